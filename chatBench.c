@@ -0,0 +1,1125 @@
+/*
+ * chat_bench: load generator and latency benchmark for ChatServer.
+ *
+ * Opens N client connections, lets P of them publish timestamped lines at a
+ * fixed total rate (or as fast as the server takes them) and measures, on all
+ * the others, how many lines arrive and how long the fanout took. The
+ * connections are opened all at once as a connect storm, which measures how
+ * fast the server accepts them. With --binary the clients switch to the
+ * server's binary framing, so the two framings can be compared, and with
+ * --compress they also ask for compressed messages: the bytes on the wire
+ * are reported next to the payload bytes, and with --admin-port the CPU time
+ * the server spent compressing. With --tls every connection does a TLS
+ * handshake after connecting, and the handshake latency is reported. The
+ * messages each read returned are reported, and with --admin-port the
+ * messages each of the server's writes carried, which shows how much a flush
+ * window (--server-args "--flush-window USECS") batches and what it costs in
+ * latency. The results are printed as one JSON object so runs can be compared.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "frame.h"
+#include "histogram.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/* Bytes a connection buffers for reading, the longest line accepted. */
+#define BENCH_IN_SIZE (64 * 1024)
+/* Publishers stop generating while this much is waiting to be sent. */
+#define BENCH_OUT_LIMIT (256 * 1024)
+/* Lines generated per publisher and round when the rate is unlimited. */
+#define BENCH_BURST 16
+/* Most lines generated per round to catch up with the schedule. */
+#define BENCH_CATCH_UP 4096
+/* Time left to the server to deliver the last lines, in seconds. */
+#define BENCH_DRAIN 1.0
+/* Smallest line: the header plus a few bytes of padding and the newline. */
+#define BENCH_MIN_SIZE 48
+/* Longest wait for the connect storm and for the server to take it all in, in ms. */
+#define BENCH_CONNECT_TIMEOUT 30000
+/* Interval of the probe lines that check every connection was accepted, in ms. */
+#define BENCH_PROBE_INTERVAL 10
+
+/*
+ * Options of a run.
+ */
+typedef struct bench_config {
+    const char *host;
+    int port;
+    /* Connections in total, publishers included. */
+    int clients;
+    int publishers;
+    /* Lines per second of all publishers together, 0 for unlimited. */
+    double rate;
+    /* Length of a line, newline included. */
+    int size;
+    /* Seconds measured, after warmup seconds that are not. */
+    double duration;
+    double warmup;
+    int threads;
+    /* Server whose RSS is reported, 0 for none. */
+    pid_t server_pid;
+    /* Server binary to start on port for the run, NULL to use a running one. */
+    const char *spawn;
+    /* Extra arguments of the spawned server, separated by spaces. */
+    const char *server_args;
+    /* Non-zero to send and receive length prefixed frames instead of lines. */
+    int binary;
+    /* Non-zero to ask for compressed messages, implies binary. */
+    int compress;
+    /* Admin port of the server, for its compression counters, 0 for none. */
+    int admin_port;
+    /* Non-zero to talk TLS to the server (whose certificate is not checked). */
+    int tls;
+} bench_config_t;
+
+/*
+ * One client connection.
+ */
+typedef struct bench_conn {
+    int fd;
+    /* TLS session with --tls, NULL otherwise. */
+    SSL *ssl;
+    /* Publisher id, -1 for a connection that only receives. */
+    int publisher;
+    /* Sequence number of the next line published. */
+    uint64_t seq;
+    /* Bytes received that do not form a complete line (or frame) yet. */
+    char *in;
+    size_t in_len;
+    /* Lines generated but not written yet. */
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    /* Non-zero once a probe line showed the server accepted the connection. */
+    int ready;
+} bench_conn_t;
+
+/*
+ * One load generating thread and the connections it drives.
+ */
+typedef struct bench_thread {
+    pthread_t thread;
+    const bench_config_t *config;
+    bench_conn_t *conns;
+    int nr_conns;
+    /* Indexes of the publishing connections in conns. */
+    int *pubs;
+    int nr_pubs;
+    /* Lines per second of this thread's publishers, 0 for unlimited. */
+    double rate;
+    /* Time from starting a connect to its completion, during the storm. */
+    histogram_t connect_latency;
+    /* Time from starting the TLS handshakes of the thread to the end of each. */
+    histogram_t handshake_latency;
+    /* Fanout latency of the lines published inside the measured window. */
+    histogram_t latency;
+    /* Lines (and their bytes) published inside the measured window. */
+    uint64_t sent;
+    uint64_t sent_bytes;
+    /* Deliveries of lines published inside the window, their bytes and the bytes they took on the wire. */
+    uint64_t received;
+    uint64_t received_bytes;
+    uint64_t wire_bytes;
+    /* Reads that returned data inside the window. */
+    uint64_t reads;
+    /* Where compressed messages are inflated, BENCH_IN_SIZE bytes. */
+    char *inflated;
+    /* Rounds in which a publisher's socket was too far behind to generate. */
+    uint64_t send_stalls;
+    /* Connections the server closed or that failed. */
+    uint64_t errors;
+} bench_thread_t;
+
+/* Monotonic times (ns) of the start and end of the measured window. */
+static uint64_t windowStart;
+static uint64_t windowEnd;
+/* Client context of the TLS connections, NULL without --tls. */
+static SSL_CTX *tlsContext;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void usageError(void) {
+    fprintf(stderr, "Usage: chat_bench [--host ADDR] [--clients N] [--publishers N] [--rate MSGS_PER_SEC]\n"
+                    "                  [--size BYTES] [--duration SECS] [--warmup SECS] [--threads N] [--binary]\n"
+                    "                  [--compress] [--admin-port PORT] [--tls]\n"
+                    "                  [--server-pid PID | --spawn PATH [--server-args ARGS]] <port>\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs(int argc, char *argv[], bench_config_t *config) {
+    static struct option longOptions[] = {
+            {"host",        required_argument, NULL, 'h'},
+            {"clients",     required_argument, NULL, 'c'},
+            {"publishers",  required_argument, NULL, 'p'},
+            {"rate",        required_argument, NULL, 'r'},
+            {"size",        required_argument, NULL, 's'},
+            {"duration",    required_argument, NULL, 'd'},
+            {"warmup",      required_argument, NULL, 'W'},
+            {"threads",     required_argument, NULL, 't'},
+            {"server-pid",  required_argument, NULL, 'P'},
+            {"spawn",       required_argument, NULL, 'S'},
+            {"server-args", required_argument, NULL, 'A'},
+            {"binary",      no_argument,       NULL, 'b'},
+            {"compress",    no_argument,       NULL, 'z'},
+            {"admin-port",  required_argument, NULL, 'a'},
+            {"tls",         no_argument,       NULL, 'T'},
+            {NULL, 0,                          NULL, 0}
+    };
+    int opt;
+    config->host = "127.0.0.1";
+    config->clients = 10;
+    config->publishers = 1;
+    config->rate = 1000;
+    config->size = 128;
+    config->duration = 5;
+    config->warmup = 1;
+    config->threads = 1;
+    config->server_pid = 0;
+    config->spawn = NULL;
+    config->server_args = NULL;
+    config->binary = 0;
+    config->compress = 0;
+    config->admin_port = 0;
+    config->tls = 0;
+    while ((opt = getopt_long(argc, argv, "h:c:p:r:s:d:W:t:P:S:A:bza:T", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                config->host = optarg;
+                break;
+            case 'c':
+                config->clients = atoi(optarg);
+                break;
+            case 'p':
+                config->publishers = atoi(optarg);
+                break;
+            case 'r':
+                config->rate = atof(optarg);
+                break;
+            case 's':
+                config->size = atoi(optarg);
+                break;
+            case 'd':
+                config->duration = atof(optarg);
+                break;
+            case 'W':
+                config->warmup = atof(optarg);
+                break;
+            case 't':
+                config->threads = atoi(optarg);
+                break;
+            case 'P':
+                config->server_pid = (pid_t) atoi(optarg);
+                break;
+            case 'S':
+                config->spawn = optarg;
+                break;
+            case 'A':
+                config->server_args = optarg;
+                break;
+            case 'b':
+                config->binary = 1;
+                break;
+            case 'z':
+                config->compress = 1;
+                config->binary = 1;
+                break;
+            case 'a':
+                config->admin_port = atoi(optarg);
+                break;
+            case 'T':
+                config->tls = 1;
+                break;
+            default:
+                usageError();
+        }
+    }
+    if (argc - optind != 1)
+        usageError();
+    config->port = atoi(argv[optind]);
+    if (config->port < 1 || config->port > 65535 || config->clients < 2 || config->publishers < 1
+        || config->publishers >= config->clients || config->rate < 0 || config->size < BENCH_MIN_SIZE
+        || config->size > BENCH_IN_SIZE - FRAME_HEADER_MAX || config->duration <= 0 || config->warmup < 0
+        || config->threads < 1 || config->admin_port < 0 || config->admin_port > 65535
+        || (config->spawn != NULL && config->server_pid != 0))
+        usageError();
+    if (config->threads > config->clients)
+        config->threads = config->clients;
+}
+
+/*
+ * Start the server binary on the benchmark port, its output is discarded.
+ * @ return value - pid of the server, -1 on failure
+ */
+static pid_t spawnServer(const bench_config_t *config) {
+    char *args[64];
+    char port[16];
+    char *extra = config->server_args != NULL ? strdup(config->server_args) : NULL;
+    int n = 0;
+    args[n++] = (char *) config->spawn;
+    args[n++] = "--log-level";
+    args[n++] = "warn";
+    for (char *save, *arg = extra != NULL ? strtok_r(extra, " ", &save) : NULL;
+         arg != NULL && n < 60; arg = strtok_r(NULL, " ", &save))
+        args[n++] = arg;
+    snprintf(port, sizeof(port), "%d", config->port);
+    args[n++] = port;
+    args[n] = NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull >= 0)
+            dup2(devNull, STDOUT_FILENO);
+        execv(config->spawn, args);
+        perror("execv");
+        _exit(127);
+    }
+    free(extra);
+    return pid;
+}
+
+static int serverAddr(const bench_config_t *config, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(config->port);
+    return inet_pton(AF_INET, config->host, &addr->sin_addr) == 1 ? SUCCESS : ERROR;
+}
+
+/*
+ * read() on a connection, through its TLS session if it has one.
+ * @ return value - as read(), -1 with errno EAGAIN while TLS waits for more records
+ */
+static ssize_t connRead(bench_conn_t *conn, char *buf, size_t len) {
+    if (conn->ssl == NULL)
+        return read(conn->fd, buf, len);
+    int n = SSL_read(conn->ssl, buf, (int) len);
+    if (n > 0)
+        return n;
+    int err = SSL_get_error(conn->ssl, n);
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    ERR_clear_error();
+    errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+    return ERROR;
+}
+
+/*
+ * write() on a connection, through its TLS session if it has one. After
+ * EAGAIN the same bytes have to be written again.
+ * @ return value - as write()
+ */
+static ssize_t connWrite(bench_conn_t *conn, const char *buf, size_t len) {
+    if (conn->ssl == NULL)
+        return write(conn->fd, buf, len);
+    int n = SSL_write(conn->ssl, buf, (int) len);
+    if (n > 0)
+        return n;
+    int err = SSL_get_error(conn->ssl, n);
+    ERR_clear_error();
+    errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+    return ERROR;
+}
+
+/*
+ * Connect one client, retrying for a while so a freshly spawned server has
+ * time to start listening.
+ * @ return value - the non-blocking socket, -1 on failure
+ */
+static int connectClient(const bench_config_t *config) {
+    struct sockaddr_in addr;
+    if (serverAddr(config, &addr) < 0)
+        return ERROR;
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return ERROR;
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            return fd;
+        }
+        close(fd);
+        if (errno != ECONNREFUSED)
+            return ERROR;
+        usleep(50 * 1000);
+    }
+    return ERROR;
+}
+
+/*
+ * Run the TLS handshakes of all connected connections of a thread at once,
+ * on the non-blocking sockets. Failed ones are closed and counted as errors.
+ */
+static void handshakeAll(bench_thread_t *t, int epfd) {
+    struct epoll_event events[256];
+    uint64_t start = nowNs();
+    int pending = 0;
+    for (int i = 0; i < t->nr_conns; i++) {
+        bench_conn_t *conn = &t->conns[i];
+        if (conn->fd < 0)
+            continue;
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u32 = (uint32_t) i;
+        if ((conn->ssl = SSL_new(tlsContext)) == NULL || SSL_set_fd(conn->ssl, conn->fd) != 1
+            || epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            t->errors++;
+            close(conn->fd);
+            conn->fd = -1;
+            continue;
+        }
+        SSL_set_connect_state(conn->ssl);
+        pending++;
+    }
+    while (pending > 0) {
+        int n = epoll_wait(epfd, events, 256, BENCH_CONNECT_TIMEOUT);
+        if (n <= 0)
+            break;
+        for (int i = 0; i < n; i++) {
+            bench_conn_t *conn = &t->conns[events[i].data.u32];
+            int ret = SSL_do_handshake(conn->ssl);
+            int err = ret == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ret);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                struct epoll_event ev;
+                ev.events = err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+                ev.data.u32 = events[i].data.u32;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+                continue;
+            }
+            epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            pending--;
+            if (err != SSL_ERROR_NONE) {
+                ERR_clear_error();
+                t->errors++;
+                SSL_free(conn->ssl);
+                conn->ssl = NULL;
+                close(conn->fd);
+                conn->fd = -1;
+                continue;
+            }
+            hist_record(&t->handshake_latency, nowNs() - start);
+        }
+    }
+    /* handshakes still pending timed out */
+    t->errors += pending;
+}
+
+/*
+ * Open all connections of a thread at once: every connect is started before
+ * the first completion is waited for, so the server gets a connect storm.
+ * Connections that fail are left with fd -1 and counted as errors.
+ */
+static void *connectThread(void *arg) {
+    bench_thread_t *t = arg;
+    struct sockaddr_in addr;
+    struct epoll_event events[256];
+    uint64_t *started = calloc(t->nr_conns, sizeof(uint64_t));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (started == NULL || epfd < 0 || serverAddr(t->config, &addr) < 0) {
+        t->errors += t->nr_conns;
+        free(started);
+        return NULL;
+    }
+    int pending = 0;
+    for (int i = 0; i < t->nr_conns; i++) {
+        bench_conn_t *conn = &t->conns[i];
+        conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (conn->fd < 0) {
+            t->errors++;
+            continue;
+        }
+        int on = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        started[i] = nowNs();
+        if (connect(conn->fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            hist_record(&t->connect_latency, nowNs() - started[i]);
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u32 = (uint32_t) i;
+        if (errno != EINPROGRESS || epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            t->errors++;
+            close(conn->fd);
+            conn->fd = -1;
+            continue;
+        }
+        pending++;
+    }
+    while (pending > 0) {
+        int n = epoll_wait(epfd, events, 256, BENCH_CONNECT_TIMEOUT);
+        if (n <= 0)
+            break;
+        uint64_t now = nowNs();
+        for (int i = 0; i < n; i++) {
+            bench_conn_t *conn = &t->conns[events[i].data.u32];
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            pending--;
+            if (err != 0) {
+                t->errors++;
+                close(conn->fd);
+                conn->fd = -1;
+                continue;
+            }
+            hist_record(&t->connect_latency, now - started[events[i].data.u32]);
+        }
+    }
+    /* connects still pending timed out */
+    t->errors += pending;
+    if (tlsContext != NULL)
+        handshakeAll(t, epfd);
+    close(epfd);
+    free(started);
+    return NULL;
+}
+
+/*
+ * Wait until the server accepted and registered every connection: a probe
+ * line published by the first connection has to reach all the others.
+ * Connections still waiting in the accept queue miss the early probes, so
+ * they are repeated. What the probes leave in the socket buffers is not a
+ * timestamped line and is ignored later.
+ * @ return value - number of connections the server did not take in time
+ */
+static int waitReady(bench_thread_t *threads, const bench_config_t *config) {
+    struct epoll_event events[256];
+    char discard[4096];
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return config->clients;
+    bench_conn_t *prober = &threads[0].conns[0];
+    for (int i = 0; i < config->threads; i++) {
+        for (int j = 0; j < threads[i].nr_conns; j++) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &threads[i].conns[j];
+            if (&threads[i].conns[j] != prober)
+                epoll_ctl(epfd, EPOLL_CTL_ADD, threads[i].conns[j].fd, &ev);
+        }
+    }
+    int waiting = config->clients - 1;
+    uint64_t deadline = nowNs() + (uint64_t) BENCH_CONNECT_TIMEOUT * 1000000;
+    while (waiting > 0 && nowNs() < deadline) {
+        if (connWrite(prober, "probe\n", 6) < 0 && errno != EAGAIN && errno != EINTR)
+            break;
+        int n = epoll_wait(epfd, events, 256, BENCH_PROBE_INTERVAL);
+        for (int i = 0; i < n; i++) {
+            bench_conn_t *conn = events[i].data.ptr;
+            while (connRead(conn, discard, sizeof(discard)) > 0) {
+                if (!conn->ready) {
+                    conn->ready = 1;
+                    waiting--;
+                }
+            }
+        }
+    }
+    close(epfd);
+    return waiting;
+}
+
+/*
+ * Switch every connection to binary framing and wait for the server to
+ * confirm each switch with its "/binary" line. Frames arriving after it
+ * (late probes) are kept for readConn().
+ * @ return value - number of connections that were not switched in time
+ */
+static int switchFraming(bench_thread_t *threads, const bench_config_t *config) {
+    struct epoll_event events[256];
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return config->clients;
+    int waiting = 0;
+    for (int i = 0; i < config->threads; i++) {
+        for (int j = 0; j < threads[i].nr_conns; j++) {
+            bench_conn_t *conn = &threads[i].conns[j];
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = conn;
+            conn->in_len = 0;
+            /* everything after the "/binary" line is read as frames already */
+            char request[64];
+            size_t len = 8;
+            memcpy(request, "/binary\n", 8);
+            if (config->compress) {
+                len += frame_header_encode(request + len, 14, FRAME_CONTROL, 0);
+                memcpy(request + len, "/compress zlib", 14);
+                len += 14;
+            }
+            if (connWrite(conn, request, len) == (ssize_t) len && epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) == 0)
+                waiting++;
+        }
+    }
+    uint64_t deadline = nowNs() + (uint64_t) BENCH_CONNECT_TIMEOUT * 1000000;
+    while (waiting > 0 && nowNs() < deadline) {
+        int n = epoll_wait(epfd, events, 256, BENCH_PROBE_INTERVAL);
+        for (int i = 0; i < n; i++) {
+            bench_conn_t *conn = events[i].data.ptr;
+            ssize_t len;
+            while ((len = connRead(conn, conn->in + conn->in_len, BENCH_IN_SIZE - conn->in_len)) > 0) {
+                conn->in_len += (size_t) len;
+                char *ack = memmem(conn->in, conn->in_len, "/binary\n", 8);
+                if (ack != NULL) {
+                    conn->in_len -= (size_t) (ack + 8 - conn->in);
+                    memmove(conn->in, ack + 8, conn->in_len);
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    waiting--;
+                    break;
+                }
+                /* probe lines, only the tail can hold the start of the answer */
+                if (conn->in_len > 7) {
+                    memmove(conn->in, conn->in + conn->in_len - 7, 7);
+                    conn->in_len = 7;
+                }
+            }
+        }
+    }
+    close(epfd);
+    return waiting;
+}
+
+/*
+ * Stop a server started with --spawn.
+ */
+static void stopServer(const bench_config_t *config, pid_t pid) {
+    if (config->spawn == NULL)
+        return;
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * Append one line "<publisher> <seq> <sent ns> xxx...\n" of config->size
+ * bytes to the output buffer of a publisher, as the payload of a frame with
+ * --binary.
+ */
+static int generateLine(bench_thread_t *t, bench_conn_t *conn, uint64_t now) {
+    int size = t->config->size;
+    if (conn->out_len + size + FRAME_HEADER_MAX > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap * 2 : 64 * 1024;
+        while (cap < conn->out_len + size + FRAME_HEADER_MAX)
+            cap *= 2;
+        char *out = realloc(conn->out, cap);
+        if (out == NULL)
+            return ERROR;
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    if (t->config->binary)
+        conn->out_len += frame_header_encode(conn->out + conn->out_len, (uint32_t) size, FRAME_MESSAGE, 0);
+    char *line = conn->out + conn->out_len;
+    int len = snprintf(line, size, "%d %llu %llu ", conn->publisher, (unsigned long long) conn->seq++,
+                       (unsigned long long) now);
+    memset(line + len, 'x', size - len - 1);
+    line[size - 1] = '\n';
+    conn->out_len += size;
+    if (now >= windowStart && now < windowEnd) {
+        t->sent++;
+        t->sent_bytes += size;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Write as much of a connection's pending output as the socket takes.
+ */
+static int flushConn(bench_conn_t *conn) {
+    size_t done = 0;
+    while (done < conn->out_len) {
+        ssize_t n = connWrite(conn, conn->out + done, conn->out_len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return ERROR;
+        }
+        done += (size_t) n;
+    }
+    memmove(conn->out, conn->out + done, conn->out_len - done);
+    conn->out_len -= done;
+    return SUCCESS;
+}
+
+/*
+ * Account for one line delivered to a receiving connection.
+ * @ wire - bytes the line took on the wire
+ */
+static void lineReceived(bench_thread_t *t, const char *line, size_t len, size_t wire, uint64_t now) {
+    char *end;
+    strtoul(line, &end, 10);
+    strtoull(end, &end, 10);
+    uint64_t sentAt = strtoull(end, &end, 10);
+    if (sentAt < windowStart || sentAt >= windowEnd)
+        return;
+    t->received++;
+    t->received_bytes += len;
+    t->wire_bytes += wire;
+    hist_record(&t->latency, now > sentAt ? now - sentAt : 0);
+}
+
+/*
+ * Count the complete frames at the start of buf, inflating the compressed
+ * ones. Commands of the server (pings, answers) are skipped.
+ * @ return value - bytes used, -1 if buf does not hold frames
+ */
+static ssize_t framesReceived(bench_thread_t *t, const char *buf, size_t len, uint64_t now) {
+    size_t used = 0;
+    frame_header_t header;
+    int headerLen;
+    while ((headerLen = frame_header_decode(buf + used, (int) (len - used), &header)) > 0
+           && header.length <= len - used - headerLen) {
+        const char *payload = buf + used + headerLen;
+        size_t wire = headerLen + header.length;
+        if (header.type == FRAME_MESSAGE && (header.flags & FRAME_COMPRESSED)) {
+            uLongf len = BENCH_IN_SIZE;
+            if (uncompress((Bytef *) t->inflated, &len, (const Bytef *) payload, header.length) != Z_OK)
+                return ERROR;
+            lineReceived(t, t->inflated, len, wire, now);
+        } else if (header.type == FRAME_MESSAGE) {
+            lineReceived(t, payload, header.length, wire, now);
+        }
+        used += wire;
+    }
+    return headerLen < 0 ? ERROR : (ssize_t) used;
+}
+
+/*
+ * Read everything available on a connection and count the complete lines.
+ */
+static int readConn(bench_thread_t *t, bench_conn_t *conn) {
+    while (1) {
+        ssize_t n = connRead(conn, conn->in + conn->in_len, BENCH_IN_SIZE - conn->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SUCCESS;
+        if (n <= 0)
+            return ERROR;
+        uint64_t now = nowNs();
+        if (now >= windowStart && now < windowEnd)
+            t->reads++;
+        conn->in_len += (size_t) n;
+        char *start = conn->in;
+        char *nl;
+        if (t->config->binary) {
+            ssize_t used = framesReceived(t, conn->in, conn->in_len, now);
+            if (used < 0)
+                return ERROR;
+            start += used;
+        } else {
+            while ((nl = memchr(start, '\n', conn->in + conn->in_len - start)) != NULL) {
+                lineReceived(t, start, (size_t) (nl - start) + 1, (size_t) (nl - start) + 1, now);
+                start = nl + 1;
+            }
+        }
+        conn->in_len -= (size_t) (start - conn->in);
+        memmove(conn->in, start, conn->in_len);
+        if (conn->in_len == BENCH_IN_SIZE) {
+            /* not a line of ours, skip it */
+            conn->in_len = 0;
+        }
+    }
+}
+
+/*
+ * Generate the lines due by now on this thread's publishers.
+ * @ next - time the next line is due, advanced by the lines generated
+ */
+static void publish(bench_thread_t *t, uint64_t now, uint64_t *next, int *turn) {
+    if (t->nr_pubs == 0 || now >= windowEnd)
+        return;
+    if (t->rate == 0) {
+        for (int i = 0; i < t->nr_pubs; i++) {
+            bench_conn_t *conn = &t->conns[t->pubs[i]];
+            if (conn->out_len > 0) {
+                t->send_stalls++;
+                continue;
+            }
+            for (int j = 0; j < BENCH_BURST; j++)
+                generateLine(t, conn, now);
+        }
+        return;
+    }
+    uint64_t interval = (uint64_t) (1e9 / t->rate);
+    for (int n = 0; *next <= now && n < BENCH_CATCH_UP; n++) {
+        bench_conn_t *conn = &t->conns[t->pubs[*turn]];
+        *turn = (*turn + 1) % t->nr_pubs;
+        if (conn->out_len >= BENCH_OUT_LIMIT)
+            t->send_stalls++;
+        else
+            generateLine(t, conn, now);
+        *next += interval;
+    }
+    if (*next <= now) {
+        /* too far behind to catch up, drop the backlog of the schedule */
+        *next = now + interval;
+    }
+}
+
+static void *runThread(void *arg) {
+    bench_thread_t *t = arg;
+    struct epoll_event events[256];
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return NULL;
+    for (int i = 0; i < t->nr_conns; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t) i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, t->conns[i].fd, &ev);
+    }
+    uint64_t next = nowNs();
+    uint64_t stop = windowEnd + (uint64_t) (BENCH_DRAIN * 1e9);
+    int turn = 0;
+    while (1) {
+        uint64_t now = nowNs();
+        if (now >= stop)
+            break;
+        publish(t, now, &next, &turn);
+        for (int i = 0; i < t->nr_pubs; i++) {
+            bench_conn_t *conn = &t->conns[t->pubs[i]];
+            if (conn->out_len > 0 && conn->fd >= 0 && flushConn(conn) < 0) {
+                t->errors++;
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+
+        /* sleep until the next line is due, a millisecond at the least */
+        int timeout = 0;
+        now = nowNs();
+        if (t->rate > 0 && next > now)
+            timeout = (int) ((next - now + 999999) / 1000000);
+        else if (t->rate == 0 || now >= windowEnd)
+            timeout = 1;
+        int n = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            bench_conn_t *conn = &t->conns[events[i].data.u32];
+            if (conn->fd >= 0 && readConn(t, conn) < 0) {
+                t->errors++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+/*
+ * Resident set size of a process from /proc.
+ * @ field - "VmRSS" for the current, "VmHWM" for the peak size
+ * @ return value - size in KB, -1 if unknown
+ */
+static long readRss(pid_t pid, const char *field) {
+    char path[64], line[256];
+    long kb = -1;
+    size_t len = strlen(field);
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/*
+ * CPU time (user and system) a process used so far, from /proc.
+ * @ return value - seconds, -1 if unknown
+ */
+static double readCpu(pid_t pid) {
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    size_t len = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[len] = '\0';
+    /* utime and stime are fields 14 and 15, counted after the command name in parentheses */
+    char *p = strrchr(stat, ')');
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return -1;
+    return (double) (utime + stime) / (double) sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Sum of the samples of a metric family on the server's admin listener.
+ * @ return value - the sum, -1 if it could not be fetched
+ */
+static double scrapeMetric(const bench_config_t *config, const char *name) {
+    struct sockaddr_in addr;
+    char *text = malloc(1 << 20);
+    size_t len = 0;
+    ssize_t n;
+    if (text == NULL || serverAddr(config, &addr) < 0) {
+        free(text);
+        return -1;
+    }
+    addr.sin_port = htons(config->admin_port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || write(fd, "GET /metrics HTTP/1.0\r\n\r\n", 26) != 26) {
+        if (fd >= 0)
+            close(fd);
+        free(text);
+        return -1;
+    }
+    while (len < (1 << 20) - 1 && (n = read(fd, text + len, (1 << 20) - 1 - len)) > 0)
+        len += (size_t) n;
+    close(fd);
+    text[len] = '\0';
+    double sum = 0;
+    size_t nameLen = strlen(name);
+    for (char *line = text, *next; line != NULL; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        if (strncmp(line, name, nameLen) != 0 || (line[nameLen] != '{' && line[nameLen] != ' '))
+            continue;
+        char *value = strchr(line, ' ');
+        if (value != NULL)
+            sum += strtod(value, NULL);
+    }
+    free(text);
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+    bench_config_t config;
+    parseArgs(argc, argv, &config);
+    signal(SIGPIPE, SIG_IGN);
+    if (config.tls) {
+        tlsContext = SSL_CTX_new(TLS_client_method());
+        if (tlsContext == NULL) {
+            fprintf(stderr, "SSL_CTX_new failed\n");
+            exit(EXIT_FAILURE);
+        }
+        /* the bench uses kTLS where the server can, a partial write leaves the rest in out */
+        SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS);
+        SSL_CTX_set_mode(tlsContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_CTX_set_verify(tlsContext, SSL_VERIFY_NONE, NULL);
+    }
+
+    pid_t serverPid = config.server_pid;
+    if (config.spawn != NULL && (serverPid = spawnServer(&config)) < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    /*************************************************************/
+    /* Connections are dealt out round robin, the publishers are */
+    /* the first ones so they spread over the threads too.       */
+    /*************************************************************/
+    bench_thread_t *threads = calloc(config.threads, sizeof(bench_thread_t));
+    if (threads == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        t->config = &config;
+        t->conns = calloc(config.clients / config.threads + 1, sizeof(bench_conn_t));
+        t->pubs = calloc(config.publishers / config.threads + 1, sizeof(int));
+        if (t->conns == NULL || t->pubs == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        hist_init(&t->latency);
+        hist_init(&t->connect_latency);
+        hist_init(&t->handshake_latency);
+        if (config.compress && (t->inflated = malloc(BENCH_IN_SIZE)) == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* a spawned server may take a moment to listen */
+    int probe = connectClient(&config);
+    if (probe < 0) {
+        fprintf(stderr, "connect %s:%d: %s\n", config.host, config.port, strerror(errno));
+        stopServer(&config, serverPid);
+        exit(EXIT_FAILURE);
+    }
+    close(probe);
+    for (int i = 0; i < config.clients; i++) {
+        bench_thread_t *t = &threads[i % config.threads];
+        bench_conn_t *conn = &t->conns[t->nr_conns];
+        conn->fd = -1;
+        conn->publisher = i < config.publishers ? i : -1;
+        conn->in = malloc(BENCH_IN_SIZE);
+        if (conn->in == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (conn->publisher >= 0)
+            t->pubs[t->nr_pubs++] = t->nr_conns;
+        t->nr_conns++;
+    }
+
+    /*************************************************************/
+    /* Connect storm: every thread starts all its connects at    */
+    /* once, then the probes tell when the server took them all. */
+    /*************************************************************/
+    uint64_t connectStart = nowNs();
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, connectThread, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t connectErrors = 0;
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        connectErrors += threads[i].errors;
+        threads[i].errors = 0;
+    }
+    double connectSecs = (double) (nowNs() - connectStart) / 1e9;
+    if (connectErrors > 0) {
+        fprintf(stderr, "%llu of %d connections to %s:%d failed\n", (unsigned long long) connectErrors,
+                config.clients, config.host, config.port);
+        stopServer(&config, serverPid);
+        exit(EXIT_FAILURE);
+    }
+    /* a backlog overflowing under the storm leaves connections the server never accepts */
+    int unaccepted = waitReady(threads, &config);
+    if (unaccepted > 0)
+        fprintf(stderr, "the server did not accept %d of %d connections\n", unaccepted, config.clients);
+    double readySecs = (double) (nowNs() - connectStart) / 1e9;
+    int unswitched = config.binary ? switchFraming(threads, &config) : 0;
+    if (unswitched > 0)
+        fprintf(stderr, "%d of %d connections did not switch to binary framing\n", unswitched, config.clients);
+
+    /* the server's counters over the run, warmup included */
+    double cpuStart = serverPid > 0 ? readCpu(serverPid) : -1;
+    double compressStart = config.admin_port > 0 ? scrapeMetric(&config, "chat_compress_seconds_total") : -1;
+    double savedStart = config.admin_port > 0 ? scrapeMetric(&config, "chat_compress_saved_bytes_total") : -1;
+    double writesStart = config.admin_port > 0 ? scrapeMetric(&config, "chat_writes_total") : -1;
+    double msgsOutStart = config.admin_port > 0 ? scrapeMetric(&config, "chat_messages_out_total") : -1;
+    windowStart = nowNs() + (uint64_t) (config.warmup * 1e9);
+    windowEnd = windowStart + (uint64_t) (config.duration * 1e9);
+    for (int i = 0; i < config.threads; i++) {
+        threads[i].rate = config.rate * threads[i].nr_pubs / config.publishers;
+        if (pthread_create(&threads[i].thread, NULL, runThread, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < config.threads; i++)
+        pthread_join(threads[i].thread, NULL);
+    double cpu = cpuStart >= 0 ? readCpu(serverPid) - cpuStart : -1;
+    double compressCpu = compressStart >= 0 ? scrapeMetric(&config, "chat_compress_seconds_total") - compressStart : -1;
+    double saved = savedStart >= 0 ? scrapeMetric(&config, "chat_compress_saved_bytes_total") - savedStart : -1;
+    double writes = writesStart >= 0 ? scrapeMetric(&config, "chat_writes_total") - writesStart : -1;
+    double msgsOut = msgsOutStart >= 0 ? scrapeMetric(&config, "chat_messages_out_total") - msgsOutStart : -1;
+    long rss = serverPid > 0 ? readRss(serverPid, "VmRSS") : -1;
+    long peakRss = serverPid > 0 ? readRss(serverPid, "VmHWM") : -1;
+
+    histogram_t latency, connectLatency, handshakeLatency;
+    hist_init(&latency);
+    hist_init(&connectLatency);
+    hist_init(&handshakeLatency);
+    uint64_t sent = 0, sentBytes = 0, received = 0, receivedBytes = 0, wireBytes = 0, reads = 0, stalls = 0, errors = 0;
+    for (int i = 0; i < config.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        hist_merge(&latency, &t->latency);
+        hist_merge(&connectLatency, &t->connect_latency);
+        hist_merge(&handshakeLatency, &t->handshake_latency);
+        sent += t->sent;
+        sentBytes += t->sent_bytes;
+        received += t->received;
+        receivedBytes += t->received_bytes;
+        wireBytes += t->wire_bytes;
+        reads += t->reads;
+        stalls += t->send_stalls;
+        errors += t->errors;
+        for (int j = 0; j < t->nr_conns; j++) {
+            if (t->conns[j].ssl != NULL)
+                SSL_free(t->conns[j].ssl);
+            if (t->conns[j].fd >= 0)
+                close(t->conns[j].fd);
+            free(t->conns[j].in);
+            free(t->conns[j].out);
+        }
+        free(t->conns);
+        free(t->pubs);
+        free(t->inflated);
+    }
+    free(threads);
+    SSL_CTX_free(tlsContext);
+    stopServer(&config, serverPid);
+
+    uint64_t expected = sent * (uint64_t) (config.clients - 1);
+    printf("{\n");
+    printf("  \"clients\": %d,\n  \"publishers\": %d,\n  \"threads\": %d,\n", config.clients, config.publishers,
+           config.threads);
+    printf("  \"rate\": %.0f,\n  \"size\": %d,\n  \"duration_s\": %.3f,\n", config.rate, config.size, config.duration);
+    printf("  \"framing\": \"%s\",\n  \"compress\": %s,\n  \"tls\": %s,\n", config.binary ? "binary" : "line",
+           config.compress ? "true" : "false", config.tls ? "true" : "false");
+    printf("  \"connect_s\": %.3f,\n  \"connects_per_sec\": %.1f,\n", connectSecs, config.clients / connectSecs);
+    printf("  \"connect_latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+           hist_percentile(&connectLatency, 0.5) / 1e3, hist_percentile(&connectLatency, 0.99) / 1e3,
+           connectLatency.max / 1e3);
+    printf("  \"handshake_latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+           hist_percentile(&handshakeLatency, 0.5) / 1e3, hist_percentile(&handshakeLatency, 0.99) / 1e3,
+           handshakeLatency.max / 1e3);
+    printf("  \"ready_s\": %.3f,\n  \"accepts_per_sec\": %.1f,\n", readySecs, config.clients / readySecs);
+    printf("  \"unaccepted\": %d,\n", unaccepted);
+    printf("  \"sent_msgs\": %llu,\n  \"sent_msgs_per_sec\": %.1f,\n", (unsigned long long) sent,
+           (double) sent / config.duration);
+    printf("  \"sent_bytes_per_sec\": %.1f,\n", (double) sentBytes / config.duration);
+    printf("  \"delivered_msgs\": %llu,\n  \"delivery_ratio\": %.6f,\n", (unsigned long long) received,
+           expected > 0 ? (double) received / (double) expected : 0.0);
+    printf("  \"msgs_per_sec\": %.1f,\n  \"bytes_per_sec\": %.1f,\n", (double) received / config.duration,
+           (double) receivedBytes / config.duration);
+    printf("  \"wire_bytes_per_sec\": %.1f,\n  \"wire_ratio\": %.4f,\n", (double) wireBytes / config.duration,
+           receivedBytes > 0 ? (double) wireBytes / (double) receivedBytes : 0.0);
+    printf("  \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f},\n",
+           hist_percentile(&latency, 0.5) / 1e3, hist_percentile(&latency, 0.99) / 1e3,
+           hist_percentile(&latency, 0.999) / 1e3, latency.max / 1e3,
+           latency.total > 0 ? (double) latency.sum / (double) latency.total / 1e3 : 0.0);
+    printf("  \"reads\": %llu,\n  \"msgs_per_read\": %.2f,\n", (unsigned long long) reads,
+           reads > 0 ? (double) received / (double) reads : 0.0);
+    printf("  \"send_stalls\": %llu,\n  \"errors\": %llu,\n", (unsigned long long) stalls,
+           (unsigned long long) errors);
+    printf("  \"server_cpu_s\": %.3f,\n  \"server_compress_cpu_s\": %.6f,\n", cpu, compressCpu);
+    printf("  \"server_compress_saved_bytes\": %.0f,\n", saved);
+    printf("  \"server_writes\": %.0f,\n  \"server_msgs_per_write\": %.2f,\n", writes,
+           writes > 0 ? msgsOut / writes : -1.0);
+    printf("  \"server_rss_kb\": %ld,\n  \"server_peak_rss_kb\": %ld\n", rss, peakRss);
+    printf("}\n");
+    return 0;
+}
@@ -1,322 +1,2976 @@
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include "chatServer.h"
+#include "log.h"
+#include "worker.h"
 
 #define SUCCESS 0
 #define ERROR (-1)
 
-static int end_server = 0;
+/* Most messages gathered into a single writev(). */
+#define WRITEV_BATCH IOV_MAX
+/* Most messages gathered into one submitted write of a completion backend. */
+#define SUBMIT_BATCH 64
+/*
+ * Most connections accepted per loop iteration, so a connect storm cannot
+ * starve the clients already connected. The rest waits for the next one.
+ */
+#define ACCEPT_BUDGET 64
 
-void intHandler(int SIG_INT) {
+/* Default outbound queue bounds. */
+#define DEFAULT_QUEUE_BYTES (16 * 1024 * 1024)
+#define DEFAULT_QUEUE_MSGS 65536
+#define DEFAULT_QUEUE_BUDGET ((size_t) 1024 * 1024 * 1024)
+/* Address of the metrics listener unless --admin-addr says otherwise: this host only. */
+#define DEFAULT_ADMIN_ADDR "127.0.0.1"
+/*
+ * How often a worker with paused publishers looks at the global budget, which
+ * the other workers drain without waking it.
+ */
+#define PAUSE_POLL_MS 10
+/* Line sent to idle connections when pings are on, answered with "/pong". */
+#define PING_LINE "/ping\n"
+/* Bytes of history kept per room by default once --history is given. */
+#define DEFAULT_HISTORY_BYTES (64 * 1024)
+/* Largest frame a binary client may send by default, and at all. */
+#define DEFAULT_MAX_FRAME (1024 * 1024)
+#define MAX_FRAME_LIMIT (1024 * 1024 * 1024)
+/* Line a client sends to switch to binary framing, echoed before the first frame. */
+#define BINARY_LINE "/binary\n"
+/* Default zlib level and smallest message compressed for clients that ask. */
+#define DEFAULT_COMPRESS_LEVEL 1
+#define DEFAULT_COMPRESS_MIN 512
+#define NS_PER_SEC 1000000000ULL
+/* Bytes queued for a connection that end its flush window early, by default. */
+#define DEFAULT_FLUSH_BYTES (16 * 1024)
+/* What a connection may publish at once over its rate: a second's worth. */
+#define RATE_BURST_NS NS_PER_SEC
+
+static atomic_int end_server = 0;
+/* eventfd of the worker on the main thread, -1 until it exists. */
+static int signalWakeFd = -1;
+
+/*
+ * Make the workers stop, from a signal handler or any thread.
+ */
+void stopServer(void) {
     /* use a flag to end_server to break the main loop */
     end_server = 1;
+    /* the signal may have come just before the wait, which would miss the flag */
+    int savedErrno = errno;
+    uint64_t one = 1;
+    if (signalWakeFd >= 0)
+        (void) write(signalWakeFd, &one, sizeof(one));
+    errno = savedErrno;
+}
+
+void intHandler(int SIG_INT) {
+    stopServer();
 }
 
 void UsageError() {
-    printf("Usage: server <port>");
+    printf("Usage: server [--backend epoll|select|io_uring] [--workers N] [--queue-bytes SIZE]\n"
+           "              [--queue-msgs N] [--queue-budget SIZE]\n"
+           "              [--slow-policy disconnect|drop-oldest|drop-newest|pause]\n"
+           "              [--log-level debug|info|warn|error|off] [--admin-port PORT [--admin-addr ADDR]]\n"
+           "              [--backlog N] [--defer-accept SECS] [--idle-timeout SECS]\n"
+           "              [--ping-interval SECS] [--write-timeout SECS] [--history N]\n"
+           "              [--history-bytes SIZE] [--max-frame SIZE] [--rate-msgs N] [--rate-bytes SIZE]\n"
+           "              [--flush-window USECS] [--flush-bytes SIZE]\n"
+           "              [--compress-level 0-9] [--compress-min SIZE] [--tls-cert FILE --tls-key FILE]\n"
+           "              [--ws-port PORT] [--node-id ID [--peer-port PORT] [--peer HOST:PORT]...\n"
+           "              [--peer-addr ADDR] [--peer-secret FILE]]\n"
+           "              [--journal DIR [--journal-sync MS] [--journal-sync-bytes SIZE]\n"
+           "              [--journal-segment SIZE] [--journal-keep N]] [--handoff PATH]\n"
+           "              <port>\n");
     exit(EXIT_FAILURE);
 }
 
-int checkForErrors(int argc, char *argv[]) {
-    if (argc != 2)
+/*
+ * Parse a byte count with an optional K, M or G suffix.
+ * @ return value - the size, 0 if arg is not a valid size
+ */
+size_t parseSize(const char *arg) {
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+    switch (*end) {
+        case 'G':
+        case 'g':
+            size *= 1024;
+            /* fall through */
+        case 'M':
+        case 'm':
+            size *= 1024;
+            /* fall through */
+        case 'K':
+        case 'k':
+            size *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    return (*end == '\0' && end != arg) ? (size_t) size : 0;
+}
+
+/*
+ * Parse a duration in (fractional) seconds.
+ * @ return value - 0 on success, -1 if arg is not a valid duration
+ */
+int parseSeconds(const char *arg, uint64_t *ns) {
+    char *end;
+    double secs = strtod(arg, &end);
+    if (*end != '\0' || end == arg || secs < 0)
+        return ERROR;
+    *ns = (uint64_t) (secs * 1e9);
+    return SUCCESS;
+}
+
+void checkForErrors(int argc, char *argv[], server_config_t *config) {
+    static struct option longOptions[] = {
+            {"backend",      required_argument, NULL, 'b'},
+            {"workers",      required_argument, NULL, 'w'},
+            {"queue-bytes",  required_argument, NULL, 'Q'},
+            {"queue-msgs",   required_argument, NULL, 'M'},
+            {"queue-budget", required_argument, NULL, 'G'},
+            {"slow-policy",  required_argument, NULL, 'P'},
+            {"log-level",    required_argument, NULL, 'L'},
+            {"admin-port",   required_argument, NULL, 'A'},
+            {"admin-addr",   required_argument, NULL, 'a'},
+            {"backlog",      required_argument, NULL, 'B'},
+            {"defer-accept", required_argument, NULL, 'D'},
+            {"idle-timeout", required_argument, NULL, 'I'},
+            {"ping-interval", required_argument, NULL, 'N'},
+            {"write-timeout", required_argument, NULL, 'W'},
+            {"history",      required_argument, NULL, 'H'},
+            {"history-bytes", required_argument, NULL, 'Y'},
+            {"max-frame",    required_argument, NULL, 'F'},
+            {"rate-msgs",    required_argument, NULL, 'R'},
+            {"rate-bytes",   required_argument, NULL, 'T'},
+            {"flush-window", required_argument, NULL, 'X'},
+            {"flush-bytes",  required_argument, NULL, 'V'},
+            {"compress-level", required_argument, NULL, 'Z'},
+            {"compress-min", required_argument, NULL, 'z'},
+            {"tls-cert",     required_argument, NULL, 'C'},
+            {"tls-key",      required_argument, NULL, 'K'},
+            {"ws-port",      required_argument, NULL, 'S'},
+            {"node-id",      required_argument, NULL, 'n'},
+            {"peer-port",    required_argument, NULL, 'p'},
+            {"peer",         required_argument, NULL, 'e'},
+            {"peer-addr",    required_argument, NULL, 'l'},
+            {"peer-secret",  required_argument, NULL, 's'},
+            {"journal",      required_argument, NULL, 'j'},
+            {"journal-sync", required_argument, NULL, 'y'},
+            {"journal-sync-bytes", required_argument, NULL, 'u'},
+            {"journal-segment", required_argument, NULL, 'g'},
+            {"journal-keep", required_argument, NULL, 'k'},
+            {"handoff",      required_argument, NULL, 'O'},
+            {NULL, 0,                           NULL, 0}
+    };
+    static const char *policies[] = {"disconnect", "drop-oldest", "drop-newest", "pause"};
+    int opt;
+    config->backend = NULL;
+    config->workers = 1;
+    config->queue_max_bytes = DEFAULT_QUEUE_BYTES;
+    config->queue_max_msgs = DEFAULT_QUEUE_MSGS;
+    config->queue_budget = DEFAULT_QUEUE_BUDGET;
+    config->slow_policy = SLOW_DISCONNECT;
+    config->admin_port = 0;
+    config->admin_addr = DEFAULT_ADMIN_ADDR;
+    config->backlog = SOMAXCONN;
+    config->defer_accept = 0;
+    config->timeouts.idle = 0;
+    config->timeouts.ping = 0;
+    config->timeouts.write_stall = 0;
+    config->history_msgs = 0;
+    config->history_bytes = DEFAULT_HISTORY_BYTES;
+    config->max_frame = DEFAULT_MAX_FRAME;
+    config->rate_msgs = 0;
+    config->rate_bytes = 0;
+    config->flush_window = 0;
+    config->flush_bytes = DEFAULT_FLUSH_BYTES;
+    config->compress_level = DEFAULT_COMPRESS_LEVEL;
+    config->compress_min = DEFAULT_COMPRESS_MIN;
+    config->tls_cert = NULL;
+    config->tls_key = NULL;
+    config->ws_port = 0;
+    config->federation.node_id = 0;
+    config->federation.port = 0;
+    config->federation.addr = FED_DEFAULT_ADDR;
+    config->federation.secret_file = NULL;
+    config->federation.nr_peers = 0;
+    config->journal.dir = NULL;
+    config->journal.sync_ms = JOURNAL_SYNC_MS;
+    config->journal.sync_bytes = JOURNAL_SYNC_BYTES;
+    config->journal.segment_bytes = JOURNAL_SEGMENT_BYTES;
+    config->journal.keep = JOURNAL_KEEP;
+    config->handoff = NULL;
+    while ((opt = getopt_long(argc, argv, "b:w:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                config->backend = optarg;
+                break;
+            case 'w':
+                config->workers = atoi(optarg);
+                if (config->workers < 1 || config->workers > 1024)
+                    UsageError();
+                break;
+            case 'Q':
+                if ((config->queue_max_bytes = parseSize(optarg)) == 0)
+                    UsageError();
+                break;
+            case 'M':
+                config->queue_max_msgs = atoi(optarg);
+                if (config->queue_max_msgs < 1)
+                    UsageError();
+                break;
+            case 'G':
+                /* 0 turns the budget off */
+                config->queue_budget = parseSize(optarg);
+                if (config->queue_budget == 0 && strcmp(optarg, "0") != 0)
+                    UsageError();
+                break;
+            case 'P': {
+                int nrPolicies = (int) (sizeof(policies) / sizeof(policies[0]));
+                int policy = 0;
+                while (policy < nrPolicies && strcmp(optarg, policies[policy]) != 0)
+                    policy++;
+                if (policy == nrPolicies)
+                    UsageError();
+                config->slow_policy = (slow_policy_t) policy;
+                break;
+            }
+            case 'L':
+                if (log_parse_level(optarg, &log_level) < 0)
+                    UsageError();
+                break;
+            case 'A':
+                config->admin_port = atoi(optarg);
+                if (config->admin_port < 1 || config->admin_port > 65535)
+                    UsageError();
+                break;
+            case 'a': {
+                struct in_addr ignored;
+                if (inet_pton(AF_INET, optarg, &ignored) != 1)
+                    UsageError();
+                config->admin_addr = optarg;
+                break;
+            }
+            case 'B':
+                /* the kernel caps it at net.core.somaxconn */
+                config->backlog = atoi(optarg);
+                if (config->backlog < 1)
+                    UsageError();
+                break;
+            case 'D':
+                config->defer_accept = atoi(optarg);
+                if (config->defer_accept < 0)
+                    UsageError();
+                break;
+            case 'I':
+                if (parseSeconds(optarg, &config->timeouts.idle) < 0)
+                    UsageError();
+                break;
+            case 'N':
+                if (parseSeconds(optarg, &config->timeouts.ping) < 0)
+                    UsageError();
+                break;
+            case 'W':
+                if (parseSeconds(optarg, &config->timeouts.write_stall) < 0)
+                    UsageError();
+                break;
+            case 'H':
+                config->history_msgs = atoi(optarg);
+                if (config->history_msgs < 0)
+                    UsageError();
+                break;
+            case 'Y':
+                if ((config->history_bytes = parseSize(optarg)) == 0)
+                    UsageError();
+                break;
+            case 'F': {
+                size_t size = parseSize(optarg);
+                if (size == 0 || size > MAX_FRAME_LIMIT)
+                    UsageError();
+                config->max_frame = (uint32_t) size;
+                break;
+            }
+            case 'R': {
+                /* 0 turns the limit off */
+                long rate = atol(optarg);
+                if (rate < 0 || rate > 1000000000 || !isdigit((unsigned char) *optarg))
+                    UsageError();
+                config->rate_msgs = (uint32_t) rate;
+                break;
+            }
+            case 'T':
+                config->rate_bytes = parseSize(optarg);
+                if ((config->rate_bytes == 0 && strcmp(optarg, "0") != 0) || config->rate_bytes > MAX_FRAME_LIMIT)
+                    UsageError();
+                break;
+            case 'X': {
+                /* 0 writes every loop iteration, as without the option */
+                long usecs = atol(optarg);
+                if (usecs < 0 || usecs > 1000000 || !isdigit((unsigned char) *optarg))
+                    UsageError();
+                config->flush_window = (uint64_t) usecs * 1000;
+                break;
+            }
+            case 'V':
+                config->flush_bytes = parseSize(optarg);
+                if (config->flush_bytes == 0)
+                    UsageError();
+                break;
+            case 'Z':
+                /* 0 keeps compression off */
+                config->compress_level = atoi(optarg);
+                if (config->compress_level < 0 || config->compress_level > 9 || !isdigit((unsigned char) *optarg))
+                    UsageError();
+                break;
+            case 'z': {
+                size_t size = parseSize(optarg);
+                if (size < 2 || size > MAX_FRAME_LIMIT)
+                    UsageError();
+                config->compress_min = (int) size;
+                break;
+            }
+            case 'C':
+                config->tls_cert = optarg;
+                break;
+            case 'K':
+                config->tls_key = optarg;
+                break;
+            case 'S':
+                config->ws_port = atoi(optarg);
+                if (config->ws_port < 1 || config->ws_port > 65535)
+                    UsageError();
+                break;
+            case 'n': {
+                char *end;
+                unsigned long id = strtoul(optarg, &end, 10);
+                if (*end != '\0' || id == 0 || id > UINT32_MAX)
+                    UsageError();
+                config->federation.node_id = (uint32_t) id;
+                break;
+            }
+            case 'p':
+                config->federation.port = atoi(optarg);
+                if (config->federation.port < 1 || config->federation.port > 65535)
+                    UsageError();
+                break;
+            case 'e':
+                if (config->federation.nr_peers == FED_MAX_PEERS || strrchr(optarg, ':') == NULL)
+                    UsageError();
+                config->federation.peers[config->federation.nr_peers++] = optarg;
+                break;
+            case 'l': {
+                struct in_addr ignored;
+                if (inet_pton(AF_INET, optarg, &ignored) != 1)
+                    UsageError();
+                config->federation.addr = optarg;
+                break;
+            }
+            case 's':
+                config->federation.secret_file = optarg;
+                break;
+            case 'j':
+                config->journal.dir = optarg;
+                break;
+            case 'y':
+                /* 0 syncs as soon as the sync thread gets to it */
+                config->journal.sync_ms = atoi(optarg);
+                if (config->journal.sync_ms < 0 || !isdigit((unsigned char) *optarg))
+                    UsageError();
+                break;
+            case 'u':
+                if ((config->journal.sync_bytes = parseSize(optarg)) == 0)
+                    UsageError();
+                break;
+            case 'g':
+                /* at least a page, at most what a 32 bit record size can describe */
+                config->journal.segment_bytes = parseSize(optarg);
+                if (config->journal.segment_bytes < 4096 || config->journal.segment_bytes > UINT32_MAX)
+                    UsageError();
+                break;
+            case 'k':
+                config->journal.keep = atoi(optarg);
+                if (config->journal.keep < 1)
+                    UsageError();
+                break;
+            case 'O':
+                config->handoff = optarg;
+                break;
+            default:
+                UsageError();
+        }
+    }
+    if (argc - optind != 1 || (config->tls_cert == NULL) != (config->tls_key == NULL))
+        UsageError();
+    /* peer links need the id that marks this node's messages */
+    if ((config->federation.port > 0 || config->federation.nr_peers > 0) != (config->federation.node_id != 0))
         UsageError();
-    int port = atoi(argv[1]);
-    if (port < 1 || port > 65535)
+    config->port = atoi(argv[optind]);
+    if (config->port < 1 || config->port > 65535 || config->port == config->ws_port)
         UsageError();
-    return port;
 }
 
 void removeAllConnectionsLeft(conn_pool_t *pool) {
 
-    conn_t *cur = pool->conn_head;
-    while (cur != NULL) {
-        conn_t *next = cur->next;
-        free(cur);
-        cur = next;
+    while (pool->nr_conns > 0)
+        remove_conn(pool->conns[pool->nr_conns - 1]->fd, pool);
+
+    /* writes still in flight were cancelled, wait for them to come back */
+    for (int tries = 0; pool->nr_zombies > 0 && tries < 50; tries++) {
+        int n = pool->backend->wait(pool->backend, pool->events, MAX_EVENTS, 100000);
+        for (int i = 0; i < n; i++) {
+            if (pool->events[i].events & EV_WRITTEN)
+                write_completed(pool->events[i].ptr, pool->events[i].res, pool);
+        }
     }
+}
 
+void acceptedConnection(int newSD, int framing, conn_pool_t *pool) {
+    log_info("New incoming %sconnection on sd %d", framing == FRAMING_HTTP ? "WebSocket " : "", newSD);
+    if (add_conn(newSD, framing, pool) < 0)
+        close(newSD);
 }
 
-int main(int argc, char *argv[]) {
-    int port = checkForErrors(argc, argv);
-    signal(SIGINT, intHandler);
+/*
+ * Accept pending connections until accept4() reports there is nothing left,
+ * or ACCEPT_BUDGET of them were accepted. The listening socket may be
+ * edge-triggered, so the caller has to come back for the rest without
+ * waiting for another notification.
+ * @ framing - framing the connections start out with, see add_conn()
+ * @ return value - non-zero if the budget ran out first
+ */
+int acceptConnections(int mainSD, int framing, conn_pool_t *pool) {
+    for (int accepted = 0; accepted < ACCEPT_BUDGET; accepted++) {
+        /* non-blocking from the start, saves a system call per connection */
+        int newSD = accept4(mainSD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newSD < 0) {
+            /* the connection failed while it waited in the queue, take the next one */
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("accept: %m");
+            return 0;
+        }
+        acceptedConnection(newSD, framing, pool);
+    }
+    return 1;
+}
+
+/*
+ * The client is gone, pass on a last line that had no newline if it closed
+ * cleanly, then remove it.
+ */
+void closeConnection(int sd, int cleanly, conn_pool_t *pool) {
+    conn_t *conn = find_conn(sd, pool);
+    const char *line;
+    int len;
+    if (conn == NULL)
+        return;
+    /* a frame cut short is dropped with the connection */
+    if (cleanly && conn->framing == FRAMING_LINE
+        && (len = line_buffer_next(&conn->input, &line, pool->line_scratch, 1)) > 0)
+        add_msg(sd, line, len, pool);
+    log_info("Connection closed for sd %d", sd);
+    remove_conn(sd, pool);
+}
+
+/*
+ * Read into the free space of the input ring of conn, through OpenSSL unless
+ * the kernel decrypts.
+ * @ return value - as line_buffer_read()
+ */
+ssize_t readInput(conn_t *conn) {
+    if (!conn->tls_read)
+        return line_buffer_read(&conn->input, conn->fd);
+    char *space;
+    int room = line_buffer_space(&conn->input, &space);
+    if (room <= 0) {
+        errno = room == 0 ? ENOBUFS : ENOMEM;
+        return ERROR;
+    }
+    ssize_t length = tls_read(conn->ssl, space, room);
+    if (length > 0)
+        line_buffer_commit(&conn->input, (int) length);
+    return length;
+}
 
-    conn_pool_t *pool = malloc(sizeof(conn_pool_t));
-    init_pool(pool);
-    char buffer[BUFFER_SIZE];
+/*
+ * Pass on the complete lines (or frames) in the input ring of conn, until
+ * it goes over its ingest rate.
+ * @ return value - 0 on success, -1 if conn broke the protocol and has to go
+ */
+int dispatchInput(conn_t *conn, conn_pool_t *pool) {
+    const char *line;
+    int len;
+    /* "/binary" switches the framing in the middle of the ring */
+    while (conn->framing == FRAMING_LINE && !conn->throttled
+           && (len = line_buffer_next(&conn->input, &line, pool->line_scratch, 0)) > 0)
+        add_msg(conn->fd, line, len, pool);
+    if (conn->framing != FRAMING_LINE)
+        return drain_frames(conn, pool);
+    return SUCCESS;
+}
+
+/*
+ * Read everything available on sd and queue each complete line (or frame) to
+ * the other connections, or take the upgrade request of a WebSocket client.
+ * Lines are handed to add_msg as views into the input ring, the payload of a
+ * frame is read into its body.
+ * @ return value - 0 while the connection is alive, -1 once it was removed
+ */
+int readFromClient(int sd, conn_pool_t *pool) {
+    conn_t *conn = find_conn(sd, pool);
+    if (conn == NULL)
+        return ERROR;
+    const char *line;
+    int len;
+    if (conn->handshaking) {
+        if (continue_handshake(conn, pool) < 0) {
+            remove_conn(sd, pool);
+            return ERROR;
+        }
+        /* records that came with the end of the handshake are read right away */
+        if (conn->handshaking)
+            return SUCCESS;
+    }
+    while (1) {
+        /***************************************************/
+        /* This is not the listening socket, therefore an  */
+        /* existing connection must be readable.           */
+        /***************************************************/
+        if (conn->paused || conn->throttled) {
+            /* leave the rest in the socket buffer until resume_publishers(), or the rate timer */
+            return SUCCESS;
+        }
+        ssize_t length;
+        if (conn->partial != NULL) {
+            /* the rest of a payload skips the ring, however large it is */
+            msg_body_t *body = conn->partial;
+            char *rest = body->data + conn->partial_len;
+            length = conn->tls_read ? tls_read(conn->ssl, rest, body->size - conn->partial_len)
+                                    : read(sd, rest, body->size - conn->partial_len);
+            if (length > 0)
+                conn->partial_len += (int) length;
+        } else {
+            length = readInput(conn);
+        }
+        if (length > 0) {
+            conn->last_read = pool->now;
+            log_debug("%zd bytes read from %d", length, sd);
+            if (dispatchInput(conn, pool) < 0) {
+                remove_conn(sd, pool);
+                return ERROR;
+            }
+            continue;
+        }
+        if (length < 0 && errno == ENOBUFS) {
+            /* the line does not fit in the ring, pass on what we have of it */
+            len = line_buffer_next(&conn->input, &line, pool->line_scratch, 1);
+            add_msg(sd, line, len, pool);
+            continue;
+        }
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SUCCESS;
+        closeConnection(sd, length == 0, pool);
+        return ERROR;
+    }
+}
 
-    int mainSD = socket(AF_INET, SOCK_STREAM, 0);
+/*
+ * Create a non-blocking listening socket on port. With several workers every
+ * one of them binds its own socket to the same port with SO_REUSEPORT.
+ * @ return value - the socket, -1 on failure
+ */
+int createListener(const server_config_t *config, int port, int reusePort) {
+    int mainSD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mainSD < 0) {
+        perror("socket");
+        return ERROR;
+    }
     int on = 1;
+    /* restart right away, even with connections of the last run in TIME_WAIT */
+    if (setsockopt(mainSD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+        || (reusePort && setsockopt(mainSD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)) {
+        perror("setsockopt");
+        close(mainSD);
+        return ERROR;
+    }
     /*************************************************************/
-    /* Set socket to be nonblocking. All of the sockets for      */
-    /* the incoming connections will also be nonblocking since   */
-    /* they will inherit that state from the listening socket.   */
+    /* Accepted sockets inherit TCP_NODELAY from the listener,   */
+    /* so it costs no call per connection. Lines are gathered    */
+    /* into one writev() anyway, Nagle would only delay them.    */
     /*************************************************************/
+    if (setsockopt(mainSD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        log_warn("TCP_NODELAY: %m");
+    /* only hand over connections once they sent something, or the timeout passed */
+    if (config->defer_accept > 0
+        && setsockopt(mainSD, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config->defer_accept, sizeof(int)) < 0)
+        log_warn("TCP_DEFER_ACCEPT: %m");
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
-    ioctl(mainSD, FIONBIO, (char *) &on);
     if (0 > bind(mainSD, (struct sockaddr *) &server_addr, sizeof(server_addr))) {
         perror("bind");
-        exit(EXIT_FAILURE);
+        close(mainSD);
+        return ERROR;
     }
 
     /*************************************************************/
     /* Set the listen back log                                   */
     /*************************************************************/
-    listen(mainSD, 5);
-    FD_SET(mainSD, &pool->read_set);
-    FD_SET(mainSD, &pool->write_set);
-    pool->maxfd = mainSD;
+    if (listen(mainSD, config->backlog) < 0) {
+        perror("listen");
+        close(mainSD);
+        return ERROR;
+    }
+    return mainSD;
+}
 
-    /*************************************************************/
-    /* Initialize fd_sets  			                             */
-    /*************************************************************/
+/*
+ * Take the listeners on port handed over by the server taken over from, in
+ * place of new ones. Those left over, or on another port, are closed: the
+ * connections waiting in their accept queues are lost.
+ * @ fds - set to the listeners taken, up to max
+ * @ return value - number of listeners taken
+ */
+int takeListeners(handoff_buf_t *buf, int port, int *fds, int max) {
+    int taken = 0;
+    uint32_t nr = handoff_get32(buf);
+    for (uint32_t i = 0; i < nr && !buf->failed; i++) {
+        int fd = handoff_get_fd(buf);
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (fd < 0)
+            continue;
+        if (taken < max && getsockname(fd, (struct sockaddr *) &addr, &len) == 0 && ntohs(addr.sin_port) == port)
+            fds[taken++] = fd;
+        else
+            close(fd);
+    }
+    if ((uint32_t) taken < nr)
+        log_warn("closed %u listener(s) of the old server, run as many workers on the same ports to keep them",
+                 nr - (uint32_t) taken);
+    return taken;
+}
+
+/*
+ * Put the listeners of group in buf, the main ones then those of the
+ * WebSocket port, for takeListeners().
+ */
+void putListeners(handoff_buf_t *buf, worker_group_t *group) {
+    handoff_put32(buf, (uint32_t) group->nr_workers);
+    for (int i = 0; i < group->nr_workers; i++)
+        handoff_put_fd(buf, group->workers[i].listen_sd);
+    handoff_put32(buf, group->workers[0].ws_listen_sd >= 0 ? (uint32_t) group->nr_workers : 0);
+    for (int i = 0; i < group->nr_workers && group->workers[i].ws_listen_sd >= 0; i++)
+        handoff_put_fd(buf, group->workers[i].ws_listen_sd);
+}
+
+/*
+ * How long the backend wait may block: not at all while connections are left
+ * to accept, else until the next tick of the timer wheel, only briefly while
+ * publishers are paused, and no longer than the flush window left.
+ * @ return value - microseconds, -1 for no limit
+ */
+long waitTimeout(worker_t *w) {
+    conn_pool_t *pool = w->pool;
+    if (w->accept_pending || w->ws_accept_pending)
+        return 0;
+    uint64_t now = metrics_now();
+    int ms = wheel_timeout(&pool->timers, now);
+    long timeout = ms < 0 ? -1 : (long) ms * 1000;
+    if (pool->nr_paused > 0 && (timeout < 0 || timeout > PAUSE_POLL_MS * 1000))
+        timeout = PAUSE_POLL_MS * 1000;
+    if (pool->limits->flush_window > 0 && pool->nr_flush > 0) {
+        /* rounded up, waking before the deadline would only wait again */
+        long left = pool->flush_deadline > now ? (long) ((pool->flush_deadline - now + 999) / 1000) : 0;
+        if (timeout < 0 || timeout > left)
+            timeout = left;
+    }
+    return timeout;
+}
+
+/*
+ * Event loop of one worker, runs until Control-C.
+ */
+void *runWorker(void *arg) {
+    worker_t *w = arg;
+    conn_pool_t *pool = w->pool;
+    arena_set_current(&pool->arena);
+    event_backend_t *backend = pool->backend;
+    int mainSD = w->listen_sd;
 
     /*************************************************************/
     /* Loop waiting for incoming connects, for incoming data or  */
     /* to write data, on any of the connected sockets.           */
     /*************************************************************/
     do {
+        log_debug("Worker %d waiting on %s()... Connections %u", w->id, backend->name, pool->nr_conns);
         /**********************************************************/
-        /* Copy the master fd_set over to the working fd_set.     */
-        /**********************************************************/
-        pool->ready_read_set = pool->read_set;
-        pool->ready_write_set = pool->write_set;
-
-        printf("Waiting on select()...\nMaxFd %d\n", pool->maxfd);
-        /**********************************************************/
-        /* Call select() and get next fd 										  */
+        /* Wait for ready descriptors, only those are visited.    */
         /**********************************************************/
-        pool->nready = select(pool->maxfd + 1, &pool->ready_read_set, &pool->ready_write_set, NULL, NULL);
+        pool->nready = backend->wait(backend, pool->events, MAX_EVENTS, waitTimeout(w));
         if (pool->nready < 0) {
-            perror("select");
-            //free all memory
-            exit(EXIT_FAILURE);
+            log_error("%s: %m", backend->name);
+            break;
         }
+        pool->now = metrics_now();
 
-        for (int i = mainSD; i <= pool->maxfd ; i++) {
-
-            if (FD_ISSET(i, &pool->ready_read_set)) {
-
-                if (i == mainSD) {
-                    int newSD = accept(mainSD, NULL, NULL);
-                    if (newSD < 0)
-                        continue;
-                    printf("New incoming connection on sd %d\n", i);
-                    add_conn(newSD, pool);
-                    break;
-                } else {
-                    /***************************************************/
-                    /* This is not the listening socket, therefore an  */
-                    /* existing connection must be readable.           */
-                    /***************************************************/
-                    printf("Descriptor %d is readable\n", i);
-                    size_t length = read(i, buffer, BUFFER_SIZE);
-                    printf("%lu bytes read from %d\n", length, i);
-                    if (length == 0) {
-                        printf("Connection closed for sd %d\n", i);
-                        printf("removing connection with sd %d\n", i);
-                        remove_conn(i, pool);
-                        break;
-                    } else {
-                        add_msg(i, buffer, (int) length, pool);
-                    }
-                }
+        for (int i = 0; i < pool->nready; i++) {
+            int sd = pool->events[i].fd;
+            int events = pool->events[i].events;
+
+            /* completion backends did the I/O already, only the results are left */
+            if (events & EV_WRITTEN) {
+                write_completed(pool->events[i].ptr, pool->events[i].res, pool);
+                continue;
+            }
+            if (events & EV_ACCEPTED) {
+                acceptedConnection(pool->events[i].res, sd == w->ws_listen_sd ? FRAMING_HTTP : FRAMING_LINE, pool);
+                continue;
+            }
+            if (events & EV_DATA) {
+                receive_from_client(sd, pool->events[i].data, pool->events[i].res, pool);
+                continue;
+            }
+            if (events & EV_CLOSED) {
+                closeConnection(sd, pool->events[i].res == 0, pool);
+                continue;
+            }
 
+            if (sd == mainSD) {
+                /* accepted below, once the clients already connected were served */
+                w->accept_pending = 1;
+                continue;
             }
-            if (FD_ISSET(i, &pool->ready_write_set)) {
+            if (sd == w->ws_listen_sd) {
+                w->ws_accept_pending = 1;
+                continue;
+            }
+            if (sd == w->wake_fd) {
+                /* other workers forwarded messages */
+                worker_drain_inbox(w);
+                continue;
+            }
+            if (events & EV_READ) {
+                log_debug("Descriptor %d is readable", sd);
+                if (readFromClient(sd, pool) < 0)
+                    continue;
+            }
+            if (events & EV_WRITE) {
                 /* try to write all msgs in queue to sd */
-                write_to_client(i, pool);
+                if (write_to_client(sd, pool) < 0)
+                    remove_conn(sd, pool);
             }
-            /*******************************************************/
+        } /* End of loop through ready descriptors */
+
+        if (w->accept_pending)
+            w->accept_pending = acceptConnections(mainSD, FRAMING_LINE, pool);
+        if (w->ws_accept_pending)
+            w->ws_accept_pending = acceptConnections(w->ws_listen_sd, FRAMING_HTTP, pool);
+        /* idle, ping and write stall timers */
+        wheel_advance(&pool->timers, pool->now, pool);
 
+        /* Write what was queued in this iteration before waiting again. */
+        resume_publishers(pool);
+        flush_pending(pool);
+        metric_add(&pool->metrics.loop_iterations, 1);
+        shared_hist_record(&pool->metrics.loop_time, metrics_now() - pool->now);
+
+    } while (atomic_load(&end_server) == 0);
+
+    /* make sure the other workers notice the end too */
+    atomic_store(&end_server, 1);
+    for (int i = 0; i < w->group->nr_workers; i++) {
+        if (&w->group->workers[i] != w)
+            worker_wake(&w->group->workers[i]);
+    }
+    return NULL;
+}
 
-        } /* End of loop through selectable descriptors */
+void printQueueStats(FILE *out, const char *name, conn_pool_t *pool) {
+    queue_stats_t *stats = &pool->queue_stats;
+    fprintf(out, "%s slow consumers: %lu disconnected, %lu oldest dropped, %lu newest dropped, %lu pauses\n",
+            name, atomic_load(&stats->disconnects), atomic_load(&stats->dropped_oldest),
+            atomic_load(&stats->dropped_newest), atomic_load(&stats->pauses));
+}
 
-    } while (end_server == 0);
+int main(int argc, char *argv[]) {
+    server_config_t config;
+    checkForErrors(argc, argv, &config);
+    static queue_limits_t limits;
+    limits.max_bytes = config.queue_max_bytes;
+    limits.max_msgs = config.queue_max_msgs;
+    limits.policy = config.slow_policy;
+    limits.budget = config.queue_budget;
+    limits.max_frame = config.max_frame;
+    limits.rate_msgs = config.rate_msgs;
+    limits.rate_bytes = config.rate_bytes;
+    limits.flush_window = config.flush_window;
+    limits.flush_bytes = config.flush_bytes;
+    static compress_config_t compress;
+    compress.level = config.compress_level;
+    compress.min_size = config.compress_min;
+    atomic_init(&compress.clients, 0);
+    atomic_init(&limits.queued_bytes, 0);
+    static room_registry_t registry;
+    if (room_registry_init(&registry, config.workers, config.history_msgs, config.history_bytes) < 0) {
+        perror("room_registry_init");
+        exit(EXIT_FAILURE);
+    }
+    if (log_start() < 0) {
+        perror("log_start");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGINT, intHandler);
+    signal(SIGPIPE, SIG_IGN);
+    SSL_CTX *tls = NULL;
+    if (config.tls_cert != NULL) {
+        if ((tls = tls_context_create(config.tls_cert, config.tls_key)) == NULL)
+            exit(EXIT_FAILURE);
+        /* io_uring reads and writes the sockets itself, OpenSSL has to for the handshake */
+        if (config.backend != NULL && strcmp(config.backend, "io_uring") == 0) {
+            log_warn("TLS needs a readiness backend, using epoll instead of io_uring");
+            config.backend = "epoll";
+        }
+    }
+    /* a connection is handed over between two reads, io_uring may have one in flight at any time */
+    if (config.handoff != NULL && config.backend != NULL && strcmp(config.backend, "io_uring") == 0) {
+        log_warn("hot restart needs a readiness backend, using epoll instead of io_uring");
+        config.backend = "epoll";
+    }
+    /*************************************************************/
+    /* The number of clients is bounded by RLIMIT_NOFILE only,   */
+    /* select is the one backend still capped at FD_SETSIZE.     */
+    /*************************************************************/
+    int maxFds = raise_fd_limit();
+
+    /*************************************************************/
+    /* With --handoff, take over the listeners and connections   */
+    /* of the server running there, if there is one.             */
+    /*************************************************************/
+    handoff_buf_t handoff;
+    handoff_init(&handoff);
+    int takingOver = config.handoff != NULL ? handoff_receive(config.handoff, &handoff) : 0;
+    if (takingOver < 0)
+        exit(EXIT_FAILURE);
+    int *inherited = calloc(2 * config.workers, sizeof(int));
+    if (inherited == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    int nrInherited = 0, nrInheritedWs = 0;
+    if (takingOver) {
+        nrInherited = takeListeners(&handoff, config.port, inherited, config.workers);
+        nrInheritedWs = takeListeners(&handoff, config.ws_port, inherited + config.workers,
+                                      config.ws_port > 0 ? config.workers : 0);
+    }
+
+    worker_group_t group;
+    group.nr_workers = config.workers;
+    group.workers = calloc(config.workers, sizeof(worker_t));
+    if (group.workers == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.workers; i++) {
+        event_backend_t *backend = create_backend(config.backend, maxFds);
+        if (backend == NULL && config.backend != NULL && strcmp(config.backend, "io_uring") == 0) {
+            /* the kernel lacks io_uring or one of the features it needs */
+            log_warn("io_uring is not supported here, falling back to epoll");
+            config.backend = "epoll";
+            backend = create_backend(config.backend, maxFds);
+        }
+        if (backend == NULL) {
+            fprintf(stderr, "unknown or unavailable backend %s\n", config.backend);
+            exit(EXIT_FAILURE);
+        }
+        conn_pool_t *pool = malloc(sizeof(conn_pool_t));
+        if (pool == NULL || init_pool(pool, backend, &limits, &registry, &config.timeouts, &compress, tls) < 0) {
+            perror("init_pool");
+            exit(EXIT_FAILURE);
+        }
+        pool->websocket = config.ws_port > 0;
+        int mainSD = i < nrInherited ? inherited[i] : createListener(&config, config.port, config.workers > 1);
+        if (mainSD < 0)
+            exit(EXIT_FAILURE);
+        if (init_worker(&group.workers[i], i, &group, pool, mainSD) < 0
+            || backend->add(backend, mainSD, EV_READ | EV_LISTEN) < 0
+            || backend->add(backend, group.workers[i].wake_fd, EV_READ | EV_POLL) < 0) {
+            perror("init_worker");
+            exit(EXIT_FAILURE);
+        }
+        if (config.ws_port > 0) {
+            int wsSD = i < nrInheritedWs ? inherited[config.workers + i]
+                                         : createListener(&config, config.ws_port, config.workers > 1);
+            if (wsSD < 0 || backend->add(backend, wsSD, EV_READ | EV_LISTEN) < 0)
+                exit(EXIT_FAILURE);
+            group.workers[i].ws_listen_sd = wsSD;
+        }
+    }
+    free(inherited);
+    if (takingOver) {
+        int imported = import_conns(&handoff, &group);
+        if (imported < 0)
+            log_error("the state handed over is incomplete, some connections were closed");
+        else
+            log_info("Took over %d listener(s) and %d connection(s)", nrInherited + nrInheritedWs, imported);
+    }
+    /* whatever nobody took, the connections left out included */
+    handoff_free(&handoff);
+    signalWakeFd = group.workers[0].wake_fd;
+    log_info("Using %s backend, %d worker(s), up to %d descriptors%s%s",
+           group.workers[0].pool->backend->name, config.workers, group.workers[0].pool->backend->max_fds,
+           tls != NULL ? ", TLS" : "", config.ws_port > 0 ? ", WebSocket" : "");
+
+    /*************************************************************/
+    /* Worker 0 runs on the main thread, the others only handle  */
+    /* their own sockets so SIGINT is blocked in them.           */
+    /*************************************************************/
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    /* the logger thread has to write out why before the process goes */
+    if ((config.journal.dir != NULL && journal_open(&config.journal, &group) < 0)
+        || (config.federation.node_id != 0 && federation_start(&config.federation, &group) < 0)) {
+        log_stop();
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < config.workers; i++) {
+        if (pthread_create(&group.workers[i].thread, NULL, runWorker, &group.workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (config.admin_port > 0 && start_admin_listener(config.admin_addr, config.admin_port, &group) < 0)
+        log_error("admin listener on %s:%d: %m", config.admin_addr, config.admin_port);
+    if (config.handoff != NULL)
+        handoff_listen(config.handoff, stopServer);
+    runWorker(&group.workers[0]);
+    signalWakeFd = -1;
+    for (int i = 1; i < config.workers; i++)
+        pthread_join(group.workers[i].thread, NULL);
+    stop_admin_listener();
+    federation_stop();
+    if (handoff_requested()) {
+        /*
+         * Messages one worker passed to another are queued before the queues
+         * are handed over. Only those coming from peers are passed on again,
+         * once, so two rounds leave every inbox empty.
+         */
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < config.workers; i++) {
+                arena_set_current(&group.workers[i].pool->arena);
+                worker_drain_inbox(&group.workers[i]);
+            }
+        }
+        arena_set_current(NULL);
+    }
+    journal_close();
+    if (handoff_requested()) {
+        handoff_init(&handoff);
+        putListeners(&handoff, &group);
+        int exported = export_conns(&group, &handoff);
+        if (exported >= 0 && handoff_send(&handoff) == SUCCESS)
+            log_info("Handed over %d connection(s)", exported);
+        handoff_free(&handoff);
+    }
+    handoff_stop();
+    /* the statistics below go straight to stdout, after everything logged */
+    log_stop();
 
     /*************************************************************/
     /* If we are here, Control-C was typed,						 */
     /* clean up all open connections					         */
     /*************************************************************/
-    removeAllConnectionsLeft(pool);
-    free(pool);
+    for (int i = 0; i < config.workers; i++) {
+        worker_t *w = &group.workers[i];
+        conn_pool_t *pool = w->pool;
+        event_backend_t *backend = pool->backend;
+        char name[32];
+        snprintf(name, sizeof(name), "worker %d", w->id);
+        arena_print_stats(stdout, name, &pool->arena);
+        printQueueStats(stdout, name, pool);
+        arena_set_current(&pool->arena);
+        removeAllConnectionsLeft(pool);
+        destroy_worker(w);
+        drop_history(pool);
+        backend->remove(backend, w->listen_sd);
+        close(w->listen_sd);
+        if (w->ws_listen_sd >= 0) {
+            backend->remove(backend, w->ws_listen_sd);
+            close(w->ws_listen_sd);
+        }
+        backend->destroy(backend);
+    }
+    /* bodies may be given back to any worker's arena until every pool is empty */
+    arena_set_current(NULL);
+    for (int i = 0; i < config.workers; i++) {
+        destroy_pool(group.workers[i].pool);
+        free(group.workers[i].pool);
+    }
+    free(group.workers);
+    room_registry_destroy(&registry);
+    if (tls != NULL)
+        tls_context_destroy(tls);
     return 0;
 }
 
+/*
+ * Tell the backend what conn is waiting for: reading unless it is paused or
+ * over its ingest rate, writing while its queue is blocked.
+ */
+static void updateInterest(conn_t *conn, conn_pool_t *pool) {
+    int events = (conn->paused || conn->throttled ? 0 : EV_READ) | (conn->want_write ? EV_WRITE : 0);
+    pool->backend->modify(pool->backend, conn->fd, events);
+}
+
+/*
+ * Register or drop write interest. Edge-triggered backends keep it armed
+ * all the time, so this only costs a call for level-triggered ones.
+ */
+static void setWriteInterest(conn_t *conn, int on, conn_pool_t *pool) {
+    if (conn->want_write == on)
+        return;
+    conn->want_write = on;
+    updateInterest(conn, pool);
+}
+
+/*
+ * Append fd to a growable descriptor list.
+ */
+static int pushFd(int **fds, int *nr, int *cap, int fd) {
+    if (*nr == *cap) {
+        int newCap = *cap ? *cap * 2 : 64;
+        int *grown = realloc(*fds, newCap * sizeof(int));
+        if (grown == NULL)
+            return ERROR;
+        *fds = grown;
+        *cap = newCap;
+    }
+    (*fds)[(*nr)++] = fd;
+    return SUCCESS;
+}
+
+/*
+ * Have flush_pending() write conn, the first connection queued after a flush
+ * starts the flush window.
+ */
+static int scheduleFlush(conn_t *conn, conn_pool_t *pool) {
+    if (pool->nr_flush == 0)
+        pool->flush_deadline = pool->now + pool->limits->flush_window;
+    if (pushFd(&pool->flush_fds, &pool->nr_flush, &pool->flush_cap, conn->fd) < 0)
+        return ERROR;
+    conn->pending_flush = 1;
+    return SUCCESS;
+}
+
+/*
+ * Account for msgs messages of bytes in total leaving the queue of cur.
+ */
+static void dequeued(conn_t *cur, size_t bytes, int msgs, conn_pool_t *pool) {
+    queue_limits_t *limits = pool->limits;
+    cur->queued_bytes -= bytes;
+    cur->queued_msgs -= msgs;
+    atomic_fetch_sub_explicit(&limits->queued_bytes, bytes, memory_order_relaxed);
+    metric_sub(&pool->metrics.queued_msgs, (uint64_t) msgs);
+    metric_sub(&pool->metrics.queued_bytes, bytes);
+    /* hysteresis: publishers stay paused until the queue is half empty */
+    if (cur->over_limit && cur->queued_bytes <= limits->max_bytes / 2 && cur->queued_msgs <= limits->max_msgs / 2) {
+        cur->over_limit = 0;
+        pool->nr_over_limit--;
+    }
+}
 
-int init_pool(conn_pool_t *pool) {
+static void freeMessages(conn_t *conn, conn_pool_t *pool) {
+    msg_t *msg = conn->write_msg_head;
+    while (msg != NULL) {
+        msg_t *next = msg->next;
+        msg_body_unref(msg->body);
+        slab_free(&pool->arena.msgs, msg);
+        msg = next;
+    }
+    conn->write_msg_head = NULL;
+    conn->write_msg_tail = NULL;
+    conn->write_offset = 0;
+    conn->line_msgs = 0;
+    conn->raw_msgs = 0;
+    dequeued(conn, conn->queued_bytes, conn->queued_msgs, pool);
+}
+
+static void freeConn(conn_t *conn, conn_pool_t *pool) {
+    freeMessages(conn, pool);
+    line_buffer_free(&conn->input);
+    if (conn->partial != NULL)
+        msg_body_unref(conn->partial);
+    free(conn->upgrade);
+    free(conn->write_iov);
+    free(conn->held);
+    slab_free(&pool->arena.conns, conn);
+}
+
+int init_pool(conn_pool_t *pool, event_backend_t *backend, queue_limits_t *limits, room_registry_t *registry,
+              conn_timeouts_t *timeouts, compress_config_t *compress, SSL_CTX *tls) {
     //initialized all fields
-    pool->maxfd = 3;
+    pool->worker = NULL;
+    pool->backend = backend;
     pool->nready = 0;
     pool->nr_conns = 0;
-    FD_ZERO(&pool->read_set);
-    FD_ZERO(&pool->ready_read_set);
-    FD_ZERO(&pool->write_set);
-    FD_ZERO(&pool->ready_write_set);
-    pool->conn_head = NULL;
+    pool->conn_by_fd = NULL;
+    pool->conn_by_fd_cap = 0;
+    pool->conns = NULL;
+    pool->conns_cap = 0;
+    pool->registry = registry;
+    pool->rooms = NULL;
+    pool->rooms_cap = 0;
+    pool->flush_fds = NULL;
+    pool->nr_flush = 0;
+    pool->flush_cap = 0;
+    pool->flush_deadline = 0;
+    pool->nr_zombies = 0;
+    pool->limits = limits;
+    metrics_init(&pool->metrics);
+    atomic_init(&pool->queue_stats.disconnects, 0);
+    atomic_init(&pool->queue_stats.dropped_oldest, 0);
+    atomic_init(&pool->queue_stats.dropped_newest, 0);
+    atomic_init(&pool->queue_stats.pauses, 0);
+    pool->nr_over_limit = 0;
+    pool->paused_fds = NULL;
+    pool->nr_paused = 0;
+    pool->paused_cap = 0;
+    pool->doomed_fds = NULL;
+    pool->nr_doomed = 0;
+    pool->doomed_cap = 0;
+    pool->timeouts = timeouts;
+    pool->now = metrics_now();
+    wheel_init(&pool->timers, pool->now);
+    pool->compress = compress;
+    compressor_init(&pool->compressor, compress->level);
+    pool->tls = tls;
+    pool->websocket = 0;
+    arena_init(&pool->arena, sizeof(conn_t), sizeof(msg_t), sizeof(forward_msg_t));
     return SUCCESS;
 }
 
-int add_conn(int sd, conn_pool_t *pool) {
-    conn_t *conn = malloc(sizeof(conn_t));
-    if (conn == NULL)
+void destroy_pool(conn_pool_t *pool) {
+    free(pool->flush_fds);
+    free(pool->paused_fds);
+    free(pool->doomed_fds);
+    free(pool->conn_by_fd);
+    free(pool->conns);
+    for (int i = 0; i < pool->rooms_cap; i++) {
+        free(pool->rooms[i].members);
+        free(pool->rooms[i].history);
+    }
+    free(pool->rooms);
+    compressor_destroy(&pool->compressor);
+    arena_destroy(&pool->arena);
+}
+
+/*
+ * Make sure the fd-indexed table has a slot for sd and the dense array has
+ * room for one more connection. Both grow geometrically.
+ */
+static int reserveSlot(int sd, conn_pool_t *pool) {
+    if (sd >= pool->conn_by_fd_cap) {
+        int cap = pool->conn_by_fd_cap ? pool->conn_by_fd_cap : 64;
+        while (cap <= sd)
+            cap *= 2;
+        conn_t **table = realloc(pool->conn_by_fd, cap * sizeof(conn_t *));
+        if (table == NULL)
+            return ERROR;
+        memset(table + pool->conn_by_fd_cap, 0, (cap - pool->conn_by_fd_cap) * sizeof(conn_t *));
+        pool->conn_by_fd = table;
+        pool->conn_by_fd_cap = cap;
+    }
+    if ((int) pool->nr_conns == pool->conns_cap) {
+        int cap = pool->conns_cap ? pool->conns_cap * 2 : 64;
+        conn_t **conns = realloc(pool->conns, cap * sizeof(conn_t *));
+        if (conns == NULL)
+            return ERROR;
+        pool->conns = conns;
+        pool->conns_cap = cap;
+    }
+    return SUCCESS;
+}
+
+static int workerId(conn_pool_t *pool) {
+    return pool->worker != NULL ? pool->worker->id : 0;
+}
+
+/*
+ * Make sure the room table has an entry for room id, growing it on demand.
+ */
+static int reserveRoom(int id, conn_pool_t *pool) {
+    if (id < pool->rooms_cap)
+        return SUCCESS;
+    int cap = pool->rooms_cap ? pool->rooms_cap : 16;
+    while (cap <= id)
+        cap *= 2;
+    room_t *rooms = realloc(pool->rooms, cap * sizeof(room_t));
+    if (rooms == NULL)
+        return ERROR;
+    memset(rooms + pool->rooms_cap, 0, (cap - pool->rooms_cap) * sizeof(room_t));
+    pool->rooms = rooms;
+    pool->rooms_cap = cap;
+    return SUCCESS;
+}
+
+/*
+ * Make conn a member of room id on this worker, growing the room table and
+ * the room's members on demand. Any room conn was in before is left to the
+ * caller.
+ */
+static int joinRoom(conn_t *conn, int id, conn_pool_t *pool) {
+    if (reserveRoom(id, pool) < 0)
+        return ERROR;
+    room_t *room = &pool->rooms[id];
+    if (room->nr_members == room->cap) {
+        int cap = room->cap ? room->cap * 2 : 8;
+        conn_t **members = realloc(room->members, cap * sizeof(conn_t *));
+        if (members == NULL)
+            return ERROR;
+        room->members = members;
+        room->cap = cap;
+    }
+    conn->room = id;
+    conn->room_idx = room->nr_members;
+    conn->joined = pool->now;
+    room->members[room->nr_members++] = conn;
+    room_presence_add(pool->registry, id, workerId(pool), 1);
+    return SUCCESS;
+}
+
+/*
+ * Take the member at idx out of room id, the last member fills its slot.
+ */
+static void leaveRoom(int id, int idx, conn_pool_t *pool) {
+    room_t *room = &pool->rooms[id];
+    conn_t *last = room->members[--room->nr_members];
+    room->members[idx] = last;
+    last->room_idx = idx;
+    room_presence_add(pool->registry, id, workerId(pool), -1);
+    if (room->nr_members == 0) {
+        /* rooms nobody is in keep no memory */
+        free(room->members);
+        room->members = NULL;
+        room->cap = 0;
+    }
+}
+
+/*
+ * Append msg to the write queue of cur and put cur in the flush list. The
+ * caller accounts for the reference and the bytes against the budget.
+ * @ return value - 0 on success, -1 if the flush list could not grow
+ */
+static int appendMsg(conn_t *cur, msg_t *msg, conn_pool_t *pool) {
+    if (cur->queued_msgs == 0) {
+        /* the write stall clock starts when the queue stops being empty */
+        cur->last_progress = pool->now;
+        if (pool->timeouts->write_stall > 0 && !wheel_timer_pending(&cur->write_timer))
+            wheel_schedule(&pool->timers, &cur->write_timer, pool->now + pool->timeouts->write_stall);
+    }
+    msg->next = NULL;
+    msg->prev = cur->write_msg_tail;
+    if (cur->write_msg_tail != NULL)
+        cur->write_msg_tail->next = msg;
+    else
+        cur->write_msg_head = msg;
+    cur->write_msg_tail = msg;
+    cur->queued_msgs++;
+    cur->queued_bytes += msg->body->size;
+    if (!cur->pending_flush && !cur->want_write && !cur->write_inflight && scheduleFlush(cur, pool) < 0)
+        return ERROR;
+    return SUCCESS;
+}
+
+/*
+ * Remember body as the newest message of room, dropping the oldest ones
+ * beyond the history bounds. The ring holds a reference to each body.
+ */
+static void historyPush(room_t *room, msg_body_t *body, conn_pool_t *pool) {
+    int max = pool->registry->history_msgs;
+    size_t maxBytes = pool->registry->history_bytes;
+    if ((size_t) body->size > maxBytes)
+        return;
+    if (room->history == NULL && (room->history = malloc(max * sizeof(msg_body_t *))) == NULL)
+        return;
+    while (room->history_len == max || room->history_bytes + body->size > maxBytes) {
+        msg_body_t *oldest = room->history[room->history_head];
+        room->history_head = (room->history_head + 1) % max;
+        room->history_len--;
+        room->history_bytes -= oldest->size;
+        msg_body_unref(oldest);
+    }
+    room->history[(room->history_head + room->history_len) % max] = msg_body_ref(body);
+    room->history_len++;
+    room->history_bytes += body->size;
+}
+
+/*
+ * Queue the history of conn's room to conn, oldest first. The bodies are
+ * shared with the ring, not copied, and bypass the queue limits: the
+ * history bounds keep them small. WebSocket clients miss messages that got
+ * no WebSocket copy.
+ */
+static void replayHistory(conn_t *conn, conn_pool_t *pool) {
+    room_t *room = &pool->rooms[conn->room];
+    int max = pool->registry->history_msgs;
+    size_t bytes = 0;
+    int queued = 0;
+    for (int i = 0; i < room->history_len; i++) {
+        msg_body_t *body = room->history[(room->history_head + i) % max];
+        if (conn->framing == FRAMING_WEBSOCKET && body->websocket == NULL)
+            continue;
+        msg_t *msg = slab_alloc(&pool->arena.msgs);
+        if (msg == NULL)
+            break;
+        msg->body = msg_body_ref(body);
+        bytes += body->size;
+        queued++;
+        if (appendMsg(conn, msg, pool) < 0)
+            break;
+    }
+    atomic_fetch_add_explicit(&pool->limits->queued_bytes, bytes, memory_order_relaxed);
+    metric_add(&pool->metrics.queued_msgs, (uint64_t) queued);
+    metric_add(&pool->metrics.queued_bytes, bytes);
+    metric_add(&pool->metrics.history_replayed, (uint64_t) queued);
+}
+
+void drop_history(conn_pool_t *pool) {
+    int max = pool->registry->history_msgs;
+    for (int i = 0; i < pool->rooms_cap; i++) {
+        room_t *room = &pool->rooms[i];
+        for (int j = 0; j < room->history_len; j++)
+            msg_body_unref(room->history[(room->history_head + j) % max]);
+        free(room->history);
+        room->history = NULL;
+        room->history_len = 0;
+        room->history_bytes = 0;
+    }
+}
+
+/*
+ * Put the len bytes of header right in front of the data of body.
+ */
+static void placeHeader(msg_body_t *body, const char *header, int len) {
+    body->frame_len = (unsigned char) len;
+    memcpy(body->frame + sizeof(body->frame) - len, header, len);
+}
+
+/*
+ * Build the frame header of body, right in front of its data.
+ */
+static void setFrame(msg_body_t *body, int type, int flags) {
+    char header[FRAME_HEADER_MAX];
+    placeHeader(body, header, frame_header_encode(header, (uint32_t) body->size, type, flags));
+}
+
+/*
+ * Build the copy of a message WebSocket clients are sent: data without its
+ * line end, behind the header of a frame of opcode. WS_RAW copies data as it
+ * is, without a header.
+ * @ return value - the copy, NULL on failure
+ */
+static msg_body_t *websocketCopy(const char *data, int len, int opcode) {
+    if (opcode == WS_TEXT || opcode == WS_BINARY) {
+        if (len > 0 && data[len - 1] == '\n')
+            len--;
+        if (len > 0 && data[len - 1] == '\r')
+            len--;
+    }
+    msg_body_t *copy = msg_body_alloc(len, FRAME_MESSAGE);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy->data, data, len);
+    char header[WS_HEADER_MAX];
+    placeHeader(copy, header, opcode == WS_RAW ? 0 : ws_header_encode(header, (uint64_t) len, opcode));
+    return copy;
+}
+
+/*
+ * Queue data for conn alone, outside of the queue limits. Binary clients get
+ * it as a FRAME_CONTROL frame, WebSocket clients as a frame of opcode.
+ */
+static int queueFrame(conn_t *conn, int opcode, const char *data, int len, conn_pool_t *pool) {
+    msg_body_t *body = msg_body_alloc(len, FRAME_CONTROL);
+    if (body == NULL)
+        return ERROR;
+    memcpy(body->data, data, len);
+    if (conn->framing == FRAMING_WEBSOCKET && (body->websocket = websocketCopy(data, len, opcode)) == NULL) {
+        msg_body_unref(body);
         return ERROR;
-    pool->nr_conns++;
+    }
+    msg_t *msg = slab_alloc(&pool->arena.msgs);
+    if (msg == NULL) {
+        msg_body_unref(body);
+        return ERROR;
+    }
+    /* the queue takes over the body's only reference */
+    msg->body = body;
+    appendMsg(conn, msg, pool);
+    atomic_fetch_add_explicit(&pool->limits->queued_bytes, (size_t) len, memory_order_relaxed);
+    metric_add(&pool->metrics.queued_msgs, 1);
+    metric_add(&pool->metrics.queued_bytes, (uint64_t) len);
+    return SUCCESS;
+}
+
+/*
+ * Queue a line of the server for conn alone, a text frame for WebSocket clients.
+ */
+static int queueControl(conn_t *conn, const char *line, int len, conn_pool_t *pool) {
+    return queueFrame(conn, WS_TEXT, line, len, pool);
+}
+
+/*
+ * Ping conn, with a ping frame if it is a WebSocket client: browsers answer
+ * those on their own.
+ */
+static void sendPing(conn_t *conn, conn_pool_t *pool) {
+    int status;
+    if (conn->framing == FRAMING_HTTP)
+        return;
+    if (conn->framing == FRAMING_WEBSOCKET)
+        status = queueFrame(conn, WS_PING, "", 0, pool);
+    else
+        status = queueControl(conn, PING_LINE, sizeof(PING_LINE) - 1, pool);
+    if (status == SUCCESS)
+        metric_add(&pool->metrics.pings, 1);
+}
+
+/*
+ * Schedule the idle timer of conn for its idle deadline or its next ping,
+ * whichever comes first.
+ */
+static void scheduleIdle(conn_t *conn, conn_pool_t *pool) {
+    conn_timeouts_t *timeouts = pool->timeouts;
+    uint64_t when = UINT64_MAX;
+    if (timeouts->idle > 0)
+        when = conn->last_read + timeouts->idle;
+    if (timeouts->ping > 0) {
+        uint64_t quiet = conn->last_read > conn->last_ping ? conn->last_read : conn->last_ping;
+        if (quiet + timeouts->ping < when)
+            when = quiet + timeouts->ping;
+    }
+    if (when != UINT64_MAX)
+        wheel_schedule(&pool->timers, &conn->idle_timer, when);
+}
+
+/*
+ * The idle timer is not moved on every read: when it fires it looks at
+ * last_read and either acts or schedules itself again.
+ */
+static void idleTimerFired(wheel_timer_t *timer, void *arg) {
+    conn_pool_t *pool = arg;
+    conn_t *conn = (conn_t *) ((char *) timer - offsetof(conn_t, idle_timer));
+    conn_timeouts_t *timeouts = pool->timeouts;
+    if (conn->paused || conn->throttled) {
+        /* the server stopped reading, not the client */
+        conn->last_read = pool->now;
+    }
+    if (timeouts->idle > 0 && pool->now - conn->last_read >= timeouts->idle) {
+        log_info("Closing idle connection %d", conn->fd);
+        metric_add(&pool->metrics.idle_timeouts, 1);
+        remove_conn(conn->fd, pool);
+        return;
+    }
+    uint64_t quiet = conn->last_read > conn->last_ping ? conn->last_read : conn->last_ping;
+    if (timeouts->ping > 0 && pool->now - quiet >= timeouts->ping) {
+        sendPing(conn, pool);
+        conn->last_ping = pool->now;
+    }
+    scheduleIdle(conn, pool);
+}
+
+/*
+ * Close conn if its queue was not written to for the write stall timeout.
+ * The timer lapses once the queue is empty, appendMsg() starts it again.
+ */
+static void writeTimerFired(wheel_timer_t *timer, void *arg) {
+    conn_pool_t *pool = arg;
+    conn_t *conn = (conn_t *) ((char *) timer - offsetof(conn_t, write_timer));
+    uint64_t timeout = pool->timeouts->write_stall;
+    if (conn->queued_msgs == 0)
+        return;
+    if (pool->now - conn->last_progress >= timeout) {
+        log_warn("closing connection %d, its queue was not written to for %.1fs", conn->fd, timeout / 1e9);
+        metric_add(&pool->metrics.write_timeouts, 1);
+        remove_conn(conn->fd, pool);
+        return;
+    }
+    wheel_schedule(&pool->timers, &conn->write_timer, conn->last_progress + timeout);
+}
+
+/*
+ * Take a message of size bytes from conn out of its rate buckets, and stop
+ * reading from conn once either is empty. A bucket holds RATE_BURST_NS worth
+ * and is kept as the time it is full again: a message goes through while
+ * there is anything left in both, and may take one below empty.
+ */
+static void rateCharge(conn_t *conn, int size, conn_pool_t *pool) {
+    queue_limits_t *limits = pool->limits;
+    uint64_t now = pool->now;
+    if (limits->rate_msgs > 0) {
+        uint64_t from = conn->msgs_full_at > now ? conn->msgs_full_at : now;
+        conn->msgs_full_at = from + NS_PER_SEC / limits->rate_msgs;
+    }
+    if (limits->rate_bytes > 0) {
+        uint64_t from = conn->bytes_full_at > now ? conn->bytes_full_at : now;
+        conn->bytes_full_at = from + (uint64_t) size * NS_PER_SEC / limits->rate_bytes;
+    }
+    uint64_t fullAt = conn->msgs_full_at > conn->bytes_full_at ? conn->msgs_full_at : conn->bytes_full_at;
+    if (conn->throttled || fullAt < now + RATE_BURST_NS)
+        return;
+    conn->throttled = 1;
+    conn->throttled_since = now;
+    updateInterest(conn, pool);
+    /* readable again as soon as both buckets are no longer empty */
+    wheel_schedule(&pool->timers, &conn->rate_timer, fullAt - RATE_BURST_NS + 1);
+    metric_add(&pool->metrics.throttles, 1);
+    metric_add(&pool->metrics.throttled, 1);
+}
+
+/*
+ * Stop holding back conn: count the time it was, and take it out of the gauge.
+ */
+static void unthrottle(conn_t *conn, conn_pool_t *pool) {
+    conn->throttled = 0;
+    metric_add(&pool->metrics.throttled_ns, pool->now - conn->throttled_since);
+    metric_sub(&pool->metrics.throttled, 1);
+}
+
+/*
+ * conn is back under its rate: pass on what it sent before it went over,
+ * then read from it again.
+ */
+static void rateTimerFired(wheel_timer_t *timer, void *arg) {
+    conn_pool_t *pool = arg;
+    conn_t *conn = (conn_t *) ((char *) timer - offsetof(conn_t, rate_timer));
+    unthrottle(conn, pool);
+    updateInterest(conn, pool);
+    if (dispatchInput(conn, pool) < 0) {
+        remove_conn(conn->fd, pool);
+        return;
+    }
+    if (conn->throttled)
+        return;
+    if (conn->held != NULL) {
+        /* what does not go through again is held anew */
+        char *held = conn->held;
+        int len = conn->held_len;
+        conn->held = NULL;
+        conn->held_len = 0;
+        receive_from_client(conn->fd, held, len, pool);
+        free(held);
+        return;
+    }
+    /* an edge-triggered backend will not report the data that waited */
+    if (pool->backend->submit_write == NULL)
+        readFromClient(conn->fd, pool);
+}
+
+/*
+ * Make sd a connection of the pool, in the lobby, watched by the backend.
+ * @ tls - context of the TLS session the client starts with, NULL for none
+ * @ return value - the connection, NULL on failure
+ */
+static conn_t *createConn(int sd, int framing, SSL_CTX *tls, conn_pool_t *pool) {
+    if (sd < 0 || sd >= pool->backend->max_fds || find_conn(sd, pool) != NULL)
+        return NULL;
+    if (reserveSlot(sd, pool) < 0)
+        return NULL;
+    conn_t *conn = slab_alloc(&pool->arena.conns);
+    if (conn == NULL)
+        return NULL;
     conn->fd = sd;
-    conn->next = NULL;
-    conn->prev = NULL;
+    line_buffer_init(&conn->input);
+    conn->framing = framing;
+    conn->line_msgs = 0;
+    conn->codec = CODEC_NONE;
+    conn->raw_msgs = 0;
+    conn->partial = NULL;
+    conn->partial_len = 0;
+    conn->partial_type = FRAME_MESSAGE;
+    conn->closing = 0;
+    conn->upgrade = NULL;
+    if (framing == FRAMING_HTTP && (conn->upgrade = calloc(1, sizeof(ws_upgrade_t))) == NULL) {
+        slab_free(&pool->arena.conns, conn);
+        return NULL;
+    }
     conn->write_msg_head = NULL;
     conn->write_msg_tail = NULL;
+    conn->write_offset = 0;
+    conn->want_write = 0;
+    conn->write_inflight = 0;
+    conn->write_iov = NULL;
+    conn->pending_flush = 0;
+    conn->queued_msgs = 0;
+    conn->queued_bytes = 0;
+    conn->write_pinned = 0;
+    conn->paused = 0;
+    conn->over_limit = 0;
+    conn->msgs_full_at = 0;
+    conn->bytes_full_at = 0;
+    conn->throttled = 0;
+    conn->throttled_since = 0;
+    conn->held = NULL;
+    conn->held_len = 0;
+    conn->last_read = pool->now;
+    conn->last_ping = 0;
+    conn->last_progress = pool->now;
+    wheel_timer_init(&conn->idle_timer, idleTimerFired);
+    wheel_timer_init(&conn->write_timer, writeTimerFired);
+    wheel_timer_init(&conn->rate_timer, rateTimerFired);
+    /* the client speaks first, the handshake starts once it is readable */
+    conn->ssl = tls != NULL ? tls_session_create(tls, sd) : NULL;
+    conn->handshaking = conn->ssl != NULL;
+    conn->tls_read = conn->ssl != NULL;
+    conn->tls_write = conn->ssl != NULL;
+    conn->tls_retry = 0;
+    if (tls != NULL && conn->ssl == NULL) {
+        free(conn->upgrade);
+        slab_free(&pool->arena.conns, conn);
+        return NULL;
+    }
 
-    if (pool->conn_head == NULL) {
-        pool->conn_head = conn;
-        return SUCCESS;
+    if (joinRoom(conn, LOBBY_ROOM, pool) < 0) {
+        if (conn->ssl != NULL)
+            tls_session_close(conn->ssl);
+        free(conn->upgrade);
+        slab_free(&pool->arena.conns, conn);
+        return NULL;
     }
-    conn_t *cur = pool->conn_head;
-    while (cur->next != NULL) {
-        cur = cur->next;
+    if (pool->backend->add(pool->backend, sd, pool->backend->edge_triggered ? EV_READ | EV_WRITE : EV_READ) < 0) {
+        leaveRoom(conn->room, conn->room_idx, pool);
+        if (conn->ssl != NULL)
+            tls_session_close(conn->ssl);
+        free(conn->upgrade);
+        slab_free(&pool->arena.conns, conn);
+        return NULL;
     }
-    cur->next = conn;
-    conn->prev = cur;
-    if (sd > pool->maxfd)
-        pool->maxfd = sd;
-    FD_SET(sd, &pool->read_set);
-    FD_SET(sd, &pool->write_set);
+    conn->idx = (int) pool->nr_conns;
+    pool->conns[pool->nr_conns++] = conn;
+    pool->conn_by_fd[sd] = conn;
+    scheduleIdle(conn, pool);
+    metric_add(&pool->metrics.connections, 1);
+    return conn;
+}
+
+int add_conn(int sd, int framing, conn_pool_t *pool) {
+    conn_t *conn = createConn(sd, framing, pool->tls, pool);
+    if (conn == NULL)
+        return ERROR;
+    /* a WebSocket client is sent the history once it upgraded */
+    if (framing != FRAMING_HTTP)
+        replayHistory(conn, pool);
+    metric_add(&pool->metrics.accepted, 1);
     return SUCCESS;
 }
 
 
 int remove_conn(int sd, conn_pool_t *pool) {
     /*
-    * 1. remove connection from pool
+    * 1. remove connection from pool, the last connection fills its slot
     * 2. deallocate connection
-    * 3. remove from sets
-    * 4. update max_fd if needed
+    * 3. remove from backend
     */
-    conn_t *cur = pool->conn_head;
-    conn_t *Prev = NULL;
-    while (cur != NULL) {
-        if (cur->fd == sd) {
-            Prev = cur->prev;
-            if (cur->next != NULL && cur->prev != NULL) {
-                conn_t *next = cur->next;
-                next->prev = Prev;
-                Prev->next = cur;
-            } else if (cur->next != NULL) {
-                conn_t *next = cur->next;
-                next->prev = NULL;
-                pool->conn_head = cur->next;
-            } else if (cur->prev != NULL) {
-                Prev->next = NULL;
+    conn_t *cur = find_conn(sd, pool);
+    if (cur == NULL)
+        return ERROR;
+    conn_t *last = pool->conns[--pool->nr_conns];
+    pool->conns[cur->idx] = last;
+    last->idx = cur->idx;
+    pool->conn_by_fd[sd] = NULL;
+    leaveRoom(cur->room, cur->room_idx, pool);
+    wheel_cancel(&pool->timers, &cur->idle_timer);
+    wheel_cancel(&pool->timers, &cur->write_timer);
+    wheel_cancel(&pool->timers, &cur->rate_timer);
+    if (cur->throttled)
+        unthrottle(cur, pool);
+    if (cur->codec != CODEC_NONE)
+        atomic_fetch_sub_explicit(&pool->compress->clients, 1, memory_order_relaxed);
+    metric_add(&pool->metrics.closed, 1);
+    metric_sub(&pool->metrics.connections, 1);
+    if (cur->over_limit) {
+        cur->over_limit = 0;
+        pool->nr_over_limit--;
+    }
+
+    pool->backend->remove(pool->backend, sd);
+    if (cur->ssl != NULL) {
+        tls_session_close(cur->ssl);
+        cur->ssl = NULL;
+    }
+    close(sd);
+    if (cur->write_inflight) {
+        /* the kernel may still read the queued bodies, free them on completion */
+        cur->fd = -1;
+        pool->nr_zombies++;
+        return SUCCESS;
+    }
+    freeConn(cur, pool);
+    return SUCCESS;
+}
+
+msg_body_t *msg_body_alloc(int len, int type) {
+    size_t size = sizeof(msg_body_t) + len + 1;
+    mem_arena_t *arena = arena_current();
+    slab_pool_t *slab = arena != NULL ? arena_body_class(arena, size) : NULL;
+    msg_body_t *body = slab != NULL ? slab_alloc(slab) : malloc(size);
+    if (body == NULL)
+        return NULL;
+    body->slab = slab;
+    atomic_init(&body->refcount, 1);
+    body->size = len;
+    body->room = LOBBY_ROOM;
+    body->created_ns = metrics_now();
+    body->compressed = NULL;
+    body->websocket = NULL;
+    setFrame(body, type, 0);
+    body->data[len] = '\0';
+    return body;
+}
+
+msg_body_t *msg_body_create(const char *buffer, int len) {
+    msg_body_t *body = msg_body_alloc(len, FRAME_MESSAGE);
+    if (body == NULL)
+        return NULL;
+    memcpy(body->data, buffer, len);
+    return body;
+}
+
+void msg_body_unref(msg_body_t *body) {
+    if (atomic_fetch_sub_explicit(&body->refcount, 1, memory_order_acq_rel) != 1)
+        return;
+    if (body->compressed != NULL)
+        msg_body_unref(body->compressed);
+    if (body->websocket != NULL)
+        msg_body_unref(body->websocket);
+    if (body->slab != NULL)
+        slab_free(body->slab, body);
+    else
+        free(body);
+}
+
+/*
+ * Switch conn to binary framing. The answer "/binary" is the last line it
+ * is sent, what was queued before still goes out as lines.
+ */
+static void switchToBinary(conn_t *conn, conn_pool_t *pool) {
+    if (queueControl(conn, BINARY_LINE, sizeof(BINARY_LINE) - 1, pool) < 0) {
+        log_error("sd %d: cannot switch to binary framing", conn->fd);
+        return;
+    }
+    conn->framing = FRAMING_BINARY;
+    conn->line_msgs = conn->queued_msgs;
+    log_info("sd %d switched to binary framing", conn->fd);
+}
+
+/*
+ * Turn compression with the codec called name on or off for conn. Only
+ * binary clients can tell compressed messages from raw ones, everybody else
+ * is answered "/compress none" like a client asking for a codec the server
+ * does not have. What was queued before goes out raw.
+ */
+static void setCodec(conn_t *conn, const char *name, int len, conn_pool_t *pool) {
+    int codec = codec_lookup(name, len);
+    if (codec < 0 || conn->framing != FRAMING_BINARY || pool->compress->level == 0)
+        codec = CODEC_NONE;
+    if (codec != conn->codec) {
+        atomic_fetch_add_explicit(&pool->compress->clients, codec != CODEC_NONE ? 1 : -1, memory_order_relaxed);
+        conn->codec = codec;
+        conn->raw_msgs = conn->queued_msgs;
+    }
+    char answer[32];
+    int answerLen = snprintf(answer, sizeof(answer), "/compress %s\n", codec_name(codec));
+    queueControl(conn, answer, answerLen, pool);
+}
+
+/*
+ * Handle "/join <room>", "/leave" (back to the lobby), "/pong", "/binary"
+ * and "/compress <codec>" from conn.
+ * @ return value - non-zero if line was a command
+ */
+static int clientCommand(conn_t *conn, const char *line, int len, conn_pool_t *pool) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    int id;
+    if (len > 6 && memcmp(line, "/join ", 6) == 0) {
+        id = room_lookup(pool->registry, line + 6, len - 6);
+        if (id < 0) {
+            log_warn("sd %d: invalid room name", conn->fd);
+            return 1;
+        }
+    } else if (len == 6 && memcmp(line, "/leave", 6) == 0) {
+        id = LOBBY_ROOM;
+    } else if (len == 5 && memcmp(line, "/pong", 5) == 0) {
+        /* reading it was all a pong is for */
+        return 1;
+    } else if (len == 7 && memcmp(line, "/binary", 7) == 0) {
+        if (conn->framing == FRAMING_LINE)
+            switchToBinary(conn, pool);
+        return 1;
+    } else if (len > 10 && memcmp(line, "/compress ", 10) == 0) {
+        setCodec(conn, line + 10, len - 10, pool);
+        return 1;
+    } else {
+        return 0;
+    }
+    if (id == conn->room)
+        return 1;
+    int previous = conn->room;
+    int previousIdx = conn->room_idx;
+    if (joinRoom(conn, id, pool) < 0) {
+        log_error("sd %d: cannot join room %s", conn->fd, room_info(pool->registry, id)->name);
+        return 1;
+    }
+    leaveRoom(previous, previousIdx, pool);
+    replayHistory(conn, pool);
+    log_info("sd %d joined room \"%s\"", conn->fd, room_info(pool->registry, id)->name);
+    return 1;
+}
+
+/*
+ * Attach a compressed copy to body, if it is big enough, somebody asked for
+ * compression and it gets smaller. This is the only place a message is
+ * compressed, all workers share the copy.
+ */
+static void compressBody(msg_body_t *body, conn_pool_t *pool) {
+    compress_config_t *compress = pool->compress;
+    if (body->size < compress->min_size || atomic_load_explicit(&compress->clients, memory_order_relaxed) == 0)
+        return;
+    const char *out;
+    uint64_t start = metrics_now();
+    int len = compressor_run(&pool->compressor, body->data, body->size, &out);
+    metric_add(&pool->metrics.compress_ns, metrics_now() - start);
+    metric_add(&pool->metrics.compress_in, (uint64_t) body->size);
+    if (len < 0)
+        return;
+    msg_body_t *compressed = msg_body_alloc(len, FRAME_MESSAGE);
+    if (compressed == NULL)
+        return;
+    memcpy(compressed->data, out, len);
+    setFrame(compressed, FRAME_MESSAGE, FRAME_COMPRESSED);
+    compressed->room = body->room;
+    body->compressed = compressed;
+    metric_add(&pool->metrics.compressed, 1);
+    metric_add(&pool->metrics.compress_out, (uint64_t) len);
+}
+
+/*
+ * Attach the WebSocket frame of body if there are WebSocket clients to send
+ * it to: a text frame if it is valid UTF-8, a binary one if not. Like the
+ * compressed copy it is built once here and shared by all workers.
+ */
+static void frameWebSocket(msg_body_t *body, conn_pool_t *pool) {
+    if (!pool->websocket)
+        return;
+    int opcode = ws_utf8_valid(body->data, (size_t) body->size) ? WS_TEXT : WS_BINARY;
+    if ((body->websocket = websocketCopy(body->data, body->size, opcode)) != NULL)
+        metric_add(&pool->metrics.ws_frames, 1);
+}
+
+/*
+ * Journal body, queue it on all connections of its room on this worker but
+ * sd and hand it to the other workers. Takes over the caller's reference.
+ */
+static int fanOut(int sd, msg_body_t *body, conn_pool_t *pool) {
+    journal_append(body);
+    compressBody(body, pool);
+    frameWebSocket(body, pool);
+    int status = add_body(sd, body, pool);
+    if (pool->worker != NULL && worker_forward(pool->worker, body) < 0)
+        status = ERROR;
+    /* drop the reference held while fanning out */
+    msg_body_unref(body);
+    return status;
+}
+
+/*
+ * Queue body, read from sd, on all other connections of its room on this
+ * worker, and hand it to the other workers and the peer nodes. Takes over
+ * the caller's reference.
+ */
+static int publishBody(int sd, msg_body_t *body, conn_pool_t *pool) {
+    conn_t *origin = find_conn(sd, pool);
+    if (origin != NULL && (pool->limits->rate_msgs > 0 || pool->limits->rate_bytes > 0))
+        rateCharge(origin, body->size, pool);
+    metric_add(&pool->metrics.msgs_in, 1);
+    metric_add(&pool->metrics.bytes_in, (uint64_t) body->size);
+    if (pool->worker != NULL)
+        federation_publish(pool->worker, body);
+    return fanOut(sd, body, pool);
+}
+
+int add_peer_body(msg_body_t *body, conn_pool_t *pool) {
+    return fanOut(-1, body, pool);
+}
+
+void restore_history(msg_body_t *body, conn_pool_t *pool) {
+    if (body->websocket == NULL)
+        frameWebSocket(body, pool);
+    if (reserveRoom(body->room, pool) == SUCCESS)
+        historyPush(&pool->rooms[body->room], body, pool);
+}
+
+/*
+ * Can conn move to another process? Not while OpenSSL holds part of its
+ * state, only a connection kTLS took over in both directions can.
+ */
+static int canHandOff(const conn_t *conn) {
+    if (conn->fd < 0 || conn->write_inflight)
+        return 0;
+    return conn->ssl == NULL || (!conn->handshaking && !conn->tls_read && !conn->tls_write && !conn->tls_retry);
+}
+
+/*
+ * Put body with its frame header and copies, only the first time however
+ * many queues hold it.
+ */
+static void exportBody(handoff_buf_t *buf, const msg_body_t *body, conn_pool_t *pool) {
+    handoff_put8(buf, body != NULL);
+    if (body == NULL || !handoff_put_object(buf, body))
+        return;
+    handoff_put32(buf, (uint32_t) body->size);
+    handoff_put8(buf, body->frame_len);
+    handoff_put(buf, body->frame + sizeof(body->frame) - body->frame_len, body->frame_len);
+    handoff_put(buf, body->data, (size_t) body->size);
+    handoff_put_string(buf, room_info(pool->registry, body->room)->name);
+    exportBody(buf, body->compressed, pool);
+    exportBody(buf, body->websocket, pool);
+}
+
+/*
+ * Get a body put by exportBody().
+ * @ return value - the body, held by the object table of buf, NULL for none or on failure
+ */
+static msg_body_t *importBody(handoff_buf_t *buf, conn_pool_t *pool) {
+    const void *known;
+    if (!handoff_get8(buf) || handoff_get_object(buf, &known) < 0)
+        return NULL;
+    if (known != NULL)
+        return (msg_body_t *) known;
+    uint32_t size = handoff_get32(buf);
+    int frameLen = handoff_get8(buf);
+    msg_body_t *body = NULL;
+    if (buf->failed || size > MAX_FRAME_LIMIT || frameLen > WIRE_HEADER_MAX
+        || (body = msg_body_alloc((int) size, FRAME_MESSAGE)) == NULL) {
+        buf->failed = 1;
+        return NULL;
+    }
+    /* the table holds the reference, the body has to be in it before its copies */
+    handoff_got_object(buf, body);
+    char frame[WIRE_HEADER_MAX];
+    handoff_get(buf, frame, (size_t) frameLen);
+    placeHeader(body, frame, frameLen);
+    handoff_get(buf, body->data, size);
+    char room[256];
+    int roomLen = handoff_get_string(buf, room);
+    int id = roomLen == 0 ? LOBBY_ROOM : room_lookup(pool->registry, room, roomLen);
+    body->room = id < 0 ? LOBBY_ROOM : id;
+    msg_body_t *copy = importBody(buf, pool);
+    body->compressed = copy != NULL ? msg_body_ref(copy) : NULL;
+    copy = importBody(buf, pool);
+    body->websocket = copy != NULL ? msg_body_ref(copy) : NULL;
+    return body;
+}
+
+static void exportConn(handoff_buf_t *buf, conn_t *conn, conn_pool_t *pool) {
+    handoff_put_fd(buf, conn->fd);
+    handoff_put8(buf, (uint8_t) conn->framing);
+    handoff_put32(buf, (uint32_t) conn->line_msgs);
+    handoff_put32(buf, (uint32_t) conn->codec);
+    handoff_put32(buf, (uint32_t) conn->raw_msgs);
+    handoff_put8(buf, (uint8_t) conn->closing);
+    handoff_put_string(buf, room_info(pool->registry, conn->room)->name);
+    char input[LINE_BUFFER_SIZE];
+    int len = line_buffer_peek(&conn->input, input, sizeof(input));
+    handoff_put32(buf, (uint32_t) len);
+    handoff_put(buf, input, (size_t) len);
+    handoff_put8(buf, conn->partial != NULL);
+    if (conn->partial != NULL) {
+        handoff_put32(buf, (uint32_t) conn->partial->size);
+        handoff_put32(buf, (uint32_t) conn->partial_len);
+        handoff_put32(buf, (uint32_t) conn->partial_type);
+        handoff_put(buf, conn->ws_mask, sizeof(conn->ws_mask));
+        handoff_put(buf, conn->partial->data, (size_t) conn->partial_len);
+    }
+    handoff_put8(buf, conn->upgrade != NULL);
+    if (conn->upgrade != NULL)
+        handoff_put(buf, conn->upgrade, sizeof(ws_upgrade_t));
+    /* the clock is the same for the next process, so are the deadlines */
+    handoff_put(buf, &conn->msgs_full_at, sizeof(conn->msgs_full_at));
+    handoff_put(buf, &conn->bytes_full_at, sizeof(conn->bytes_full_at));
+    handoff_put8(buf, (uint8_t) conn->throttled);
+    handoff_put32(buf, (uint32_t) conn->queued_msgs);
+    handoff_put32(buf, (uint32_t) conn->write_offset);
+    for (msg_t *msg = conn->write_msg_head; msg != NULL; msg = msg->next)
+        exportBody(buf, msg->body, pool);
+    /* the session goes away with this process, the kernel keeps encrypting for the next one */
+    if (conn->ssl != NULL)
+        SSL_set_quiet_shutdown(conn->ssl, 1);
+}
+
+/*
+ * Get a connection put by exportConn() and make it a connection of pool
+ * with the same room, input and queue.
+ * @ return value - 0 on success, -1 if it could not be added (it is closed)
+ */
+static int importConn(handoff_buf_t *buf, conn_pool_t *pool) {
+    int fd = handoff_get_fd(buf);
+    int framing = handoff_get8(buf);
+    int lineMsgs = (int) handoff_get32(buf);
+    int codec = (int) handoff_get32(buf);
+    int rawMsgs = (int) handoff_get32(buf);
+    int closing = handoff_get8(buf);
+    char room[256];
+    int roomLen = handoff_get_string(buf, room);
+    char input[LINE_BUFFER_SIZE];
+    uint32_t inputLen = handoff_get32(buf);
+    if (inputLen > sizeof(input))
+        buf->failed = 1;
+    handoff_get(buf, input, inputLen);
+    msg_body_t *partial = NULL;
+    int partialLen = 0, partialType = 0;
+    unsigned char mask[4];
+    if (handoff_get8(buf)) {
+        uint32_t size = handoff_get32(buf);
+        partialLen = (int) handoff_get32(buf);
+        partialType = (int) handoff_get32(buf);
+        handoff_get(buf, mask, sizeof(mask));
+        /* one byte more for the newline a WebSocket message may need */
+        if (buf->failed || size > MAX_FRAME_LIMIT || (uint32_t) partialLen > size
+            || (partial = msg_body_alloc((int) size + 1, FRAME_MESSAGE)) == NULL) {
+            buf->failed = 1;
+        } else {
+            partial->size = (int) size;
+            handoff_get(buf, partial->data, (size_t) partialLen);
+        }
+    }
+    ws_upgrade_t upgrade;
+    int hasUpgrade = handoff_get8(buf);
+    if (hasUpgrade)
+        handoff_get(buf, &upgrade, sizeof(upgrade));
+    uint64_t msgsFullAt = 0, bytesFullAt = 0;
+    handoff_get(buf, &msgsFullAt, sizeof(msgsFullAt));
+    handoff_get(buf, &bytesFullAt, sizeof(bytesFullAt));
+    int throttled = handoff_get8(buf);
+    uint32_t nrMsgs = handoff_get32(buf);
+    int writeOffset = (int) handoff_get32(buf);
+    msg_body_t **queue = !buf->failed && nrMsgs > 0 ? malloc(nrMsgs * sizeof(msg_body_t *)) : NULL;
+    if (nrMsgs > 0 && queue == NULL)
+        buf->failed = 1;
+    for (uint32_t i = 0; !buf->failed && i < nrMsgs; i++)
+        queue[i] = importBody(buf, pool);
+    conn_t *conn = buf->failed || fd < 0 ? NULL : createConn(fd, framing, NULL, pool);
+    if (conn == NULL) {
+        if (fd >= 0)
+            close(fd);
+        if (partial != NULL)
+            msg_body_unref(partial);
+        free(queue);
+        return ERROR;
+    }
+    conn->line_msgs = lineMsgs;
+    conn->codec = codec;
+    conn->raw_msgs = rawMsgs;
+    conn->closing = closing;
+    if (codec != CODEC_NONE)
+        atomic_fetch_add_explicit(&pool->compress->clients, 1, memory_order_relaxed);
+    if (inputLen > 0)
+        line_buffer_append(&conn->input, input, (int) inputLen);
+    conn->partial = partial;
+    conn->partial_len = partialLen;
+    conn->partial_type = partialType;
+    memcpy(conn->ws_mask, mask, sizeof(mask));
+    if (hasUpgrade && conn->upgrade != NULL)
+        *conn->upgrade = upgrade;
+    conn->msgs_full_at = msgsFullAt;
+    conn->bytes_full_at = bytesFullAt;
+    uint64_t now = metrics_now();
+    uint64_t fullAt = msgsFullAt > bytesFullAt ? msgsFullAt : bytesFullAt;
+    if (throttled || fullAt >= now + RATE_BURST_NS) {
+        /*
+         * held back as rateCharge() left it, the throttle itself was counted
+         * before: its timer passes on what is waiting, even if the deadline
+         * went by during the handoff
+         */
+        uint64_t deadline = fullAt >= now + RATE_BURST_NS ? fullAt - RATE_BURST_NS + 1 : now;
+        conn->throttled = 1;
+        conn->throttled_since = now;
+        updateInterest(conn, pool);
+        wheel_schedule(&pool->timers, &conn->rate_timer, deadline);
+        metric_add(&pool->metrics.throttled, 1);
+    }
+    int id = roomLen == 0 ? LOBBY_ROOM : room_lookup(pool->registry, room, roomLen);
+    if (id > LOBBY_ROOM) {
+        int previousIdx = conn->room_idx;
+        if (joinRoom(conn, id, pool) == SUCCESS)
+            leaveRoom(LOBBY_ROOM, previousIdx, pool);
+    }
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < nrMsgs && queue[i] != NULL; i++) {
+        msg_t *msg = slab_alloc(&pool->arena.msgs);
+        if (msg == NULL)
+            break;
+        msg->body = msg_body_ref(queue[i]);
+        bytes += queue[i]->size;
+        if (appendMsg(conn, msg, pool) < 0)
+            break;
+    }
+    /* the head message may be half written, the rest of it goes first */
+    if (conn->write_msg_head != NULL)
+        conn->write_offset = writeOffset;
+    atomic_fetch_add_explicit(&pool->limits->queued_bytes, bytes, memory_order_relaxed);
+    metric_add(&pool->metrics.queued_msgs, (uint64_t) conn->queued_msgs);
+    metric_add(&pool->metrics.queued_bytes, bytes);
+    free(queue);
+    return SUCCESS;
+}
+
+int export_conns(struct worker_group *group, handoff_buf_t *buf) {
+    int exported = 0;
+    handoff_put32(buf, (uint32_t) group->nr_workers);
+    for (int i = 0; i < group->nr_workers; i++) {
+        conn_pool_t *pool = group->workers[i].pool;
+        uint32_t nr = 0;
+        for (unsigned int j = 0; j < pool->nr_conns; j++)
+            nr += canHandOff(pool->conns[j]);
+        handoff_put32(buf, nr);
+        for (unsigned int j = 0; j < pool->nr_conns; j++) {
+            if (canHandOff(pool->conns[j])) {
+                exportConn(buf, pool->conns[j], pool);
+                exported++;
             }
-            else
-                pool->conn_head= NULL;
-            if (cur->write_msg_head != NULL) {
-                msg_t *msg = cur->write_msg_head;
-                while (msg != NULL) {
-                    msg_t *next = msg->next;
-                    msg_t *prev = msg->prev;
-                    if (next == NULL){
-                        free(msg);
-                        break;
-                    }
-                    if (prev != NULL)
-                        free(prev);
-                    if (msg->message != NULL)
-                        free(msg->message);
-
-                    msg = next;
-                }
+        }
+    }
+    return buf->failed ? ERROR : exported;
+}
+
+int import_conns(handoff_buf_t *buf, struct worker_group *group) {
+    int imported = 0;
+    uint32_t nrPools = handoff_get32(buf);
+    for (uint32_t i = 0; i < nrPools && !buf->failed; i++) {
+        /* a connection stays with the same worker, if there are as many */
+        conn_pool_t *pool = group->workers[i % group->nr_workers].pool;
+        arena_set_current(&pool->arena);
+        uint32_t nr = handoff_get32(buf);
+        for (uint32_t j = 0; j < nr && !buf->failed; j++)
+            imported += importConn(buf, pool) == SUCCESS;
+    }
+    arena_set_current(NULL);
+    /* the queues hold their own references now */
+    for (uint32_t i = 0; i < buf->nr_objects; i++)
+        msg_body_unref((msg_body_t *) buf->objects[i]);
+    buf->nr_objects = 0;
+    return buf->failed ? ERROR : imported;
+}
+
+int add_msg(int sd, const char *buffer, int len, conn_pool_t *pool) {
+
+    /*
+     * 1. handle commands, they are not passed on
+     * 2. copy the msg once into a shared body
+     * 3. queue it on all other connections of the origin's room on this worker
+     * 4. hand it to the other workers
+     */
+
+    conn_t *origin = find_conn(sd, pool);
+    if (origin != NULL && len > 0 && buffer[0] == '/' && clientCommand(origin, buffer, len, pool))
+        return SUCCESS;
+    msg_body_t *body = msg_body_create(buffer, len);
+    if (body == NULL)
+        return ERROR;
+    body->room = origin != NULL ? origin->room : LOBBY_ROOM;
+    return publishBody(sd, body, pool);
+}
+
+/*
+ * Make the message in body a line, whatever the framing it came in, so line
+ * clients can tell messages apart: end it with a newline if it lacks one, in
+ * the byte its allocation left for it, and build its frame header for the
+ * final size.
+ */
+static void terminateLine(msg_body_t *body) {
+    if (body->size > 0 && body->data[body->size - 1] != '\n')
+        body->data[body->size++] = '\n';
+    body->data[body->size] = '\0';
+    setFrame(body, FRAME_MESSAGE, 0);
+}
+
+/*
+ * Act on a complete frame from conn: run a command or publish a message.
+ * Takes over the reference to body.
+ */
+static void frameReceived(conn_t *conn, msg_body_t *body, int type, conn_pool_t *pool) {
+    if (type == FRAME_CONTROL) {
+        if (!clientCommand(conn, body->data, body->size, pool))
+            log_warn("sd %d: unknown command", conn->fd);
+        msg_body_unref(body);
+        return;
+    }
+    if (body->size == 0) {
+        /* line clients would be sent nothing at all */
+        msg_body_unref(body);
+        return;
+    }
+    terminateLine(body);
+    body->room = conn->room;
+    /* the payload may have taken a while, it is queued from now on */
+    body->created_ns = metrics_now();
+    publishBody(conn->fd, body, pool);
+}
+
+/*
+ * Act on a complete frame from a WebSocket client: publish a message or run
+ * a command, answer a ping, or answer a close and close once that is out.
+ * Takes over the reference to body.
+ * @ return value - 0 on success, -1 if conn has to go
+ */
+static int websocketReceived(conn_t *conn, msg_body_t *body, int opcode, conn_pool_t *pool) {
+    int status = SUCCESS;
+    ws_unmask(body->data, (size_t) body->size, conn->ws_mask);
+    switch (opcode) {
+        case WS_TEXT:
+        case WS_BINARY:
+            terminateLine(body);
+            if (body->size > 0 && body->data[0] == '/' && clientCommand(conn, body->data, body->size, pool))
+                break;
+            frameReceived(conn, body, FRAME_MESSAGE, pool);
+            return SUCCESS;
+        case WS_PING:
+            status = queueFrame(conn, WS_PONG, body->data, body->size, pool);
+            break;
+        case WS_CLOSE:
+            /* echo the status code, if there is one */
+            status = queueFrame(conn, WS_CLOSE, body->data, body->size < 2 ? body->size : 2, pool);
+            conn->closing = 1;
+            log_info("sd %d: WebSocket closed by the client", conn->fd);
+            break;
+        default:
+            /* a pong, reading it was all it is for */
+            break;
+    }
+    msg_body_unref(body);
+    return status;
+}
+
+/*
+ * Take the header of the next frame of a WebSocket client from the input
+ * ring and allocate the body its payload is read into.
+ * @ return value - 1 once the header was taken, 0 if it is not complete yet,
+ *   -1 if conn broke the protocol or sent a fragmented message
+ */
+static int websocketHeader(conn_t *conn, conn_pool_t *pool) {
+    char raw[WS_CLIENT_HEADER_MAX];
+    ws_header_t header;
+    int len = ws_header_decode(raw, line_buffer_peek(&conn->input, raw, WS_CLIENT_HEADER_MAX), &header);
+    if (len == 0)
+        return 0;
+    if (len < 0 || header.length > pool->limits->max_frame) {
+        log_warn("sd %d: bad WebSocket frame header", conn->fd);
+        return ERROR;
+    }
+    if (!header.fin || header.opcode == WS_CONTINUATION) {
+        log_warn("sd %d: fragmented WebSocket messages are not supported", conn->fd);
+        return ERROR;
+    }
+    line_buffer_take(&conn->input, NULL, len);
+    /* one byte more for the newline a message may need */
+    msg_body_t *body = msg_body_alloc((int) header.length + 1, FRAME_MESSAGE);
+    if (body == NULL)
+        return ERROR;
+    body->size = (int) header.length;
+    conn->partial = body;
+    conn->partial_len = 0;
+    conn->partial_type = header.opcode;
+    memcpy(conn->ws_mask, header.mask, sizeof(conn->ws_mask));
+    return 1;
+}
+
+/*
+ * Take the lines of the upgrade request of conn from its input ring. Once it
+ * is complete conn is answered and, if it was a valid WebSocket request,
+ * upgraded and sent its room's history. A refused client is closed once the
+ * answer is out.
+ * @ return value - 0 on success, -1 if the request is too long and conn has to go
+ */
+static int upgradeRequest(conn_t *conn, conn_pool_t *pool) {
+    line_buffer_t *input = &conn->input;
+    const char *line;
+    int len;
+    while ((len = line_buffer_next(input, &line, pool->line_scratch, 0)) > 0) {
+        int done = ws_upgrade_line(conn->upgrade, line, len);
+        if (done < 0)
+            break;
+        if (done == 0)
+            continue;
+        char answer[256];
+        int answerLen = ws_upgrade_answer(conn->upgrade, answer, sizeof(answer));
+        free(conn->upgrade);
+        conn->upgrade = NULL;
+        /* from here on only frames are read, and only WebSocket copies written */
+        conn->framing = FRAMING_WEBSOCKET;
+        if (answerLen < 0) {
+            log_warn("sd %d: not a WebSocket upgrade request", conn->fd);
+            metric_add(&pool->metrics.ws_rejected, 1);
+            conn->closing = 1;
+            return queueFrame(conn, WS_RAW, answer, -answerLen, pool);
+        }
+        if (queueFrame(conn, WS_RAW, answer, answerLen, pool) < 0)
+            return ERROR;
+        replayHistory(conn, pool);
+        metric_add(&pool->metrics.ws_upgrades, 1);
+        log_info("sd %d upgraded to WebSocket", conn->fd);
+        return SUCCESS;
+    }
+    if (len == 0 && input->tail - input->head < LINE_BUFFER_SIZE)
+        return SUCCESS;
+    log_warn("sd %d: upgrade request too long", conn->fd);
+    return ERROR;
+}
+
+int drain_frames(conn_t *conn, conn_pool_t *pool) {
+    line_buffer_t *input = &conn->input;
+    if (conn->framing == FRAMING_HTTP && upgradeRequest(conn, pool) < 0)
+        return ERROR;
+    while (conn->framing != FRAMING_HTTP) {
+        if (conn->closing) {
+            /* nothing the client sends after a close counts */
+            line_buffer_take(input, NULL, LINE_BUFFER_SIZE);
+            if (conn->partial != NULL) {
+                msg_body_unref(conn->partial);
+                conn->partial = NULL;
             }
+            return SUCCESS;
         }
-        cur = cur->next;
-    }
-    FD_CLR(sd, &(pool->read_set));
-    FD_CLR(sd, &(pool->write_set));
-    FD_CLR(sd, &(pool->ready_read_set));
-    FD_CLR(sd, &(pool->ready_write_set));
-    pool->nr_conns--;
-    if (sd >= pool->maxfd) {
-        pool->maxfd = 3;
-        if (pool->nr_conns > 0) {
-            cur = pool->conn_head;
-            while (cur != NULL) {
-                if (cur->fd > pool->maxfd)
-                    pool->maxfd = cur->fd;
-                cur = cur->next;
+        /* over its rate: the rest waits in the ring, or in the socket */
+        if (conn->throttled)
+            return SUCCESS;
+        msg_body_t *body = conn->partial;
+        if (body != NULL) {
+            int missing = body->size - conn->partial_len;
+            conn->partial_len += line_buffer_take(input, body->data + conn->partial_len, missing);
+            if (conn->partial_len < body->size)
+                return SUCCESS;
+            conn->partial = NULL;
+            if (conn->framing == FRAMING_WEBSOCKET) {
+                if (websocketReceived(conn, body, conn->partial_type, pool) < 0)
+                    return ERROR;
+            } else {
+                frameReceived(conn, body, conn->partial_type, pool);
             }
+            continue;
+        }
+        if (conn->framing == FRAMING_WEBSOCKET) {
+            int taken = websocketHeader(conn, pool);
+            if (taken <= 0)
+                return taken;
+            continue;
         }
+        char raw[FRAME_HEADER_MAX];
+        frame_header_t header;
+        int len = frame_header_decode(raw, line_buffer_peek(input, raw, FRAME_HEADER_MAX), &header);
+        if (len == 0)
+            return SUCCESS;
+        if (len < 0 || header.type > FRAME_CONTROL || header.flags != 0 || header.length > pool->limits->max_frame) {
+            log_warn("sd %d: bad frame header", conn->fd);
+            return ERROR;
+        }
+        line_buffer_take(input, NULL, len);
+        /* the body is only ever fanned out as a message, commands stay here; one byte more for its newline */
+        body = msg_body_alloc((int) header.length + 1, FRAME_MESSAGE);
+        if (body == NULL)
+            return ERROR;
+        body->size = (int) header.length;
+        conn->partial = body;
+        conn->partial_len = 0;
+        conn->partial_type = header.type;
     }
-    close(sd);
-    free(cur);
     return SUCCESS;
 }
 
-int add_msg(int sd, char *buffer, int len, conn_pool_t *pool) {
+/*
+ * Would queueing size more bytes take cur over its limits or the global
+ * budget? The budget only holds back connections that have a backlog, so a
+ * reader keeping up is never punished for the slow ones.
+ * @ slack - multiplier of the limits, SLOW_PAUSE tolerates what the
+ *   publisher sent before it was paused
+ */
+static int queueFull(conn_t *cur, int size, int slack, conn_pool_t *pool) {
+    queue_limits_t *limits = pool->limits;
+    if (cur->queued_bytes + size > limits->max_bytes * slack || cur->queued_msgs >= limits->max_msgs * slack)
+        return 1;
+    return limits->budget > 0 && cur->queued_msgs > 0
+           && atomic_load_explicit(&limits->queued_bytes, memory_order_relaxed) + size > limits->budget * slack;
+}
+
+/*
+ * Drop queued messages of cur, oldest first, until size more bytes fit. The
+ * messages being written (partly written, in flight or in a record OpenSSL
+ * holds on to) have to stay.
+ */
+static void dropOldest(conn_t *cur, int size, conn_pool_t *pool) {
+    int pinned = cur->write_inflight || cur->tls_retry ? cur->write_pinned : cur->write_offset > 0;
+    msg_t *msg = cur->write_msg_head;
+    for (int i = 0; i < pinned && msg != NULL; i++)
+        msg = msg->next;
+    while (msg != NULL && queueFull(cur, size, 1, pool)) {
+        msg_t *next = msg->next;
+        if (msg->prev != NULL)
+            msg->prev->next = next;
+        else
+            cur->write_msg_head = next;
+        if (next != NULL)
+            next->prev = msg->prev;
+        else
+            cur->write_msg_tail = msg->prev;
+        /* every message dropped is the one at position pinned */
+        if (pinned < cur->line_msgs)
+            cur->line_msgs--;
+        if (pinned < cur->raw_msgs)
+            cur->raw_msgs--;
+        dequeued(cur, msg->body->size, 1, pool);
+        msg_body_unref(msg->body);
+        slab_free(&pool->arena.msgs, msg);
+        atomic_fetch_add_explicit(&pool->queue_stats.dropped_oldest, 1, memory_order_relaxed);
+        msg = next;
+    }
+}
+
+/*
+ * Stop reading from a publisher until resume_publishers().
+ */
+static void pausePublisher(conn_t *conn, conn_pool_t *pool) {
+    if (pushFd(&pool->paused_fds, &pool->nr_paused, &pool->paused_cap, conn->fd) < 0)
+        return;
+    conn->paused = 1;
+    updateInterest(conn, pool);
+    atomic_fetch_add_explicit(&pool->queue_stats.pauses, 1, memory_order_relaxed);
+}
+
+/*
+ * Apply the slow consumer policy to cur, whose queue has no room for size
+ * more bytes.
+ * @ origin - the publisher if it is a connection of this pool, else NULL
+ * @ return value - non-zero if the message should still be queued
+ */
+static int slowConsumer(conn_t *cur, int size, conn_t *origin, conn_pool_t *pool) {
+    queue_stats_t *stats = &pool->queue_stats;
+    switch (pool->limits->policy) {
+        case SLOW_DISCONNECT:
+            if (pushFd(&pool->doomed_fds, &pool->nr_doomed, &pool->doomed_cap, cur->fd) == SUCCESS)
+                atomic_fetch_add_explicit(&stats->disconnects, 1, memory_order_relaxed);
+            return 0;
+        case SLOW_DROP_OLDEST:
+            dropOldest(cur, size, pool);
+            if (!queueFull(cur, size, 1, pool))
+                return 1;
+            break;
+        case SLOW_PAUSE:
+            if (!cur->over_limit) {
+                cur->over_limit = 1;
+                pool->nr_over_limit++;
+            }
+            if (origin != NULL && !origin->paused)
+                pausePublisher(origin, pool);
+            /* publishers on other workers cannot be paused from here */
+            if (!queueFull(cur, size, 2, pool))
+                return 1;
+            break;
+        case SLOW_DROP_NEWEST:
+            break;
+    }
+    atomic_fetch_add_explicit(&stats->dropped_newest, 1, memory_order_relaxed);
+    return 0;
+}
+
+int add_body(int sd, msg_body_t *body, conn_pool_t *pool) {
 
     /*
-     * 1. add msg_t to write queue of all other connections
-     * 2. set each fd to check if ready to write`
+     * 1. keep a reference in the history of the body's room
+     * 2. add msg_t pointing at the body to write queue of all other members of
+     *    its room, unless the slow consumer policy says otherwise
+     * 3. put each fd in the flush list of this iteration
+     * 4. take all the references at once, the caller's keeps the body alive meanwhile
+     * 5. close the connections the policy gave up on
      */
 
-    conn_t *cur = pool->conn_head;
-    while (cur != NULL) {
-        if (cur->fd != sd) {
-            msg_t *msg = malloc(sizeof(msg_t));
-            msg->message = malloc(len + 1);
-            memcpy(msg->message, buffer, len);
-            msg->message[len] = '\0';
-            msg->size = len;
-            msg->next = NULL;
-            msg->prev = cur->write_msg_tail;
-            cur->write_msg_tail = msg;
-            FD_SET(cur->fd, &pool->write_set);
-            if(cur->write_msg_head == NULL){
-                cur->write_msg_head = NULL;
+    int status = SUCCESS;
+    int queued = 0;
+    conn_t *origin = find_conn(sd, pool);
+    room_t *room = NULL;
+    if (pool->registry->history_msgs > 0) {
+        /* every worker keeps the history of every room, members or not */
+        if (reserveRoom(body->room, pool) == SUCCESS) {
+            room = &pool->rooms[body->room];
+            historyPush(room, body, pool);
+        }
+    } else if (body->room < pool->rooms_cap) {
+        room = &pool->rooms[body->room];
+    }
+    for (int i = 0; room != NULL && i < room->nr_members; i++) {
+        conn_t *cur = room->members[i];
+        if (cur->fd == sd || cur->framing == FRAMING_HTTP || cur->closing)
+            continue;
+        /* left without a WebSocket copy by an allocation failure */
+        if (cur->framing == FRAMING_WEBSOCKET && body->websocket == NULL)
+            continue;
+        if (queueFull(cur, body->size, 1, pool)) {
+            if (cur->pending_flush && pool->backend->submit_write == NULL) {
+                /* a long read burst filled the queue before the end of the iteration, try the socket first */
+                cur->pending_flush = 0;
+                if (write_to_client(cur->fd, pool) < 0) {
+                    pushFd(&pool->doomed_fds, &pool->nr_doomed, &pool->doomed_cap, cur->fd);
+                    continue;
+                }
             }
+            if (queueFull(cur, body->size, 1, pool) && !slowConsumer(cur, body->size, origin, pool))
+                continue;
+        }
+        msg_t *msg = slab_alloc(&pool->arena.msgs);
+        if (msg == NULL) {
+            status = ERROR;
+            break;
+        }
+        msg->body = body;
+        queued++;
+        if (appendMsg(cur, msg, pool) < 0) {
+            status = ERROR;
+            break;
+        }
+    }
+    if (queued > 0) {
+        atomic_fetch_add_explicit(&body->refcount, queued, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->limits->queued_bytes, (size_t) queued * body->size, memory_order_relaxed);
+        metric_add(&pool->metrics.queued_msgs, (uint64_t) queued);
+        metric_add(&pool->metrics.queued_bytes, (uint64_t) queued * body->size);
+    }
+    for (int i = 0; i < pool->nr_doomed; i++) {
+        log_warn("closing slow connection %d", pool->doomed_fds[i]);
+        remove_conn(pool->doomed_fds[i], pool);
+    }
+    pool->nr_doomed = 0;
+    return status;
+}
+
+void flush_pending(conn_pool_t *pool) {
+    queue_limits_t *limits = pool->limits;
+    /* within the window only connections with flush_bytes queued are written, the rest wait for more */
+    int early = limits->flush_window > 0 && pool->nr_flush > 0 && metrics_now() < pool->flush_deadline;
+    int kept = 0;
+    for (int i = 0; i < pool->nr_flush; i++) {
+        conn_t *conn = find_conn(pool->flush_fds[i], pool);
+        if (conn == NULL || !conn->pending_flush)
+            continue;
+        if (early && conn->queued_bytes < limits->flush_bytes) {
+            pool->flush_fds[kept++] = conn->fd;
+            continue;
+        }
+        conn->pending_flush = 0;
+        if (write_to_client(conn->fd, pool) < 0)
+            remove_conn(conn->fd, pool);
+    }
+    pool->nr_flush = kept;
+}
+
+void resume_publishers(conn_pool_t *pool) {
+    queue_limits_t *limits = pool->limits;
+    if (pool->nr_paused == 0 || pool->nr_over_limit > 0)
+        return;
+    /* the budget has to drain to three quarters before anybody publishes again */
+    if (limits->budget > 0
+        && atomic_load_explicit(&limits->queued_bytes, memory_order_relaxed) > limits->budget / 4 * 3)
+        return;
+    int resumed = pool->nr_paused;
+    for (int i = 0; i < resumed; i++) {
+        conn_t *conn = find_conn(pool->paused_fds[i], pool);
+        if (conn == NULL || !conn->paused)
+            continue;
+        conn->paused = 0;
+        updateInterest(conn, pool);
+        /* an edge-triggered backend will not report the data that waited, nor anybody what OpenSSL holds */
+        if ((pool->backend->edge_triggered && pool->backend->submit_write == NULL) || conn->tls_read)
+            readFromClient(conn->fd, pool);
+    }
+    /* publishers paused again while reading stay in the list */
+    memmove(pool->paused_fds, pool->paused_fds + resumed, (pool->nr_paused - resumed) * sizeof(int));
+    pool->nr_paused -= resumed;
+}
+
+/*
+ * Does msg at position pos of the queue of cur go out compressed?
+ */
+static int sendCompressed(const conn_t *cur, const msg_t *msg, int pos) {
+    return cur->codec != CODEC_NONE && pos >= cur->raw_msgs && msg->body->compressed != NULL;
+}
+
+/*
+ * What goes on the wire of cur for msg at position pos of its queue: the
+ * frame header and the payload (or its compressed copy) for binary clients,
+ * the payload alone for line clients and for what was queued before the
+ * switch, the WebSocket copy for WebSocket clients.
+ * @ len - set to the number of bytes
+ */
+static char *wireData(const conn_t *cur, const msg_t *msg, int pos, int *len) {
+    if (cur->framing == FRAMING_WEBSOCKET) {
+        msg_body_t *frame = msg->body->websocket;
+        *len = frame->frame_len + frame->size;
+        return frame->data - frame->frame_len;
+    }
+    msg_body_t *body = sendCompressed(cur, msg, pos) ? msg->body->compressed : msg->body;
+    if (cur->framing == FRAMING_BINARY && pos >= cur->line_msgs) {
+        *len = body->frame_len + body->size;
+        return body->data - body->frame_len;
+    }
+    *len = body->size;
+    return body->data;
+}
+
+/*
+ * Describe the head of the queue (starting at write_offset) in iov.
+ * @ return value - number of entries used, *total is set to their length
+ */
+static int gatherQueue(conn_t *cur, struct iovec *iov, int max, size_t *total) {
+    int count = 0;
+    int offset = cur->write_offset;
+    *total = 0;
+    for (msg_t *msg = cur->write_msg_head; msg != NULL && count < max; msg = msg->next) {
+        int len;
+        iov[count].iov_base = wireData(cur, msg, count, &len) + offset;
+        iov[count].iov_len = len - offset;
+        *total += iov[count].iov_len;
+        offset = 0;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Drop the messages covered by written bytes from the head of the queue,
+ * remembering how much of a partly writen one went out.
+ */
+static void consumeWritten(conn_t *cur, size_t written, conn_pool_t *pool) {
+    size_t bytes = 0;
+    uint64_t saved = 0;
+    int msgs = 0;
+    uint64_t now = 0;
+    metric_add(&pool->metrics.bytes_out, written);
+    if (written > 0)
+        cur->last_progress = pool->now;
+    while (written > 0) {
+        msg_t *msg = cur->write_msg_head;
+        int len;
+        wireData(cur, msg, 0, &len);
+        size_t left = len - cur->write_offset;
+        if (written < left) {
+            cur->write_offset += (int) written;
+            break;
         }
-        cur = cur->next;
+        written -= left;
+        cur->write_offset = 0;
+        if (sendCompressed(cur, msg, 0))
+            saved += msg->body->frame_len + msg->body->size - len;
+        if (cur->line_msgs > 0)
+            cur->line_msgs--;
+        if (cur->raw_msgs > 0)
+            cur->raw_msgs--;
+        cur->write_msg_head = msg->next;
+        if (msg->next != NULL)
+            msg->next->prev = NULL;
+        else
+            cur->write_msg_tail = NULL;
+        bytes += msg->body->size;
+        msgs++;
+        if (now == 0)
+            now = metrics_now();
+        /* replayed history says nothing about queueing delay */
+        if (msg->body->created_ns >= cur->joined)
+            shared_hist_record(&pool->metrics.queue_time, now - msg->body->created_ns);
+        msg_body_unref(msg->body);
+        slab_free(&pool->arena.msgs, msg);
+    }
+    if (msgs > 0) {
+        dequeued(cur, bytes, msgs, pool);
+        metric_add(&pool->metrics.msgs_out, (uint64_t) msgs);
     }
+    if (saved > 0)
+        metric_add(&pool->metrics.compress_saved, saved);
+}
+
+/*
+ * Completion backend flush: submit the head of the queue as one writev, the
+ * submissions of all connections go to the kernel together on the next wait.
+ */
+static int submitWrite(conn_t *cur, conn_pool_t *pool) {
+    if (cur->write_inflight)
+        return SUCCESS;
+    if (cur->write_msg_head == NULL)
+        return cur->closing ? ERROR : SUCCESS;
+    if (cur->write_iov == NULL) {
+        cur->write_iov = malloc(SUBMIT_BATCH * sizeof(struct iovec));
+        if (cur->write_iov == NULL)
+            return ERROR;
+    }
+    size_t total;
+    int count = gatherQueue(cur, cur->write_iov, SUBMIT_BATCH, &total);
+    if (pool->backend->submit_write(pool->backend, cur->fd, cur->write_iov, count, cur) < 0)
+        return ERROR;
+    cur->write_inflight = 1;
+    cur->write_pinned = count;
+    metric_add(&pool->metrics.writes, 1);
+    return SUCCESS;
+}
+
+void write_completed(conn_t *conn, int res, conn_pool_t *pool) {
+    conn->write_inflight = 0;
+    conn->write_pinned = 0;
+    if (conn->fd < 0) {
+        /* removed while the write was in flight */
+        pool->nr_zombies--;
+        freeConn(conn, pool);
+        return;
+    }
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EINTR) {
+            submitWrite(conn, pool);
+            return;
+        }
+        remove_conn(conn->fd, pool);
+        return;
+    }
+    consumeWritten(conn, (size_t) res, pool);
+    if (submitWrite(conn, pool) < 0)
+        remove_conn(conn->fd, pool);
+}
+
+/*
+ * Completion backend input of a binary or WebSocket connection. Payloads are
+ * copied straight into their bodies, only frame headers (and the upgrade
+ * request) go through the ring.
+ */
+/*
+ * Keep len bytes a completion backend received after conn went over its rate.
+ */
+static int holdInput(conn_t *conn, const char *data, int len) {
+    char *held = realloc(conn->held, (size_t) conn->held_len + len);
+    if (held == NULL)
+        return ERROR;
+    memcpy(held + conn->held_len, data, len);
+    conn->held = held;
+    conn->held_len += len;
+    return SUCCESS;
+}
+
+static int receiveFrames(conn_t *conn, const char *data, int len, conn_pool_t *pool) {
+    /* the ring may still hold what came after "/binary" */
+    if (drain_frames(conn, pool) < 0)
+        return ERROR;
+    while (len > 0 && !conn->throttled) {
+        msg_body_t *body = conn->partial;
+        int copied;
+        if (body != NULL) {
+            copied = body->size - conn->partial_len < len ? body->size - conn->partial_len : len;
+            memcpy(body->data + conn->partial_len, data, copied);
+            conn->partial_len += copied;
+        } else if ((copied = line_buffer_append(&conn->input, data, len)) < 0) {
+            return ERROR;
+        }
+        data += copied;
+        len -= copied;
+        if (drain_frames(conn, pool) < 0)
+            return ERROR;
+    }
+    return len > 0 ? holdInput(conn, data, len) : SUCCESS;
+}
+
+int receive_from_client(int sd, const char *data, int len, conn_pool_t *pool) {
+    conn_t *conn = find_conn(sd, pool);
+    if (conn == NULL)
+        return ERROR;
+    line_buffer_t *input = &conn->input;
+    const char *line;
+    int lineLen;
+    conn->last_read = pool->now;
+    /* the recv is cancelled, what it still brings has to wait */
+    if (conn->throttled) {
+        if (holdInput(conn, data, len) < 0) {
+            remove_conn(sd, pool);
+            return ERROR;
+        }
+        return SUCCESS;
+    }
+    if (input->head == input->tail) {
+        /* nothing pending: complete lines go out straight from the receive buffer */
+        const char *nl;
+        while (conn->framing == FRAMING_LINE && !conn->throttled && len > 0
+               && (nl = find_newline(data, len)) != NULL) {
+            lineLen = (int) (nl - data) + 1;
+            add_msg(sd, data, lineLen, pool);
+            data += lineLen;
+            len -= lineLen;
+        }
+    }
+    while (conn->framing == FRAMING_LINE && !conn->throttled && len > 0) {
+        int copied = line_buffer_append(input, data, len);
+        if (copied < 0)
+            return ERROR;
+        data += copied;
+        len -= copied;
+        while (conn->framing == FRAMING_LINE && !conn->throttled
+               && (lineLen = line_buffer_next(input, &line, pool->line_scratch, 0)) > 0)
+            add_msg(sd, line, lineLen, pool);
+        if (copied == 0 && !conn->throttled) {
+            /* the line does not fit in the ring, pass on what we have of it */
+            lineLen = line_buffer_next(input, &line, pool->line_scratch, 1);
+            add_msg(sd, line, lineLen, pool);
+        }
+    }
+    if (conn->framing == FRAMING_LINE && len > 0 && holdInput(conn, data, len) < 0) {
+        remove_conn(sd, pool);
+        return ERROR;
+    }
+    if (conn->framing != FRAMING_LINE && receiveFrames(conn, data, len, pool) < 0) {
+        remove_conn(sd, pool);
+        return ERROR;
+    }
+    /* idle connections keep no input memory */
+    if (input->head == input->tail)
+        line_buffer_free(input);
+    return SUCCESS;
+}
+
+int continue_handshake(conn_t *conn, conn_pool_t *pool) {
+    int wantWrite;
+    int done = tls_handshake(conn->ssl, conn->fd, &wantWrite);
+    if (done < 0) {
+        metric_add(&pool->metrics.tls_failures, 1);
+        return ERROR;
+    }
+    setWriteInterest(conn, wantWrite, pool);
+    if (done == 0)
+        return SUCCESS;
+    conn->handshaking = 0;
+    conn->tls_write = !tls_ktls_send(conn->ssl);
+    conn->tls_read = !tls_ktls_recv(conn->ssl);
+    metric_add(&pool->metrics.tls_handshakes, 1);
+    metric_add(&pool->metrics.ktls_send, (uint64_t) !conn->tls_write);
+    metric_add(&pool->metrics.ktls_recv, (uint64_t) !conn->tls_read);
+    log_info("sd %d: %s, kTLS %s", conn->fd, SSL_get_version(conn->ssl),
+             conn->tls_write ? (conn->tls_read ? "off" : "receive only") : (conn->tls_read ? "send only" : "on"));
+    /* the history queued on accept waited for the handshake */
+    if (conn->write_msg_head != NULL && !conn->pending_flush)
+        scheduleFlush(conn, pool);
     return SUCCESS;
 }
 
+/*
+ * writev() where OpenSSL encrypts: iov is packed into records of up to
+ * TLS_RECORD_MAX bytes, so a burst of short messages costs one record and
+ * not one each. A record the socket did not take has to be offered again
+ * with the same bytes, the messages it covers are pinned until then.
+ * @ return value - as writev()
+ */
+static ssize_t writeRecords(conn_t *cur, const struct iovec *iov, int count, conn_pool_t *pool) {
+    char *record = pool->tls_record;
+    size_t written = 0;
+    size_t offset = 0;
+    int i = 0;
+    while (i < count) {
+        /* the record starts in message first, the head once written is consumed */
+        int first = i;
+        size_t len = 0;
+        while (i < count && len < TLS_RECORD_MAX) {
+            size_t n = iov[i].iov_len - offset;
+            if (n > TLS_RECORD_MAX - len)
+                n = TLS_RECORD_MAX - len;
+            memcpy(record + len, (char *) iov[i].iov_base + offset, n);
+            len += n;
+            offset += n;
+            if (offset == iov[i].iov_len) {
+                i++;
+                offset = 0;
+            }
+        }
+        if (tls_write(cur->ssl, record, len) < 0) {
+            if (errno == EAGAIN) {
+                cur->tls_retry = 1;
+                cur->write_pinned = i - first + (offset > 0);
+            }
+            return written > 0 ? (ssize_t) written : ERROR;
+        }
+        cur->tls_retry = 0;
+        cur->write_pinned = 0;
+        written += len;
+    }
+    return (ssize_t) written;
+}
+
 int write_to_client(int sd, conn_pool_t *pool) {
 
     /*
-     * 1. write all msgs in queue
-     * 2. deallocate each writen msg
+     * 1. gather queued msgs into one writev() until the socket buffer is full
+     * 2. deallocate each fully writen msg, remember how much of a partly writen one went out
      * 3. if all msgs were writen successfully, there is nothing else to write to this fd... */
 
-    conn_t *cur = pool->conn_head;
-    while (cur != NULL) {
-        if (cur->fd == sd) {
-            msg_t *msg = cur->write_msg_head;
-            while (msg != NULL) {
-                if (write(sd, msg->message, msg->size) < 0) {
-                    return ERROR;
-                }
-                msg_t *temp = msg;
-                msg = msg->next;
-                free(temp->message);
-                free(temp);
-
+    conn_t *cur = find_conn(sd, pool);
+    if (cur == NULL)
+        return ERROR;
+    if (cur->handshaking) {
+        if (continue_handshake(cur, pool) < 0)
+            return ERROR;
+        if (cur->handshaking)
+            return SUCCESS;
+    }
+    if (pool->backend->submit_write != NULL)
+        return submitWrite(cur, pool);
+    struct iovec iov[WRITEV_BATCH];
+    while (cur->write_msg_head != NULL) {
+        size_t total;
+        int count = gatherQueue(cur, iov, WRITEV_BATCH, &total);
+        ssize_t written = cur->tls_write ? writeRecords(cur, iov, count, pool) : writev(sd, iov, count);
+        metric_add(&pool->metrics.writes, 1);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* wait until the socket becomes writable again */
+                setWriteInterest(cur, 1, pool);
+                return SUCCESS;
             }
-            cur->write_msg_head = NULL;
-            cur->write_msg_tail = NULL;
-            FD_CLR(sd, &pool->write_set);
-            FD_CLR(sd, &pool->ready_write_set);
+            return ERROR;
+        }
+        consumeWritten(cur, (size_t) written, pool);
+        if ((size_t) written < total) {
+            /* the socket buffer is full, resume from write_offset once it drains */
+            setWriteInterest(cur, 1, pool);
             return SUCCESS;
         }
-        cur = cur->next;
     }
-    return ERROR;
+    setWriteInterest(cur, 0, pool);
+    /* the last words of a closing connection are out */
+    return cur->closing ? ERROR : SUCCESS;
 }
@@ -1,32 +1,303 @@
 #ifndef CHAT_SERVER_H
 #define CHAT_SERVER_H
 
-#include <sys/select.h>
+#include <stdatomic.h>
+#include "compressor.h"
+#include "eventBackend.h"
+#include "federation.h"
+#include "frame.h"
+#include "handoff.h"
+#include "journal.h"
+#include "lineBuffer.h"
+#include "metrics.h"
+#include "room.h"
+#include "slab.h"
+#include "timerWheel.h"
+#include "tls.h"
+#include "websocket.h"
 
 #define BUFFER_SIZE 4096
+/* Room for the longest header put in front of a body: a binary frame header or a WebSocket one. */
+#define WIRE_HEADER_MAX WS_HEADER_MAX
+
+/*
+ * What happens to a message for a connection whose outbound queue is full.
+ */
+typedef enum slow_policy {
+    /* Close the slow connection. */
+    SLOW_DISCONNECT,
+    /* Make room by dropping queued messages, oldest first. */
+    SLOW_DROP_OLDEST,
+    /* Drop the new message. */
+    SLOW_DROP_NEWEST,
+    /* Stop reading from the publisher until the slow queues drained. */
+    SLOW_PAUSE
+} slow_policy_t;
+
+/*
+ * Bounds of the outbound queues, shared by all workers.
+ */
+typedef struct queue_limits {
+    /* Most bytes queued for one connection. */
+    size_t max_bytes;
+    /* Most messages queued for one connection. */
+    int max_msgs;
+    /* Applied when a queue is full. */
+    slow_policy_t policy;
+    /* Most bytes queued for all connections together, 0 for no limit. */
+    size_t budget;
+    /* Bytes queued for all connections of all workers. */
+    atomic_size_t queued_bytes;
+    /* Largest frame accepted from a binary client, bigger ones close it. */
+    uint32_t max_frame;
+    /*
+     * Messages and bytes per second one connection may publish, 0 for no
+     * limit. A second's worth may come at once, beyond that the connection
+     * is not read from until it is back under its rate.
+     */
+    uint32_t rate_msgs;
+    size_t rate_bytes;
+    /*
+     * Longest a queued message may wait for more to write with it (ns), 0
+     * writes every loop iteration. A connection with flush_bytes queued is
+     * written without waiting.
+     */
+    uint64_t flush_window;
+    size_t flush_bytes;
+} queue_limits_t;
+
+/*
+ * How often each slow consumer policy fired in one pool.
+ */
+typedef struct queue_stats {
+    atomic_ulong disconnects;
+    atomic_ulong dropped_oldest;
+    atomic_ulong dropped_newest;
+    atomic_ulong pauses;
+} queue_stats_t;
+
+/*
+ * Timeouts of the client connections, shared by all workers. 0 turns one off.
+ */
+typedef struct conn_timeouts {
+    /* Close a connection nothing was read from for this long (ns). */
+    uint64_t idle;
+    /* Send "/ping" to a connection nothing was read from for this long (ns). */
+    uint64_t ping;
+    /* Close a connection whose queue was not written to for this long (ns). */
+    uint64_t write_stall;
+} conn_timeouts_t;
+
+/*
+ * Compression of the messages sent to clients that asked for it, shared by
+ * all workers.
+ */
+typedef struct compress_config {
+    /* zlib level, 0 if clients may not turn compression on. */
+    int level;
+    /* Messages shorter than this go out raw. */
+    int min_size;
+    /* Connections with compression on, nothing is compressed while there are none. */
+    atomic_int clients;
+} compress_config_t;
+
+/*
+ * Startup options of the server.
+ */
+typedef struct server_config {
+    /* TCP port to listen on. */
+    int port;
+    /* Event backend name, NULL for the default. */
+    const char *backend;
+    /* Number of reactor threads, each with its own listener and pool. */
+    int workers;
+    /* Outbound queue bounds and slow consumer policy. */
+    size_t queue_max_bytes;
+    int queue_max_msgs;
+    slow_policy_t slow_policy;
+    size_t queue_budget;
+    /* Largest frame accepted from a binary client. */
+    uint32_t max_frame;
+    /* Messages and bytes per second a connection may publish, 0 for no limit. */
+    uint32_t rate_msgs;
+    size_t rate_bytes;
+    /* Longest a queued message waits to be written with others (ns), and the bytes that end the wait. */
+    uint64_t flush_window;
+    size_t flush_bytes;
+    /* zlib level of compressed messages (0 for none), and the smallest message compressed. */
+    int compress_level;
+    int compress_min;
+    /* Port of the Prometheus metrics listener, 0 for none, and the IPv4 address it binds. */
+    int admin_port;
+    const char *admin_addr;
+    /* Length of the listeners' accept queues. */
+    int backlog;
+    /* Seconds TCP_DEFER_ACCEPT holds back connections that sent nothing yet, 0 for off. */
+    int defer_accept;
+    /* Connection timeouts. */
+    conn_timeouts_t timeouts;
+    /* Messages and bytes of history kept per room, 0 messages for none. */
+    int history_msgs;
+    size_t history_bytes;
+    /* PEM certificate chain and key, the listener speaks TLS when both are given. */
+    const char *tls_cert;
+    const char *tls_key;
+    /* TCP port of the WebSocket listener, 0 for none. */
+    int ws_port;
+    /* Peer links to the other nodes of a federation. */
+    federation_config_t federation;
+    /* Message journal, off without a directory. */
+    journal_config_t journal;
+    /* Unix socket a new process takes over through, NULL for no hot restart. */
+    const char *handoff;
+} server_config_t;
+
+/*
+ * Members and history of one room on one worker.
+ */
+typedef struct room {
+    /* Connections of this worker in the room, in no particular order. */
+    struct conn **members;
+    int nr_members;
+    int cap;
+    /*
+     * Ring of the last messages fanned out in the room, oldest at
+     * history_head, replayed by reference to members joining on this worker.
+     */
+    struct msg_body **history;
+    int history_head;
+    int history_len;
+    size_t history_bytes;
+} room_t;
+
+/* Newline terminated lines, the default. */
+#define FRAMING_LINE 0
+/* Length prefixed frames, see frame.h. */
+#define FRAMING_BINARY 1
+/* A WebSocket client still sending its upgrade request, and one past it. */
+#define FRAMING_HTTP 2
+#define FRAMING_WEBSOCKET 3
+
 /*
  * Data structure to keep track of active client connections (not the for main socket).
  */
 typedef struct conn_pool {
-    /* Largest file descriptor in this pool. */
-    int maxfd;
-    /* Number of ready descriptors returned by select. */
+    /* Worker thread owning this pool. */
+    struct worker *worker;
+    /* Slabs for the connections, queue nodes and bodies of this worker. */
+    mem_arena_t arena;
+    /* Readiness notification backend (epoll by default, select as a fallback). */
+    event_backend_t *backend;
+    /* Number of ready descriptors returned by the last backend wait. */
     int nready;
-    /* Set of all active descriptors for reading. */
-    fd_set read_set;
-    /* Subset of descriptors ready for reading. */
-    fd_set ready_read_set;
-    /* Set of all active descriptors for writing. */
-    fd_set write_set;
-    /* Subset of descriptors ready for writing.  */
-    fd_set ready_write_set;
-    /* Doubly-linked list of active client connection objects. */
-    struct conn *conn_head;
+    /* Ready descriptors returned by the last backend wait. */
+    ev_event_t events[MAX_EVENTS];
+    /*
+     * Connection slots indexed by file descriptor, NULL for unused slots.
+     * Grows on demand to cover the largest descriptor seen so far.
+     */
+    struct conn **conn_by_fd;
+    int conn_by_fd_cap;
+    /* Dense array of active client connection objects. */
+    struct conn **conns;
+    int conns_cap;
     /* Number of active client connections. */
     unsigned int nr_conns;
+    /* Room names and ids, shared with the other workers. */
+    room_registry_t *registry;
+    /* Members of each room on this worker indexed by room id, used for fanout. */
+    room_t *rooms;
+    int rooms_cap;
+    /*
+     * Descriptors that got new messages queued during this loop iteration
+     * and should be flushed before the next wait.
+     */
+    int *flush_fds;
+    int nr_flush;
+    int flush_cap;
+    /* When the oldest of them was queued plus the flush window (ns). */
+    uint64_t flush_deadline;
+    /*
+     * Connections removed while a write submitted to a completion backend
+     * was still in flight, freed when that write completes.
+     */
+    int nr_zombies;
+    /* Outbound queue bounds, shared with the other workers. */
+    queue_limits_t *limits;
+    queue_stats_t queue_stats;
+    /* Counters and histograms exported by the admin listener. */
+    worker_metrics_t metrics;
+    /* Connections over their queue limits under SLOW_PAUSE. */
+    int nr_over_limit;
+    /* Publishers paused by SLOW_PAUSE, resumed once the queues drained. */
+    int *paused_fds;
+    int nr_paused;
+    int paused_cap;
+    /* Slow connections to close once the current fanout is done. */
+    int *doomed_fds;
+    int nr_doomed;
+    int doomed_cap;
+    /* Connection timeouts, shared with the other workers. */
+    conn_timeouts_t *timeouts;
+    /* Idle, ping and write stall timers of the connections. */
+    timer_wheel_t timers;
+    /* When the current loop iteration started (metrics_now()). */
+    uint64_t now;
+    /* Compression settings, shared with the other workers, and this worker's deflate stream. */
+    compress_config_t *compress;
+    compressor_t compressor;
+    /* TLS context shared with the other workers, NULL for a plaintext listener. */
+    SSL_CTX *tls;
+    /* Non-zero if there is a WebSocket listener, messages get a WebSocket copy then. */
+    int websocket;
+    /* Where queued messages are packed into records for OpenSSL. */
+    char tls_record[TLS_RECORD_MAX];
+    /* Where a line that wraps around the end of an input ring is assembled. */
+    char line_scratch[LINE_BUFFER_SIZE];
 
 }conn_pool_t;
 
+/*
+ * Immutable, reference-counted message payload.
+ *
+ * A body is allocated once per message read from a client and shared by the
+ * queues of all recipients, on every worker. Each queued msg_t holds one
+ * reference, the body is freed when the last recipient has written it.
+ */
+typedef struct msg_body {
+    /* Number of msg_t objects (and other holders) pointing at this body. */
+    atomic_int refcount;
+    /* Size class slab the body came from, NULL if it was malloc'ed. */
+    slab_pool_t *slab;
+    /* Size of the message. */
+    int size;
+    /* Room the message was published in. */
+    int room;
+    /* When the message was read (metrics_now()), for the time-in-queue histogram. */
+    uint64_t created_ns;
+    /*
+     * Compressed copy of the message for clients that asked for it, built
+     * once at ingest and owned by this body. NULL if the message goes out
+     * raw to everybody.
+     */
+    struct msg_body *compressed;
+    /*
+     * Copy of the message for WebSocket clients, its frame is a WebSocket
+     * frame header and its data lacks the newline. Built once at ingest and
+     * owned by this body, NULL if there is no WebSocket listener.
+     */
+    struct msg_body *websocket;
+    /*
+     * Binary frame header of the message, in the last frame_len bytes of
+     * frame so that it runs straight into data. Built once, binary clients
+     * are sent frame and data in one piece, line clients data only.
+     */
+    unsigned char frame_len;
+    char frame[WIRE_HEADER_MAX];
+    /* The message itself, followed by a terminating '\0'. */
+    char data[];
+}msg_body_t;
+
 /*
  * Data structure to keep track of messages. Each message object holds one
  * complete line of message from a client.
@@ -42,51 +313,183 @@ typedef struct msg {
     struct msg *prev;
     /* Points to the next message object in the doubly-linked list. */
     struct msg *next;
-    /* Points to a dynamically allocated buffer holding the message. */
-    char *message;
-    /* Size of the message. */
-    int size;
+    /* Points to the shared body holding the message. */
+    msg_body_t *body;
 }msg_t;
 
 
 /*
  * Data structure to keep track of client connection state.
  *
- * The connection objects are also maintained in a global doubly-linked list.
- * There is a dummy connection head at the beginning of the list.
+ * The connection objects are owned by the pool, which indexes them by file
+ * descriptor for lookups and keeps them in a dense array for iteration.
  */
 typedef struct conn {
-    /* Points to the previous connection object in the doubly-linked list. */
-    struct conn *prev;
-    /* Points to the next connection object in the doubly-linked list. */
-    struct conn *next;
     /* File descriptor associated with this connection. */
     int fd;
+    /* Position of this connection in the pool's dense array. */
+    int idx;
+    /* Room this connection is in, and its position in the room's members. */
+    int room;
+    int room_idx;
+    /* Bytes read from the client that do not form a complete line (or frame header) yet. */
+    line_buffer_t input;
+    /*
+     * FRAMING_LINE until the client asks for FRAMING_BINARY, in both
+     * directions. Connections of the WebSocket listener start out as
+     * FRAMING_HTTP and are FRAMING_WEBSOCKET once upgraded.
+     */
+    int framing;
+    /* Messages at the head of the queue still written as lines, queued before the switch. */
+    int line_msgs;
+    /* Codec of a binary connection, and the messages at the head still written raw. */
+    int codec;
+    int raw_msgs;
+    /*
+     * Binary framing: body of the frame being received, the rest of its
+     * payload is read straight into it. partial_len bytes of it arrived.
+     */
+    struct msg_body *partial;
+    int partial_len;
+    int partial_type;
+    /* Mask of the WebSocket frame in partial, partial_type is its opcode. */
+    unsigned char ws_mask[4];
+    /* The upgrade request while FRAMING_HTTP, NULL after. */
+    ws_upgrade_t *upgrade;
+    /* Non-zero once conn is closed as soon as its queue is written out, nothing more is read. */
+    int closing;
     /*
      * Pointers for the doubly-linked list of messages that
      * have to be written out on this connection.
      */
     struct msg *write_msg_head;
     struct msg *write_msg_tail;
+    /* Bytes of the head message already written by a previous short write. */
+    int write_offset;
+    /* Non-zero while write interest is registered with the backend. */
+    int want_write;
+    /*
+     * Completion backends: non-zero while a write of the queue head is
+     * submitted, write_iov describes it until it completes.
+     */
+    int write_inflight;
+    struct iovec *write_iov;
+    /* Non-zero while this connection is in the pool's flush list. */
+    int pending_flush;
+    /* Messages in the write queue and the sum of their sizes. */
+    int queued_msgs;
+    size_t queued_bytes;
+    /* Messages at the head of the queue covered by the write in flight. */
+    int write_pinned;
+    /* Non-zero while reading from this connection is paused. */
+    int paused;
+    /* Non-zero while this connection's queue holds back paused publishers. */
+    int over_limit;
+    /*
+     * Ingest rate limit: when the message and byte buckets are full again
+     * (ns), and while reading is held back for being over the rate, since
+     * when and the timer that ends it.
+     */
+    uint64_t msgs_full_at;
+    uint64_t bytes_full_at;
+    int throttled;
+    uint64_t throttled_since;
+    wheel_timer_t rate_timer;
+    /* Completion backends: bytes received while throttled, passed on once conn is back under its rate. */
+    char *held;
+    int held_len;
+    /* When something was last read from the client, and last pinged. */
+    uint64_t last_read;
+    uint64_t last_ping;
+    /* When the queue was last written to, or became non-empty. */
+    uint64_t last_progress;
+    /* When the connection last joined a room, older messages are history. */
+    uint64_t joined;
+    /* Idle (and ping) timer, and write stall timer. Both are pushed back lazily when they fire. */
+    wheel_timer_t idle_timer;
+    wheel_timer_t write_timer;
+    /* TLS session, NULL for a plaintext connection. */
+    SSL *ssl;
+    /* Non-zero until the handshake is done, nothing is read or written before. */
+    int handshaking;
+    /*
+     * Non-zero for the directions OpenSSL encrypts or decrypts itself, those
+     * kTLS did not take over. Both are 0 for plaintext connections.
+     */
+    int tls_read;
+    int tls_write;
+    /* Non-zero while a record the socket did not take pins the messages it covers (write_pinned). */
+    int tls_retry;
 }conn_t;
 
 
 /*
  * Init the conn_pool_t structure.
  * @pool - allocated pool
+ * @ backend - event backend used to watch the pool's descriptors
+ * @ limits - outbound queue bounds, shared by all pools
+ * @ registry - room names and ids, shared by all pools
+ * @ timeouts - connection timeouts, shared by all pools
+ * @ compress - compression settings, shared by all pools
+ * @ tls - TLS context shared by all pools, NULL for plaintext connections
  * @ return value - 0 on success, -1 on failure
  */
-int init_pool(conn_pool_t* pool);
+int init_pool(conn_pool_t* pool, event_backend_t *backend, queue_limits_t *limits, room_registry_t *registry,
+              conn_timeouts_t *timeouts, compress_config_t *compress, SSL_CTX *tls);
 
+/*
+ * Free everything init_pool and the pool's connections allocated. The
+ * connections must have been removed already.
+ * @pool - the pool
+ */
+void destroy_pool(conn_pool_t* pool);
 
+/*
+ * Drop the room histories of the pool. Called for every pool before any of
+ * them is destroyed, the bodies may come from the arena of any worker.
+ * @pool - the pool
+ */
+void drop_history(conn_pool_t* pool);
 
 /*
- * Add connection when new client connects the server.
+ * Write out the queues of all connections that got messages since the last call.
+ * Within the flush window, connections with less than flush_bytes queued are
+ * left for a later call.
+ * @pool - the pool
+ */
+void flush_pending(conn_pool_t* pool);
+
+/*
+ * Resume the publishers paused by SLOW_PAUSE once no queue of the pool is
+ * over its limits and the global budget has room again.
+ * @pool - the pool
+ */
+void resume_publishers(conn_pool_t* pool);
+
+
+
+/*
+ * Add connection when new client connects the server. It starts out in the
+ * lobby and is sent the lobby's history, once its TLS handshake is done if
+ * the pool has a TLS context, and once it upgraded for a WebSocket client.
  * @ sd - the socket descriptor returned from accept
+ * @ framing - FRAMING_LINE, or FRAMING_HTTP for the WebSocket listener
  * @pool - the pool
  * @ return value - 0 on success, -1 on failure
  */
-int add_conn(int sd, conn_pool_t* pool);
+int add_conn(int sd, int framing, conn_pool_t* pool);
+
+/*
+ * Find the connection object of a descriptor.
+ * @ sd - the socket descriptor
+ * @pool - the pool
+ * @ return value - the connection, NULL if sd is not a client connection
+ */
+static inline conn_t *find_conn(int sd, conn_pool_t* pool) {
+    if (sd < 0 || sd >= pool->conn_by_fd_cap)
+        return NULL;
+    return pool->conn_by_fd[sd];
+}
 
 /*
  * Remove connection when a client closes connection, or clean memory if server stops.
@@ -97,18 +500,160 @@ int add_conn(int sd, conn_pool_t* pool);
 int remove_conn(int sd, conn_pool_t* pool);
 
 /*
- * Add msg to the queues of all connections (except of the origin).
+ * Allocate a message body of len bytes, with one reference and its frame
+ * header built. The body comes from a size class of the calling worker's
+ * arena when it fits. The caller fills in data.
+ * @ len - length of msg
+ * @ type - FRAME_MESSAGE or FRAME_CONTROL
+ * @ return value - the body, NULL on failure
+ */
+msg_body_t *msg_body_alloc(int len, int type);
+
+/*
+ * Allocate a message body holding a copy of buffer, as msg_body_alloc().
+ * @ buffer - the msg
+ * @ len - length of msg
+ * @ return value - the body, NULL on failure
+ */
+msg_body_t *msg_body_create(const char* buffer, int len);
+
+/*
+ * Take one more reference to a body.
+ */
+static inline msg_body_t *msg_body_ref(msg_body_t *body) {
+    atomic_fetch_add_explicit(&body->refcount, 1, memory_order_relaxed);
+    return body;
+}
+
+/*
+ * Drop one reference to a body, freeing it when it was the last one.
+ */
+void msg_body_unref(msg_body_t *body);
+
+/*
+ * Add msg to the queues of all connections in the origin's room (except of
+ * the origin), and hand it to the other workers with members there. The
+ * lines "/join <room>" and "/leave" move the origin between rooms instead,
+ * and send it the history of the room it joined. "/pong" (the answer to a
+ * ping) is dropped, "/binary" switches the origin to binary framing and
+ * "/compress <codec>" turns compression on or off for it. A message big
+ * enough is compressed here, once for all recipients that want it, and the
+ * WebSocket frame is built here, once for all WebSocket recipients.
  * @ sd - the socket descriptor to add this msg to the queue in its conn object
  * @ buffer - the msg to add
  * @ len - length of msg
  * @pool - the pool
  * @ return value - 0 on success, -1 on failure
  */
-int add_msg(int sd,char* buffer,int len,conn_pool_t* pool);
+int add_msg(int sd,const char* buffer,int len,conn_pool_t* pool);
+
+/*
+ * Publish a message another node of the federation sent as if a client of
+ * this pool had: compressed and framed for WebSocket once here, fanned out to
+ * the room and handed to the other workers, but not back to the peers.
+ * Takes over the caller's reference.
+ * @ body - the msg, its room set
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int add_peer_body(msg_body_t* body,conn_pool_t* pool);
 
+/*
+ * Put a message read back from the journal in the history of its room, with
+ * its WebSocket frame (made by the first pool, shared by the others). The
+ * history takes its own reference.
+ * @ body - the msg, its room set
+ * @pool - the pool
+ */
+void restore_history(msg_body_t* body,conn_pool_t* pool);
+
+struct worker_group;
+
+/*
+ * Put the connections of all workers of group in buf for a new process, with
+ * their rooms, unparsed input and queues. The workers must have stopped. A
+ * connection OpenSSL still encrypts itself is left out, and closed as usual.
+ * @ group - the stopped workers
+ * @ buf - the handoff state
+ * @ return value - number of connections put, -1 on failure
+ */
+int export_conns(struct worker_group* group,handoff_buf_t* buf);
+
+/*
+ * Add the connections put by export_conns() to the pools of group, each to
+ * the same worker as before if there are as many. Called before the workers run.
+ * @ buf - the handoff state, positioned at the connections
+ * @ group - the workers
+ * @ return value - number of connections added, -1 on failure
+ */
+int import_conns(handoff_buf_t* buf,struct worker_group* group);
+
+/*
+ * Add an existing body to the history of its room and to the queues of all
+ * connections of this pool in the room (except of the origin). Every queued msg_t takes its own
+ * reference. A connection whose queue would exceed its limits, or the global
+ * budget, is handled by the slow consumer policy.
+ * @ sd - the origin, -1 if the msg came from another worker
+ * @ body - the msg
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int add_body(int sd,msg_body_t* body,conn_pool_t* pool);
+
+
+/*
+ * Feed bytes received by a completion backend into the connection's line
+ * framing. Lines complete within data are passed on in place, only a partial
+ * line is kept in the input ring, which is released again once it is empty.
+ * With binary framing the payload of a frame goes straight into its body.
+ * What comes while the connection is over its ingest rate is held until it
+ * is back under. A connection breaking the framing is removed.
+ * @ sd - the socket descriptor the bytes came from
+ * @ data - the bytes
+ * @ len - number of bytes
+ * @pool - the pool
+ * @ return value - 0 on success, -1 on failure
+ */
+int receive_from_client(int sd,const char* data,int len,conn_pool_t* pool);
+
+/*
+ * Pass on the frames complete in the input ring of a binary or WebSocket
+ * connection, or the upgrade request of one still speaking HTTP. A frame
+ * whose payload is still missing gets its body allocated, the rest of the
+ * payload is meant to be read straight into conn->partial.
+ * @ conn - the connection
+ * @pool - the pool
+ * @ return value - 0 on success, -1 if conn broke the framing and has to go
+ */
+int drain_frames(conn_t* conn,conn_pool_t* pool);
+
+/*
+ * Handle the completion of a write submitted to a completion backend.
+ * @ conn - the connection passed as ctx to submit_write
+ * @ res - bytes written or -errno
+ * @pool - the pool
+ */
+void write_completed(conn_t* conn,int res,conn_pool_t* pool);
+
+/*
+ * Move the TLS handshake of conn on as far as the socket allows. Once it is
+ * done the directions kTLS took over go back to plain read() and writev(),
+ * and what was queued meanwhile is put in the flush list.
+ * @ conn - a connection with conn->handshaking set
+ * @pool - the pool
+ * @ return value - 0 while the handshake goes on or once it is done, -1 if it
+ *   failed and conn has to go
+ */
+int continue_handshake(conn_t* conn,conn_pool_t* pool);
 
 /*
- * Write msg to client.
+ * Write msg to client. Queued messages are gathered into writev() calls of up
+ * to IOV_MAX messages each. Stops without error when the socket buffer is
+ * full, the rest of the queue (starting at write_offset in the head message)
+ * is written once the socket becomes writable again. With a completion
+ * backend the gathered messages are submitted instead and the queue is
+ * advanced in write_completed(). Where OpenSSL encrypts, the gathered
+ * messages are packed into records of up to TLS_RECORD_MAX bytes instead.
  * @ sd - the socket descriptor of the connection to write msg to
  * @pool - the pool
  * @ return value - 0 on success, -1 on failure
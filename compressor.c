@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+#include "compressor.h"
+
+#define ERROR (-1)
+
+static const char *codecNames[] = {"none", "zlib"};
+
+void compressor_init(compressor_t *c, int level) {
+    memset(&c->stream, 0, sizeof(c->stream));
+    c->level = level;
+    c->ready = 0;
+    c->buf = NULL;
+    c->cap = 0;
+}
+
+void compressor_destroy(compressor_t *c) {
+    if (c->ready)
+        deflateEnd(&c->stream);
+    free(c->buf);
+    compressor_init(c, c->level);
+}
+
+int compressor_run(compressor_t *c, const char *data, int len, const char **out) {
+    if (len < 2)
+        return ERROR;
+    if (!c->ready) {
+        if (deflateInit(&c->stream, c->level) != Z_OK)
+            return ERROR;
+        c->ready = 1;
+    } else if (deflateReset(&c->stream) != Z_OK) {
+        return ERROR;
+    }
+    /* anything that does not save at least a byte goes out raw */
+    size_t limit = (size_t) len - 1;
+    if (limit > c->cap) {
+        char *buf = realloc(c->buf, limit);
+        if (buf == NULL)
+            return ERROR;
+        c->buf = buf;
+        c->cap = limit;
+    }
+    c->stream.next_in = (Bytef *) data;
+    c->stream.avail_in = (uInt) len;
+    c->stream.next_out = (Bytef *) c->buf;
+    c->stream.avail_out = (uInt) limit;
+    /* Z_OK or Z_BUF_ERROR: the output did not fit in limit */
+    if (deflate(&c->stream, Z_FINISH) != Z_STREAM_END)
+        return ERROR;
+    *out = c->buf;
+    return (int) (limit - c->stream.avail_out);
+}
+
+int codec_lookup(const char *name, int len) {
+    for (int codec = CODEC_NONE; codec <= CODEC_ZLIB; codec++) {
+        if ((int) strlen(codecNames[codec]) == len && memcmp(name, codecNames[codec], len) == 0)
+            return codec;
+    }
+    return ERROR;
+}
+
+const char *codec_name(int codec) {
+    return codecNames[codec];
+}
@@ -0,0 +1,56 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+/* Codecs a client can ask for with "/compress <name>". */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+
+/*
+ * Per-worker zlib deflate state and output buffer. Setting up a deflate
+ * stream allocates a few hundred KB, so one stream is kept and reset for
+ * every message instead.
+ */
+typedef struct compressor {
+    z_stream stream;
+    /* zlib level, the stream is set up on first use. */
+    int level;
+    int ready;
+    /* Output of the last compressor_run(). */
+    char *buf;
+    size_t cap;
+} compressor_t;
+
+/*
+ * Init a compressor, no memory is allocated yet.
+ * @ level - zlib level, 1 (fastest) to 9 (smallest)
+ */
+void compressor_init(compressor_t *c, int level);
+
+/*
+ * Free the stream and the buffer of a compressor.
+ */
+void compressor_destroy(compressor_t *c);
+
+/*
+ * Compress data[0..len) into a zlib stream.
+ * @ out - set to the compressed bytes, valid until the next call
+ * @ return value - length of the compressed bytes, -1 if they would not be
+ *   shorter than len or on failure
+ */
+int compressor_run(compressor_t *c, const char *data, int len, const char **out);
+
+/*
+ * The codec called name (len bytes, not terminated).
+ * @ return value - CODEC_NONE or CODEC_ZLIB, -1 for an unknown name
+ */
+int codec_lookup(const char *name, int len);
+
+/*
+ * Name of a codec.
+ */
+const char *codec_name(int codec);
+
+#endif
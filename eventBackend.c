@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include "eventBackend.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+int raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return FD_SETSIZE;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 30))
+        return 1 << 30;
+    return (int) rl.rlim_cur;
+}
+
+event_backend_t *create_backend(const char *name, int max_fds) {
+    if (name == NULL || strcmp(name, "epoll") == 0)
+        return create_epoll_backend(max_fds);
+    if (strcmp(name, "select") == 0)
+        return create_select_backend();
+    if (strcmp(name, "io_uring") == 0)
+        return create_uring_backend(max_fds);
+    return NULL;
+}
+
+/*************************************************************/
+/* epoll: edge-triggered, every descriptor is registered for */
+/* both directions once, so interest never has to change.    */
+/*************************************************************/
+
+typedef struct epoll_backend {
+    event_backend_t base;
+    int epfd;
+    struct epoll_event events[MAX_EVENTS];
+    /* Non-zero once epoll_pwait2() turned out missing, timeouts are rounded up to milliseconds then. */
+    int no_pwait2;
+} epoll_backend_t;
+
+static int epollAdd(event_backend_t *be, int fd, int events) {
+    epoll_backend_t *ep = (epoll_backend_t *) be;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (events & EV_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    return epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int epollModify(event_backend_t *be, int fd, int events) {
+    /* EPOLLOUT stays armed for edge-triggered connections. */
+    (void) be;
+    (void) fd;
+    (void) events;
+    return SUCCESS;
+}
+
+static int epollRemove(event_backend_t *be, int fd) {
+    epoll_backend_t *ep = (epoll_backend_t *) be;
+    return epoll_ctl(ep->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epollWait(event_backend_t *be, ev_event_t *events, int max_events, long timeout_us) {
+    epoll_backend_t *ep = (epoll_backend_t *) be;
+    if (max_events > MAX_EVENTS)
+        max_events = MAX_EVENTS;
+    int n = -1;
+    if (!ep->no_pwait2) {
+        struct timespec ts = {timeout_us / 1000000, timeout_us % 1000000 * 1000};
+        n = epoll_pwait2(ep->epfd, ep->events, max_events, timeout_us >= 0 ? &ts : NULL, NULL);
+        if (n < 0 && errno == ENOSYS)
+            ep->no_pwait2 = 1;
+    }
+    if (ep->no_pwait2)
+        n = epoll_wait(ep->epfd, ep->events, max_events, timeout_us >= 0 ? (int) ((timeout_us + 999) / 1000) : -1);
+    if (n < 0)
+        return errno == EINTR ? 0 : ERROR;
+    for (int i = 0; i < n; i++) {
+        uint32_t e = ep->events[i].events;
+        events[i].fd = ep->events[i].data.fd;
+        events[i].events = 0;
+        if (e & (EPOLLIN | EPOLLRDHUP))
+            events[i].events |= EV_READ;
+        if (e & EPOLLOUT)
+            events[i].events |= EV_WRITE;
+        if (e & (EPOLLERR | EPOLLHUP))
+            events[i].events |= EV_ERROR | EV_READ;
+    }
+    return n;
+}
+
+static void epollDestroy(event_backend_t *be) {
+    epoll_backend_t *ep = (epoll_backend_t *) be;
+    close(ep->epfd);
+    free(ep);
+}
+
+event_backend_t *create_epoll_backend(int max_fds) {
+    epoll_backend_t *ep = calloc(1, sizeof(epoll_backend_t));
+    if (ep == NULL)
+        return NULL;
+    ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep->epfd < 0) {
+        free(ep);
+        return NULL;
+    }
+    ep->base.name = "epoll";
+    ep->base.edge_triggered = 1;
+    ep->base.max_fds = max_fds;
+    ep->base.add = epollAdd;
+    ep->base.modify = epollModify;
+    ep->base.remove = epollRemove;
+    ep->base.wait = epollWait;
+    ep->base.destroy = epollDestroy;
+    return &ep->base;
+}
+
+/*************************************************************/
+/* select: level-triggered fallback, scans up to maxfd.      */
+/*************************************************************/
+
+typedef struct select_backend {
+    event_backend_t base;
+    /* Largest file descriptor being watched. */
+    int maxfd;
+    /* Set of all active descriptors for reading. */
+    fd_set read_set;
+    /* Subset of descriptors ready for reading. */
+    fd_set ready_read_set;
+    /* Set of all active descriptors for writing. */
+    fd_set write_set;
+    /* Subset of descriptors ready for writing.  */
+    fd_set ready_write_set;
+} select_backend_t;
+
+static int selectModify(event_backend_t *be, int fd, int events) {
+    select_backend_t *sb = (select_backend_t *) be;
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return ERROR;
+    }
+    if (events & EV_READ)
+        FD_SET(fd, &sb->read_set);
+    else
+        FD_CLR(fd, &sb->read_set);
+    if (events & EV_WRITE)
+        FD_SET(fd, &sb->write_set);
+    else
+        FD_CLR(fd, &sb->write_set);
+    /* a paused fd watched for nothing may have been dropped from the scan range */
+    if ((events & (EV_READ | EV_WRITE)) && fd > sb->maxfd)
+        sb->maxfd = fd;
+    return SUCCESS;
+}
+
+static int selectAdd(event_backend_t *be, int fd, int events) {
+    return selectModify(be, fd, events);
+}
+
+static int selectRemove(event_backend_t *be, int fd) {
+    select_backend_t *sb = (select_backend_t *) be;
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return ERROR;
+    FD_CLR(fd, &sb->read_set);
+    FD_CLR(fd, &sb->write_set);
+    FD_CLR(fd, &sb->ready_read_set);
+    FD_CLR(fd, &sb->ready_write_set);
+    while (sb->maxfd >= 0 && !FD_ISSET(sb->maxfd, &sb->read_set) && !FD_ISSET(sb->maxfd, &sb->write_set))
+        sb->maxfd--;
+    return SUCCESS;
+}
+
+static int selectWait(event_backend_t *be, ev_event_t *events, int max_events, long timeout_us) {
+    select_backend_t *sb = (select_backend_t *) be;
+    struct timeval tv;
+    struct timeval *tvp = NULL;
+    if (timeout_us >= 0) {
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+        tvp = &tv;
+    }
+    /**********************************************************/
+    /* Copy the master fd_set over to the working fd_set.     */
+    /**********************************************************/
+    sb->ready_read_set = sb->read_set;
+    sb->ready_write_set = sb->write_set;
+    int nready = select(sb->maxfd + 1, &sb->ready_read_set, &sb->ready_write_set, NULL, tvp);
+    if (nready < 0)
+        return errno == EINTR ? 0 : ERROR;
+
+    int n = 0;
+    for (int i = 0; i <= sb->maxfd && n < max_events && nready > 0; i++) {
+        int mask = 0;
+        if (FD_ISSET(i, &sb->ready_read_set))
+            mask |= EV_READ;
+        if (FD_ISSET(i, &sb->ready_write_set))
+            mask |= EV_WRITE;
+        if (mask == 0)
+            continue;
+        events[n].fd = i;
+        events[n].events = mask;
+        n++;
+        nready--;
+    }
+    return n;
+}
+
+static void selectDestroy(event_backend_t *be) {
+    free(be);
+}
+
+event_backend_t *create_select_backend(void) {
+    select_backend_t *sb = calloc(1, sizeof(select_backend_t));
+    if (sb == NULL)
+        return NULL;
+    sb->maxfd = -1;
+    FD_ZERO(&sb->read_set);
+    FD_ZERO(&sb->ready_read_set);
+    FD_ZERO(&sb->write_set);
+    FD_ZERO(&sb->ready_write_set);
+    sb->base.name = "select";
+    sb->base.edge_triggered = 0;
+    sb->base.max_fds = FD_SETSIZE;
+    sb->base.add = selectAdd;
+    sb->base.modify = selectModify;
+    sb->base.remove = selectRemove;
+    sb->base.wait = selectWait;
+    sb->base.destroy = selectDestroy;
+    return &sb->base;
+}
@@ -0,0 +1,137 @@
+#ifndef EVENT_BACKEND_H
+#define EVENT_BACKEND_H
+
+#include <sys/uio.h>
+
+/* Readiness flags reported by (and requested from) an event backend. */
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+/* Peer hung up or the descriptor is in an error state. */
+#define EV_ERROR 0x4
+
+/* Registration flag: fd is a listening socket. */
+#define EV_LISTEN 0x8
+/* Registration flag: only report readiness, never read from fd (eventfd). */
+#define EV_POLL 0x10
+
+/*
+ * Completion events, only reported by backends that do the I/O themselves.
+ * EV_ACCEPTED: the listener fd accepted the connection in res.
+ * EV_DATA: res bytes were received on fd, they are at data until the next wait.
+ * EV_CLOSED: the peer closed fd or receiving failed.
+ * EV_WRITTEN: the write submitted with ctx ptr completed, res bytes or -errno.
+ */
+#define EV_ACCEPTED 0x20
+#define EV_DATA     0x40
+#define EV_CLOSED   0x80
+#define EV_WRITTEN  0x100
+
+/* Maximum number of ready descriptors returned by a single wait. */
+#define MAX_EVENTS 1024
+
+/*
+ * One ready descriptor returned by a backend wait.
+ */
+typedef struct ev_event {
+    /* File descriptor that became ready. */
+    int fd;
+    /* EV_READ / EV_WRITE / EV_ERROR mask, or one completion event. */
+    int events;
+    /* Result of a completion event. */
+    int res;
+    /* EV_DATA: the received bytes. */
+    const char *data;
+    /* EV_WRITTEN: the ctx passed to submit_write. */
+    void *ptr;
+} ev_event_t;
+
+/*
+ * Readiness notification mechanism used by the main loop.
+ *
+ * Each implementation keeps its own private state behind this struct. The
+ * edge-triggered ones report a descriptor only when it changes state, so the
+ * caller must read / accept / write until EAGAIN. The level-triggered ones
+ * keep reporting a descriptor while it is ready, so write interest must only
+ * be requested while a connection has data that could not be written.
+ *
+ * Completion backends (io_uring) accept, receive and write themselves and
+ * report the results as completion events instead of readiness.
+ */
+typedef struct event_backend {
+    /* Human readable name ("epoll", "select", "io_uring"). */
+    const char *name;
+    /* Non-zero if readiness is reported on edges only. */
+    int edge_triggered;
+    /* Largest descriptor this backend is able to watch. */
+    int max_fds;
+
+    /*
+     * Start watching fd.
+     * @ events - EV_READ / EV_WRITE interest
+     * @ return value - 0 on success, -1 on failure
+     */
+    int (*add)(struct event_backend *be, int fd, int events);
+
+    /*
+     * Change the interest of an already watched fd. Leaving out EV_READ
+     * pauses reading: unread data stays in the socket buffer. epoll keeps
+     * its edge-triggered interest, the caller simply stops reading and
+     * reads again on its own when it resumes.
+     * @ return value - 0 on success, -1 on failure
+     */
+    int (*modify)(struct event_backend *be, int fd, int events);
+
+    /*
+     * Stop watching fd. Must be called before the fd is closed.
+     * @ return value - 0 on success, -1 on failure
+     */
+    int (*remove)(struct event_backend *be, int fd);
+
+    /*
+     * Wait for ready descriptors.
+     * @ events - array filled with at most max_events ready descriptors
+     * @ timeout_us - microseconds, -1 blocks forever, 0 polls
+     * @ return value - number of ready descriptors, -1 on failure
+     */
+    int (*wait)(struct event_backend *be, ev_event_t *events, int max_events, long timeout_us);
+
+    /* Release the backend and all of its resources. */
+    void (*destroy)(struct event_backend *be);
+
+    /*
+     * Completion backends only, NULL for the others. Start writing iov to fd,
+     * the result comes back as an EV_WRITTEN event carrying ctx. The bytes
+     * must stay valid until then, the iov array until the next wait.
+     * @ return value - 0 on success, -1 on failure
+     */
+    int (*submit_write)(struct event_backend *be, int fd, const struct iovec *iov, int count, void *ctx);
+} event_backend_t;
+
+/*
+ * Raise the soft RLIMIT_NOFILE to the hard limit.
+ * @ return value - the resulting descriptor limit
+ */
+int raise_fd_limit(void);
+
+/*
+ * Create a backend by name.
+ * @ name - "epoll", "select" or "io_uring", NULL picks the default (epoll)
+ * @ max_fds - descriptor limit, usually the value of raise_fd_limit()
+ * @ return value - the backend, NULL on failure
+ */
+event_backend_t *create_backend(const char *name, int max_fds);
+
+/* Edge-triggered epoll backend. */
+event_backend_t *create_epoll_backend(int max_fds);
+
+/* Level-triggered select backend, limited to FD_SETSIZE descriptors. */
+event_backend_t *create_select_backend(void);
+
+/*
+ * io_uring completion backend: multishot accept, multishot recv into a
+ * provided buffer ring and batched writev submissions.
+ * @ return value - the backend, NULL if the kernel lacks the features used
+ */
+event_backend_t *create_uring_backend(int max_fds);
+
+#endif
@@ -0,0 +1,871 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "federation.h"
+#include "log.h"
+#include "worker.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/* First bytes of every link, in both directions, followed by the node id and a nonce. */
+#define HELLO_MAGIC "CHATFED2"
+#define NONCE_LEN 16
+#define HELLO_LEN (12 + NONCE_LEN)
+/* HMAC-SHA256 of the proof after the hello and at the end of every batch. */
+#define MAC_LEN 32
+/* Longest shared secret read from --peer-secret. */
+#define SECRET_MAX 256
+/* Length, batch number and entry count in front of every batch. */
+#define BATCH_HEADER 16
+/* Origin, sequence number, room name length and payload length of an entry. */
+#define ENTRY_HEADER 17
+/* Largest peer frame accepted, a peer sending a bigger one is cut off. */
+#define FRAME_MAX (64 * 1024 * 1024)
+/* Bytes waiting for a slow peer before its link is dropped. */
+#define OUT_MAX (64 * 1024 * 1024)
+/* Most links at once, the ones this node opens included. */
+#define MAX_LINKS (2 * FED_MAX_PEERS)
+/* Delay before a link this node opens is tried again. */
+#define RETRY_MS 1000
+#define NO_BATCH ((size_t) -1)
+
+/*
+ * A link opening, waiting for the peer's hello, then for its proof that it
+ * knows the secret, carrying messages, or down until retry_at.
+ */
+#define LINK_CONNECTING 0
+#define LINK_HELLO 1
+#define LINK_PROOF 2
+#define LINK_UP 3
+#define LINK_DOWN 4
+
+/*
+ * Growable byte buffer, the bytes in use are data[start..len).
+ */
+typedef struct link_buf {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+} link_buf_t;
+
+/*
+ * One TCP link to a peer node.
+ */
+typedef struct link {
+    int fd;
+    int state;
+    /* "host:port" for links this node opens, NULL for accepted ones. */
+    const char *address;
+    /* Id of the node on the other end, once its hello arrived. */
+    uint32_t node;
+    /* When a link that is down is opened again (metrics_now()). */
+    uint64_t retry_at;
+    link_buf_t in;
+    link_buf_t out;
+    /* Offset in out of the batch being filled and its entries, NO_BATCH if none is. */
+    size_t batch;
+    uint32_t batch_count;
+    /* Nonce of this node's hello, and the keys of the batches each way derived from both hellos. */
+    unsigned char nonce[NONCE_LEN];
+    unsigned char key_out[MAC_LEN];
+    unsigned char key_in[MAC_LEN];
+    /* Batches sent and received, each batch carries its number under its MAC. */
+    uint64_t batches_out;
+    uint64_t batches_in;
+} link_t;
+
+/*
+ * Sequence numbers seen from one origin: the highest, and which of the
+ * FED_SEEN_WINDOW up to it, bit seq % FED_SEEN_WINDOW.
+ */
+typedef struct origin_seen {
+    uint32_t node;
+    uint64_t seq;
+    uint64_t window[FED_SEEN_WINDOW / 64];
+} origin_seen_t;
+
+static struct {
+    uint32_t node_id;
+    worker_group_t *group;
+    room_registry_t *registry;
+    pthread_t thread;
+    int epfd;
+    int listen_sd;
+    /* eventfd the workers signal once they put messages in the inbox. */
+    int wake_fd;
+    mpsc_queue_t inbox;
+    atomic_int wakeup_pending;
+    link_t *links[MAX_LINKS];
+    int nr_links;
+    origin_seen_t *seen;
+    int nr_seen;
+    int seen_cap;
+    /* Sequence number of the last message of this node. */
+    uint64_t seq;
+    /* Secret every peer has to prove it knows, empty for none. */
+    unsigned char secret[SECRET_MAX];
+    int secret_len;
+} fed = {.epfd = -1, .listen_sd = -1, .wake_fd = -1};
+
+static atomic_int fedRunning = 0;
+static atomic_int fedStop = 0;
+
+/* Counters, written by the link thread only. */
+static metric_t linksUp;
+static metric_t published;
+static metric_t framesOut;
+static metric_t entriesOut;
+static metric_t framesIn;
+static metric_t entriesIn;
+static metric_t duplicates;
+
+static void put32(char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (char) (v >> (24 - 8 * i));
+}
+
+static void put64(char *p, uint64_t v) {
+    put32(p, (uint32_t) (v >> 32));
+    put32(p + 4, (uint32_t) v);
+}
+
+static uint32_t get32(const char *p) {
+    const unsigned char *u = (const unsigned char *) p;
+    return (uint32_t) u[0] << 24 | (uint32_t) u[1] << 16 | (uint32_t) u[2] << 8 | u[3];
+}
+
+static uint64_t get64(const char *p) {
+    return (uint64_t) get32(p) << 32 | get32(p + 4);
+}
+
+/*
+ * Make room for n more bytes at the end of buf, moving what is in use to
+ * the front first.
+ */
+static int bufReserve(link_buf_t *buf, size_t n) {
+    if (buf->start > 0 && buf->len + n > buf->cap) {
+        memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+        buf->len -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->len + n <= buf->cap)
+        return SUCCESS;
+    size_t cap = buf->cap ? buf->cap : 64 * 1024;
+    while (cap < buf->len + n)
+        cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (data == NULL)
+        return ERROR;
+    buf->data = data;
+    buf->cap = cap;
+    return SUCCESS;
+}
+
+static void bufFree(link_buf_t *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * Close the link. One this node opens is tried again after RETRY_MS, an
+ * accepted one is freed by reapLinks().
+ */
+static void linkDown(link_t *link, const char *why) {
+    if (link->fd < 0)
+        return;
+    if (link->state == LINK_UP) {
+        metric_sub(&linksUp, 1);
+        log_warn("peer link to node %u down: %s", link->node, why);
+    } else {
+        log_info("peer link %s failed: %s", link->address != NULL ? link->address : "(accepted)", why);
+    }
+    close(link->fd);
+    link->fd = -1;
+    link->state = LINK_DOWN;
+    link->retry_at = metrics_now() + (uint64_t) RETRY_MS * 1000000;
+    bufFree(&link->in);
+    bufFree(&link->out);
+    link->batch = NO_BATCH;
+}
+
+/*
+ * Free the accepted links that went down.
+ */
+static void reapLinks(void) {
+    for (int i = 0; i < fed.nr_links; i++) {
+        link_t *link = fed.links[i];
+        if (link->address != NULL || link->fd >= 0)
+            continue;
+        fed.links[i--] = fed.links[--fed.nr_links];
+        free(link);
+    }
+}
+
+static void queueHello(link_t *link) {
+    if (getrandom(link->nonce, NONCE_LEN, 0) != NONCE_LEN) {
+        linkDown(link, "no random nonce");
+        return;
+    }
+    if (bufReserve(&link->out, HELLO_LEN) < 0) {
+        linkDown(link, "out of memory");
+        return;
+    }
+    memcpy(link->out.data + link->out.len, HELLO_MAGIC, 8);
+    put32(link->out.data + link->out.len + 8, fed.node_id);
+    memcpy(link->out.data + link->out.len + 12, link->nonce, NONCE_LEN);
+    link->out.len += HELLO_LEN;
+}
+
+/*
+ * Key of the batches node from sends to node to, bound to the nonces of
+ * both hellos so that batches of another link cannot be replayed on this one.
+ */
+static void deriveKey(uint32_t from, const unsigned char *fromNonce, uint32_t to, const unsigned char *toNonce,
+                      unsigned char key[MAC_LEN]) {
+    unsigned char in[2 * NONCE_LEN + 8];
+    memcpy(in, fromNonce, NONCE_LEN);
+    memcpy(in + NONCE_LEN, toNonce, NONCE_LEN);
+    put32((char *) in + 2 * NONCE_LEN, from);
+    put32((char *) in + 2 * NONCE_LEN + 4, to);
+    HMAC(EVP_sha256(), fed.secret, fed.secret_len, in, sizeof(in), key, NULL);
+}
+
+/*
+ * Take the peer's hello: derive the keys of the link and queue the proof
+ * that this node knows the secret, a MAC of the magic under its key.
+ */
+static void helloReceived(link_t *link, const char *hello) {
+    const unsigned char *peerNonce = (const unsigned char *) hello + 12;
+    deriveKey(fed.node_id, link->nonce, link->node, peerNonce, link->key_out);
+    deriveKey(link->node, peerNonce, fed.node_id, link->nonce, link->key_in);
+    if (bufReserve(&link->out, MAC_LEN) < 0) {
+        linkDown(link, "out of memory");
+        return;
+    }
+    HMAC(EVP_sha256(), link->key_out, MAC_LEN, (const unsigned char *) HELLO_MAGIC, 8,
+         (unsigned char *) link->out.data + link->out.len, NULL);
+    link->out.len += MAC_LEN;
+    link->state = LINK_PROOF;
+}
+
+/*
+ * Put the link's socket in the epoll set and queue the hello.
+ */
+static int linkStart(link_t *link, int fd, int state) {
+    link->fd = fd;
+    link->state = state;
+    link->node = 0;
+    link->batch = NO_BATCH;
+    link->batches_out = 0;
+    link->batches_in = 0;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = link};
+    if (epoll_ctl(fed.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        linkDown(link, strerror(errno));
+        return ERROR;
+    }
+    queueHello(link);
+    return SUCCESS;
+}
+
+/*
+ * Start opening a link to link->address.
+ */
+static void linkConnect(link_t *link) {
+    char host[256];
+    const char *colon = strrchr(link->address, ':');
+    size_t hostLen = (size_t) (colon - link->address);
+    if (hostLen >= sizeof(host))
+        hostLen = sizeof(host) - 1;
+    memcpy(host, link->address, hostLen);
+    host[hostLen] = '\0';
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    link->retry_at = metrics_now() + (uint64_t) RETRY_MS * 1000000;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        log_warn("peer %s: cannot resolve %s", link->address, host);
+        return;
+    }
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return;
+    }
+    int done = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (done < 0 && errno != EINPROGRESS) {
+        log_debug("peer %s: connect: %m", link->address);
+        close(fd);
+        return;
+    }
+    linkStart(link, fd, done == 0 ? LINK_HELLO : LINK_CONNECTING);
+}
+
+/*
+ * Close the batch being filled on link: its header gets the length, number
+ * and count, and the MAC of all but the length goes after the entries, in
+ * the room appendEntry() reserved for it.
+ */
+static void closeBatch(link_t *link) {
+    if (link->batch == NO_BATCH)
+        return;
+    char *header = link->out.data + link->batch;
+    put32(header, (uint32_t) (link->out.len + MAC_LEN - link->batch - 4));
+    put64(header + 4, ++link->batches_out);
+    put32(header + 12, link->batch_count);
+    HMAC(EVP_sha256(), link->key_out, MAC_LEN, (const unsigned char *) header + 4, link->out.len - link->batch - 4,
+         (unsigned char *) link->out.data + link->out.len, NULL);
+    link->out.len += MAC_LEN;
+    link->batch = NO_BATCH;
+    metric_add(&framesOut, 1);
+}
+
+/*
+ * Add a message to the batch being filled on link, starting a new one if
+ * there is none or it would grow past FED_BATCH_BYTES.
+ */
+static void appendEntry(link_t *link, uint32_t origin, uint64_t seq, const char *room, int roomLen,
+                        const char *data, int len) {
+    size_t need = ENTRY_HEADER + (size_t) roomLen + (size_t) len;
+    if (link->batch != NO_BATCH && link->out.len - link->batch + need > FED_BATCH_BYTES)
+        closeBatch(link);
+    if (link->out.len - link->out.start + need + MAC_LEN > OUT_MAX) {
+        linkDown(link, "peer too slow");
+        return;
+    }
+    /* the reserve may move the bytes in use to the front, the open batch with them */
+    size_t batchAt = link->batch != NO_BATCH ? link->batch - link->out.start : NO_BATCH;
+    if (bufReserve(&link->out, BATCH_HEADER + need + MAC_LEN) < 0) {
+        linkDown(link, "out of memory");
+        return;
+    }
+    if (batchAt != NO_BATCH)
+        link->batch = link->out.start + batchAt;
+    if (link->batch == NO_BATCH) {
+        link->batch = link->out.len;
+        link->batch_count = 0;
+        link->out.len += BATCH_HEADER;
+    }
+    char *p = link->out.data + link->out.len;
+    put32(p, origin);
+    put64(p + 4, seq);
+    p[12] = (char) roomLen;
+    memcpy(p + 13, room, roomLen);
+    put32(p + 13 + roomLen, (uint32_t) len);
+    memcpy(p + ENTRY_HEADER + roomLen, data, len);
+    link->out.len += need;
+    link->batch_count++;
+    metric_add(&entriesOut, 1);
+}
+
+/*
+ * Send a message to every link that is up, except to the one it came from
+ * and to its origin.
+ */
+static void sendAll(link_t *from, uint32_t origin, uint64_t seq, const char *room, int roomLen,
+                    const char *data, int len) {
+    for (int i = 0; i < fed.nr_links; i++) {
+        link_t *link = fed.links[i];
+        if (link != from && link->state == LINK_UP && link->node != origin)
+            appendEntry(link, origin, seq, room, roomLen, data, len);
+    }
+}
+
+/*
+ * Is seq new from origin? Remembers it if it is. Anything older than the
+ * window counts as seen.
+ */
+static int firstSeen(uint32_t origin, uint64_t seq) {
+    origin_seen_t *seen = NULL;
+    for (int i = 0; i < fed.nr_seen && seen == NULL; i++) {
+        if (fed.seen[i].node == origin)
+            seen = &fed.seen[i];
+    }
+    if (seen == NULL) {
+        if (fed.nr_seen == fed.seen_cap) {
+            int cap = fed.seen_cap ? fed.seen_cap * 2 : 16;
+            origin_seen_t *grown = realloc(fed.seen, cap * sizeof(origin_seen_t));
+            if (grown == NULL)
+                return 0;
+            fed.seen = grown;
+            fed.seen_cap = cap;
+        }
+        seen = &fed.seen[fed.nr_seen++];
+        memset(seen, 0, sizeof(*seen));
+        seen->node = origin;
+        seen->seq = seq;
+    } else if (seq > seen->seq) {
+        /* slide the window up to seq, forgetting what falls out of it */
+        if (seq - seen->seq >= FED_SEEN_WINDOW) {
+            memset(seen->window, 0, sizeof(seen->window));
+        } else {
+            for (uint64_t s = seen->seq + 1; s <= seq; s++)
+                seen->window[s % FED_SEEN_WINDOW / 64] &= ~(1ULL << (s % 64));
+        }
+        seen->seq = seq;
+    } else if (seen->seq - seq >= FED_SEEN_WINDOW) {
+        return 0;
+    }
+    uint64_t *word = &seen->window[seq % FED_SEEN_WINDOW / 64];
+    uint64_t bit = 1ULL << (seq % 64);
+    if (*word & bit)
+        return 0;
+    *word |= bit;
+    return 1;
+}
+
+/*
+ * Publish a message from a peer as if a client of this node had sent it.
+ * All messages of one origin go through the same worker, which keeps them
+ * in order.
+ */
+static void publishLocally(uint32_t origin, const char *room, int roomLen, const char *data, int len) {
+    int id = roomLen == 0 ? LOBBY_ROOM : room_lookup(fed.registry, room, roomLen);
+    if (id < 0) {
+        log_warn("peer message for an invalid room dropped");
+        return;
+    }
+    msg_body_t *body = msg_body_create(data, len);
+    forward_msg_t *fwd = malloc(sizeof(forward_msg_t));
+    if (body == NULL || fwd == NULL) {
+        if (body != NULL)
+            msg_body_unref(body);
+        free(fwd);
+        return;
+    }
+    body->room = id;
+    fwd->body = body;
+    fwd->slab = NULL;
+    fwd->ingest = 1;
+    worker_post(&fed.group->workers[origin % fed.group->nr_workers], fwd);
+}
+
+/*
+ * Take the entries of one batch from link, once its number and MAC check out.
+ * @ return value - 0 on success, -1 if the batch is malformed or forged
+ */
+static int receiveBatch(link_t *link, const char *frame, uint32_t len) {
+    if (len < 12 + MAC_LEN)
+        return ERROR;
+    len -= MAC_LEN;
+    unsigned char mac[MAC_LEN];
+    HMAC(EVP_sha256(), link->key_in, MAC_LEN, (const unsigned char *) frame, len, mac, NULL);
+    if (CRYPTO_memcmp(mac, frame + len, MAC_LEN) != 0 || get64(frame) != ++link->batches_in)
+        return ERROR;
+    uint32_t count = get32(frame + 8);
+    uint32_t pos = 12;
+    metric_add(&framesIn, 1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (len - pos < ENTRY_HEADER)
+            return ERROR;
+        const char *p = frame + pos;
+        uint32_t origin = get32(p);
+        uint64_t seq = get64(p + 4);
+        int roomLen = (unsigned char) p[12];
+        if (len - pos < ENTRY_HEADER + (uint32_t) roomLen)
+            return ERROR;
+        uint32_t dataLen = get32(p + 13 + roomLen);
+        if (len - pos - ENTRY_HEADER - roomLen < dataLen)
+            return ERROR;
+        const char *data = p + ENTRY_HEADER + roomLen;
+        pos += ENTRY_HEADER + roomLen + dataLen;
+        metric_add(&entriesIn, 1);
+        if (origin == fed.node_id || !firstSeen(origin, seq)) {
+            /* it came around a loop */
+            metric_add(&duplicates, 1);
+            continue;
+        }
+        sendAll(link, origin, seq, p + 13, roomLen, data, (int) dataLen);
+        publishLocally(origin, p + 13, roomLen, data, (int) dataLen);
+    }
+    return pos == len ? SUCCESS : ERROR;
+}
+
+/*
+ * Take the hello, the proof and the complete batches from the input of link.
+ */
+static int receiveFrames(link_t *link) {
+    link_buf_t *in = &link->in;
+    while (1) {
+        const char *p = in->data + in->start;
+        size_t avail = in->len - in->start;
+        if (link->state == LINK_HELLO) {
+            if (avail < HELLO_LEN)
+                break;
+            if (memcmp(p, HELLO_MAGIC, 8) != 0) {
+                linkDown(link, "not a peer");
+                return ERROR;
+            }
+            link->node = get32(p + 8);
+            if (link->node == fed.node_id || link->node == 0) {
+                linkDown(link, "peer has this node's id");
+                return ERROR;
+            }
+            helloReceived(link, p);
+            if (link->fd < 0)
+                return ERROR;
+            in->start += HELLO_LEN;
+            continue;
+        }
+        if (link->state == LINK_PROOF) {
+            unsigned char proof[MAC_LEN];
+            if (avail < MAC_LEN)
+                break;
+            HMAC(EVP_sha256(), link->key_in, MAC_LEN, (const unsigned char *) HELLO_MAGIC, 8, proof, NULL);
+            if (CRYPTO_memcmp(proof, p, MAC_LEN) != 0) {
+                linkDown(link, "peer does not know the secret");
+                return ERROR;
+            }
+            link->state = LINK_UP;
+            metric_add(&linksUp, 1);
+            log_info("peer link to node %u up", link->node);
+            in->start += MAC_LEN;
+            continue;
+        }
+        if (avail < 4)
+            break;
+        uint32_t len = get32(p);
+        if (len > FRAME_MAX) {
+            linkDown(link, "frame too large");
+            return ERROR;
+        }
+        if (avail - 4 < len)
+            break;
+        if (receiveBatch(link, p + 4, len) < 0) {
+            linkDown(link, "malformed batch");
+            return ERROR;
+        }
+        in->start += 4 + len;
+    }
+    if (in->start == in->len)
+        in->start = in->len = 0;
+    return SUCCESS;
+}
+
+static void readLink(link_t *link) {
+    while (link->fd >= 0) {
+        if (bufReserve(&link->in, 64 * 1024) < 0) {
+            linkDown(link, "out of memory");
+            return;
+        }
+        ssize_t n = read(link->fd, link->in.data + link->in.len, link->in.cap - link->in.len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            linkDown(link, n == 0 ? "closed by peer" : strerror(errno));
+            return;
+        }
+        link->in.len += (size_t) n;
+        if (receiveFrames(link) < 0)
+            return;
+    }
+}
+
+/*
+ * Write what is queued on link, up to the batch still being filled.
+ */
+static void writeLink(link_t *link) {
+    link_buf_t *out = &link->out;
+    while (link->fd >= 0) {
+        size_t end = link->batch != NO_BATCH ? link->batch : out->len;
+        if (out->start >= end)
+            break;
+        ssize_t n = write(link->fd, out->data + out->start, end - out->start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) {
+            linkDown(link, strerror(errno));
+            return;
+        }
+        out->start += (size_t) n;
+    }
+    if (out->start == out->len)
+        out->start = out->len = 0;
+}
+
+static void linkEvent(link_t *link, uint32_t events) {
+    if (link->state == LINK_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            linkDown(link, strerror(err));
+            return;
+        }
+        link->state = LINK_HELLO;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        readLink(link);
+    if (events & EPOLLOUT)
+        writeLink(link);
+}
+
+static void acceptLinks(void) {
+    while (1) {
+        int fd = accept4(fed.listen_sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        link_t *link = fed.nr_links < MAX_LINKS ? calloc(1, sizeof(link_t)) : NULL;
+        if (link == NULL) {
+            log_warn("peer link refused, %d links already", fed.nr_links);
+            close(fd);
+            continue;
+        }
+        fed.links[fed.nr_links++] = link;
+        linkStart(link, fd, LINK_HELLO);
+    }
+}
+
+/*
+ * Send the messages the workers handed over to every peer, each with the
+ * next sequence number of this node.
+ */
+static void drainInbox(void) {
+    uint64_t count;
+    while (read(fed.wake_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+    atomic_exchange_explicit(&fed.wakeup_pending, 0, memory_order_acq_rel);
+    mpsc_node_t *node;
+    while ((node = mpsc_pop(&fed.inbox)) != NULL) {
+        forward_msg_t *fwd = (forward_msg_t *) node;
+        msg_body_t *body = fwd->body;
+        const char *room = room_info(fed.registry, body->room)->name;
+        sendAll(NULL, fed.node_id, ++fed.seq, room, (int) strlen(room), body->data, body->size);
+        metric_add(&published, 1);
+        msg_body_unref(body);
+        slab_free(fwd->slab, fwd);
+    }
+}
+
+/*
+ * Milliseconds until the next link is due to be opened again, -1 for none.
+ */
+static int nextTimeout(uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < fed.nr_links; i++) {
+        if (fed.links[i]->state == LINK_DOWN && fed.links[i]->retry_at < next)
+            next = fed.links[i]->retry_at;
+    }
+    if (next == UINT64_MAX)
+        return -1;
+    return next <= now ? 0 : (int) ((next - now) / 1000000 + 1);
+}
+
+static void *federationLoop(void *arg) {
+    (void) arg;
+    struct epoll_event events[64];
+    while (!atomic_load(&fedStop)) {
+        int n = epoll_wait(fed.epfd, events, 64, nextTimeout(metrics_now()));
+        if (n < 0 && errno != EINTR) {
+            log_error("peer links: epoll_wait: %m");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &fed.listen_sd)
+                acceptLinks();
+            else if (ptr != &fed.wake_fd)
+                linkEvent(ptr, events[i].events);
+        }
+        drainInbox();
+        uint64_t now = metrics_now();
+        for (int i = 0; i < fed.nr_links; i++) {
+            link_t *link = fed.links[i];
+            if (link->state == LINK_DOWN && link->address != NULL && link->retry_at <= now)
+                linkConnect(link);
+            /* everything gathered in this round goes out as one batch per link */
+            closeBatch(link);
+            if (link->state != LINK_CONNECTING)
+                writeLink(link);
+        }
+        reapLinks();
+    }
+    return NULL;
+}
+
+static int listenLinks(const struct sockaddr_in *addr) {
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+        return ERROR;
+    int on = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sd, (const struct sockaddr *) addr, sizeof(*addr)) < 0 || listen(sd, 16) < 0) {
+        close(sd);
+        return ERROR;
+    }
+    return sd;
+}
+
+/*
+ * Read the shared secret of the peers from path, without a trailing newline.
+ */
+static int readSecret(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("peer secret %s: %m", path);
+        return ERROR;
+    }
+    ssize_t n = read(fd, fed.secret, SECRET_MAX);
+    close(fd);
+    while (n > 0 && (fed.secret[n - 1] == '\n' || fed.secret[n - 1] == '\r'))
+        n--;
+    if (n <= 0) {
+        log_error("peer secret %s: empty or unreadable", path);
+        return ERROR;
+    }
+    fed.secret_len = (int) n;
+    return SUCCESS;
+}
+
+int federation_start(const federation_config_t *config, worker_group_t *group) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config->port);
+    if (inet_pton(AF_INET, config->addr, &addr.sin_addr) != 1) {
+        log_error("peer address %s is not an IPv4 address", config->addr);
+        return ERROR;
+    }
+    if (config->secret_file != NULL && readSecret(config->secret_file) < 0)
+        return ERROR;
+    /* anyone reaching the port could inject messages under any origin */
+    if (config->port > 0 && fed.secret_len == 0 && (ntohl(addr.sin_addr.s_addr) >> 24) != 127) {
+        log_error("peer port on %s needs --peer-secret", config->addr);
+        return ERROR;
+    }
+    fed.node_id = config->node_id;
+    fed.group = group;
+    fed.registry = group->workers[0].pool->registry;
+    /* sequence numbers keep growing across restarts of this node, peers remember the last one */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fed.seq = (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+    mpsc_init(&fed.inbox);
+    atomic_init(&fed.wakeup_pending, 0);
+    fed.epfd = epoll_create1(EPOLL_CLOEXEC);
+    fed.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &fed.wake_fd};
+    if (fed.epfd < 0 || fed.wake_fd < 0 || epoll_ctl(fed.epfd, EPOLL_CTL_ADD, fed.wake_fd, &ev) < 0) {
+        log_error("peer links: %m");
+        return ERROR;
+    }
+    if (config->port > 0) {
+        ev.data.ptr = &fed.listen_sd;
+        if ((fed.listen_sd = listenLinks(&addr)) < 0
+            || epoll_ctl(fed.epfd, EPOLL_CTL_ADD, fed.listen_sd, &ev) < 0) {
+            log_error("peer listener on %s:%d: %m", config->addr, config->port);
+            return ERROR;
+        }
+    }
+    for (int i = 0; i < config->nr_peers; i++) {
+        link_t *link = calloc(1, sizeof(link_t));
+        if (link == NULL)
+            return ERROR;
+        link->fd = -1;
+        link->state = LINK_DOWN;
+        link->address = config->peers[i];
+        link->batch = NO_BATCH;
+        fed.links[fed.nr_links++] = link;
+    }
+    if (pthread_create(&fed.thread, NULL, federationLoop, NULL) != 0)
+        return ERROR;
+    atomic_store(&fedRunning, 1);
+    log_info("Node %u: %d peer(s), peer port %d", fed.node_id, config->nr_peers, config->port);
+    return SUCCESS;
+}
+
+void federation_stop(void) {
+    if (!atomic_load(&fedRunning))
+        return;
+    atomic_store(&fedRunning, 0);
+    atomic_store(&fedStop, 1);
+    uint64_t one = 1;
+    (void) write(fed.wake_fd, &one, sizeof(one));
+    pthread_join(fed.thread, NULL);
+    drainInbox();
+    for (int i = 0; i < fed.nr_links; i++) {
+        if (fed.links[i]->state == LINK_UP)
+            metric_sub(&linksUp, 1);
+        if (fed.links[i]->fd >= 0)
+            close(fed.links[i]->fd);
+        bufFree(&fed.links[i]->in);
+        bufFree(&fed.links[i]->out);
+        free(fed.links[i]);
+    }
+    fed.nr_links = 0;
+    OPENSSL_cleanse(fed.secret, sizeof(fed.secret));
+    fed.secret_len = 0;
+    free(fed.seen);
+    fed.seen = NULL;
+    if (fed.listen_sd >= 0)
+        close(fed.listen_sd);
+    close(fed.wake_fd);
+    close(fed.epfd);
+}
+
+void federation_publish(worker_t *w, msg_body_t *body) {
+    if (!atomic_load_explicit(&fedRunning, memory_order_relaxed))
+        return;
+    forward_msg_t *fwd = slab_alloc(&w->pool->arena.forwards);
+    if (fwd == NULL)
+        return;
+    fwd->slab = &w->pool->arena.forwards;
+    fwd->body = msg_body_ref(body);
+    fwd->ingest = 0;
+    mpsc_push(&fed.inbox, &fwd->node);
+    if (!atomic_exchange_explicit(&fed.wakeup_pending, 1, memory_order_acq_rel)) {
+        uint64_t one = 1;
+        while (write(fed.wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+}
+
+void federation_write_metrics(FILE *out) {
+    if (fed.node_id == 0)
+        return;
+    fprintf(out, "# HELP chat_peer_links Peer links up.\n# TYPE chat_peer_links gauge\nchat_peer_links %llu\n",
+            (unsigned long long) metric_get(&linksUp));
+    fprintf(out, "# HELP chat_peer_published_total Messages of this node handed to the peer links.\n"
+                 "# TYPE chat_peer_published_total counter\nchat_peer_published_total %llu\n",
+            (unsigned long long) metric_get(&published));
+    fprintf(out, "# HELP chat_peer_frames_out_total Batches sent to peers.\n"
+                 "# TYPE chat_peer_frames_out_total counter\nchat_peer_frames_out_total %llu\n",
+            (unsigned long long) metric_get(&framesOut));
+    fprintf(out, "# HELP chat_peer_messages_out_total Messages sent to peers, relayed ones included.\n"
+                 "# TYPE chat_peer_messages_out_total counter\nchat_peer_messages_out_total %llu\n",
+            (unsigned long long) metric_get(&entriesOut));
+    fprintf(out, "# HELP chat_peer_frames_in_total Batches received from peers.\n"
+                 "# TYPE chat_peer_frames_in_total counter\nchat_peer_frames_in_total %llu\n",
+            (unsigned long long) metric_get(&framesIn));
+    fprintf(out, "# HELP chat_peer_messages_in_total Messages received from peers.\n"
+                 "# TYPE chat_peer_messages_in_total counter\nchat_peer_messages_in_total %llu\n",
+            (unsigned long long) metric_get(&entriesIn));
+    fprintf(out, "# HELP chat_peer_duplicates_total Messages from peers dropped as seen before.\n"
+                 "# TYPE chat_peer_duplicates_total counter\nchat_peer_duplicates_total %llu\n",
+            (unsigned long long) metric_get(&duplicates));
+}
@@ -0,0 +1,97 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Federation of several server processes into one logical chat.
+ *
+ * Every node runs a peer link thread next to its workers. Links are plain
+ * TCP: a node listens on its peer port and connects to the peers it was
+ * given, reconnecting while they are down.
+ *
+ * Links are authenticated, not encrypted. Both ends open with a hello of
+ * their node id and a random nonce, then prove they know the secret shared
+ * by all peers (--peer-secret) with an HMAC-SHA256 under a key derived from
+ * the secret, both ids and both nonces. Every batch carries its number and
+ * a MAC under that key, so nobody without the secret can inject messages or
+ * replay them, even on a link they relay. Without a secret the key is
+ * derived from an empty one, which only a peer port bound to loopback (the
+ * default) allows.
+ *
+ * A message read from a client of
+ * this node gets the node's id as origin and the next sequence number, and
+ * goes to every linked peer. A peer relays what it receives to its other
+ * peers and remembers, per origin, which of the last FED_SEEN_WINDOW
+ * sequence numbers it saw: a message seen before came around a loop and is
+ * dropped. Paths need not deliver in step, after a link comes back the
+ * newer messages of an origin may arrive on it before older ones still on
+ * their way over another path. Any topology works, a full mesh is the
+ * shortest path.
+ *
+ * Messages are batched: whatever the workers handed over since the thread
+ * last ran goes out as one peer frame per link, up to FED_BATCH_BYTES.
+ * Nothing is stored for a peer while its link is down.
+ */
+
+/* Most peers a node connects to. */
+#define FED_MAX_PEERS 32
+/* Address the peer port binds unless --peer-addr says otherwise: this host only. */
+#define FED_DEFAULT_ADDR "127.0.0.1"
+/* Peer frames are closed at this size, a bigger message gets a frame of its own. */
+#define FED_BATCH_BYTES (64 * 1024)
+/*
+ * Sequence numbers remembered per origin. A message arriving more than this
+ * many behind the newest of its origin is taken for a duplicate and lost,
+ * which a path lagging that far behind another (up to the 64 MiB a slow
+ * link may queue) can cause.
+ */
+#define FED_SEEN_WINDOW 4096
+
+struct msg_body;
+struct worker;
+struct worker_group;
+
+/*
+ * Peer link options of the server.
+ */
+typedef struct federation_config {
+    /* Id of this node, unique in the federation, 0 with federation off. */
+    uint32_t node_id;
+    /* TCP port peers connect to, 0 for none, and the IPv4 address it binds. */
+    int port;
+    const char *addr;
+    /* File holding the secret shared by all peers, NULL for none. */
+    const char *secret_file;
+    /* "host:port" of the peers this node connects to. */
+    const char *peers[FED_MAX_PEERS];
+    int nr_peers;
+} federation_config_t;
+
+/*
+ * Start the peer link thread. Messages from peers are published through the
+ * workers of group, one worker per origin node.
+ * @ return value - 0 on success, -1 on failure (logged)
+ */
+int federation_start(const federation_config_t *config, struct worker_group *group);
+
+/*
+ * Stop the peer link thread, if it was started, and close every link. The
+ * workers must have stopped already.
+ */
+void federation_stop(void);
+
+/*
+ * Hand a message read from a client of this node to the peer link thread,
+ * which takes its own reference. Does nothing with federation off.
+ * @ w - the worker that read it
+ */
+void federation_publish(struct worker *w, struct msg_body *body);
+
+/*
+ * Write the peer link counters in Prometheus text exposition format.
+ */
+void federation_write_metrics(FILE *out);
+
+#endif
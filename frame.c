@@ -0,0 +1,39 @@
+#include "frame.h"
+
+#define ERROR (-1)
+
+int frame_header_encode(char *out, uint32_t length, int type, int flags) {
+    int n = 0;
+    while (length >= 0x80) {
+        out[n++] = (char) (length | 0x80);
+        length >>= 7;
+    }
+    out[n++] = (char) length;
+    out[n++] = (char) type;
+    out[n++] = (char) flags;
+    return n;
+}
+
+int frame_header_decode(const char *p, int avail, frame_header_t *header) {
+    uint64_t length = 0;
+    int n = 0;
+    while (1) {
+        if (n == avail)
+            return 0;
+        unsigned char byte = (unsigned char) p[n];
+        length |= (uint64_t) (byte & 0x7f) << (7 * n);
+        n++;
+        if (!(byte & 0x80))
+            break;
+        if (n == 5)
+            return ERROR;
+    }
+    if (length > UINT32_MAX)
+        return ERROR;
+    if (avail < n + 2)
+        return 0;
+    header->length = (uint32_t) length;
+    header->type = (unsigned char) p[n];
+    header->flags = (unsigned char) p[n + 1];
+    return n + 2;
+}
@@ -0,0 +1,54 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+/*
+ * Binary framing, the alternative to newline terminated lines a client
+ * picks by sending the line "/binary". Every frame starts with a header:
+ *
+ *   length   payload bytes, unsigned LEB128 varint of at most 5 bytes
+ *   type     one byte, FRAME_MESSAGE or FRAME_CONTROL
+ *   flags    one byte, FRAME_COMPRESSED or 0
+ *
+ * followed by the payload. The header alone says where a frame ends, the
+ * payload is never looked at.
+ */
+
+/* Longest frame header. */
+#define FRAME_HEADER_MAX 7
+
+/*
+ * A message, fanned out as a line: a payload that does not end in a newline
+ * gets one, and messages of line clients arrive with theirs.
+ */
+#define FRAME_MESSAGE 0
+/* A command line ("/join <room>", "/ping", ...), never fanned out. */
+#define FRAME_CONTROL 1
+
+/*
+ * The payload is the message compressed with the codec the client asked for
+ * ("/compress zlib"). Only the server sets it, clients send raw frames.
+ */
+#define FRAME_COMPRESSED 0x01
+
+typedef struct frame_header {
+    uint32_t length;
+    int type;
+    int flags;
+} frame_header_t;
+
+/*
+ * Write the header of a frame to out, which has room for FRAME_HEADER_MAX bytes.
+ * @ return value - length of the header
+ */
+int frame_header_encode(char *out, uint32_t length, int type, int flags);
+
+/*
+ * Parse the header at the start of p[0..avail).
+ * @ return value - length of the header, 0 if it is not complete yet, -1 if
+ *   the length does not fit in 32 bits
+ */
+int frame_header_decode(const char *p, int avail, frame_header_t *header);
+
+#endif
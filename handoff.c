@@ -0,0 +1,446 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "handoff.h"
+#include "log.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/* Sent by the successor to ask, and in front of the state sent back. */
+#define HANDOFF_MAGIC "CHATHOT1"
+/* Header of the state: magic, number of descriptors, length of the stream. */
+#define HANDOFF_HEADER 20
+/* How often the listener thread looks at the stop flag. */
+#define HANDOFF_POLL_MS 200
+/* Longest a successor waits for the old server to stop and send everything. */
+#define HANDOFF_TIMEOUT_SEC 30
+
+static struct {
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    void (*requested)(void);
+    pthread_t thread;
+    int listen_sd;
+    /* The successor, once it asked. */
+    int peer_sd;
+} hand = {.listen_sd = -1, .peer_sd = -1};
+
+static atomic_int handStop = 0;
+static atomic_int handRequested = 0;
+
+void handoff_init(handoff_buf_t *buf) {
+    memset(buf, 0, sizeof(*buf));
+}
+
+void handoff_free(handoff_buf_t *buf) {
+    for (int i = 0; i < buf->nr_fds; i++) {
+        if (buf->received && buf->fds[i] >= 0)
+            close(buf->fds[i]);
+    }
+    free(buf->data);
+    free(buf->fds);
+    free(buf->objects);
+    free(buf->index);
+    handoff_init(buf);
+}
+
+static int reserve(handoff_buf_t *buf, size_t n) {
+    if (buf->failed)
+        return ERROR;
+    if (buf->len + n <= buf->cap)
+        return SUCCESS;
+    size_t cap = buf->cap ? buf->cap : 64 * 1024;
+    while (cap < buf->len + n)
+        cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        buf->failed = 1;
+        return ERROR;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return SUCCESS;
+}
+
+void handoff_put(handoff_buf_t *buf, const void *data, size_t len) {
+    if (reserve(buf, len) < 0)
+        return;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void handoff_put8(handoff_buf_t *buf, uint8_t v) {
+    handoff_put(buf, &v, 1);
+}
+
+/* both ends run the same binary on the same machine, host byte order it is */
+void handoff_put32(handoff_buf_t *buf, uint32_t v) {
+    handoff_put(buf, &v, 4);
+}
+
+void handoff_put_string(handoff_buf_t *buf, const char *s) {
+    size_t len = strlen(s);
+    if (len > 255)
+        len = 255;
+    handoff_put8(buf, (uint8_t) len);
+    handoff_put(buf, s, len);
+}
+
+static int pushFd(handoff_buf_t *buf, int fd) {
+    if (buf->nr_fds == buf->fds_cap) {
+        int cap = buf->fds_cap ? buf->fds_cap * 2 : 256;
+        int *fds = realloc(buf->fds, cap * sizeof(int));
+        if (fds == NULL) {
+            buf->failed = 1;
+            return ERROR;
+        }
+        buf->fds = fds;
+        buf->fds_cap = cap;
+    }
+    buf->fds[buf->nr_fds++] = fd;
+    return SUCCESS;
+}
+
+void handoff_put_fd(handoff_buf_t *buf, int fd) {
+    if (pushFd(buf, fd) == SUCCESS)
+        handoff_put32(buf, (uint32_t) buf->nr_fds - 1);
+}
+
+static uint32_t hashAddress(const void *obj, uint32_t cap) {
+    uint64_t h = (uint64_t) (uintptr_t) obj * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t) (h >> 32) & (cap - 1);
+}
+
+static int growIndex(handoff_buf_t *buf) {
+    uint32_t cap = buf->index_cap ? buf->index_cap * 2 : 1024;
+    uint32_t *index = malloc(cap * sizeof(uint32_t));
+    if (index == NULL)
+        return ERROR;
+    /* slots hold object number + 1, 0 is free */
+    memset(index, 0, cap * sizeof(uint32_t));
+    for (uint32_t i = 0; i < buf->nr_objects; i++) {
+        uint32_t slot = hashAddress(buf->objects[i], cap);
+        while (index[slot] != 0)
+            slot = (slot + 1) & (cap - 1);
+        index[slot] = i + 1;
+    }
+    free(buf->index);
+    buf->index = index;
+    buf->index_cap = cap;
+    return SUCCESS;
+}
+
+static int addObject(handoff_buf_t *buf, const void *obj) {
+    if (buf->nr_objects == buf->objects_cap) {
+        uint32_t cap = buf->objects_cap ? buf->objects_cap * 2 : 1024;
+        const void **objects = realloc(buf->objects, cap * sizeof(void *));
+        if (objects == NULL) {
+            buf->failed = 1;
+            return ERROR;
+        }
+        buf->objects = objects;
+        buf->objects_cap = cap;
+    }
+    buf->objects[buf->nr_objects++] = obj;
+    return SUCCESS;
+}
+
+int handoff_put_object(handoff_buf_t *buf, const void *obj) {
+    if (buf->failed)
+        return 0;
+    if ((buf->nr_objects + 1) * 2 > buf->index_cap && growIndex(buf) < 0) {
+        buf->failed = 1;
+        return 0;
+    }
+    uint32_t slot = hashAddress(obj, buf->index_cap);
+    for (; buf->index[slot] != 0; slot = (slot + 1) & (buf->index_cap - 1)) {
+        if (buf->objects[buf->index[slot] - 1] == obj) {
+            handoff_put32(buf, buf->index[slot] - 1);
+            return 0;
+        }
+    }
+    if (addObject(buf, obj) < 0)
+        return 0;
+    buf->index[slot] = buf->nr_objects;
+    handoff_put32(buf, buf->nr_objects - 1);
+    return 1;
+}
+
+int handoff_get(handoff_buf_t *buf, void *out, size_t len) {
+    if (buf->failed || buf->len - buf->pos < len) {
+        buf->failed = 1;
+        memset(out, 0, len);
+        return ERROR;
+    }
+    memcpy(out, buf->data + buf->pos, len);
+    buf->pos += len;
+    return SUCCESS;
+}
+
+uint8_t handoff_get8(handoff_buf_t *buf) {
+    uint8_t v;
+    handoff_get(buf, &v, 1);
+    return v;
+}
+
+uint32_t handoff_get32(handoff_buf_t *buf) {
+    uint32_t v;
+    handoff_get(buf, &v, 4);
+    return v;
+}
+
+int handoff_get_string(handoff_buf_t *buf, char *out) {
+    int len = handoff_get8(buf);
+    if (handoff_get(buf, out, (size_t) len) < 0)
+        len = 0;
+    out[len] = '\0';
+    return len;
+}
+
+int handoff_get_fd(handoff_buf_t *buf) {
+    uint32_t i = handoff_get32(buf);
+    if (buf->failed || i >= (uint32_t) buf->nr_fds || buf->fds[i] < 0)
+        return ERROR;
+    int fd = buf->fds[i];
+    buf->fds[i] = -1;
+    return fd;
+}
+
+int handoff_get_object(handoff_buf_t *buf, const void **obj) {
+    uint32_t i = handoff_get32(buf);
+    *obj = NULL;
+    if (buf->failed || i > buf->nr_objects) {
+        buf->failed = 1;
+        return ERROR;
+    }
+    if (i < buf->nr_objects)
+        *obj = buf->objects[i];
+    return SUCCESS;
+}
+
+void handoff_got_object(handoff_buf_t *buf, const void *obj) {
+    addObject(buf, obj);
+}
+
+static int fillAddress(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("handoff socket path %s is too long", path);
+        return ERROR;
+    }
+    strcpy(addr->sun_path, path);
+    return SUCCESS;
+}
+
+static int readFull(int sd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(sd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERROR;
+        p += n;
+        len -= (size_t) n;
+    }
+    return SUCCESS;
+}
+
+static int writeFull(int sd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(sd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERROR;
+        p += n;
+        len -= (size_t) n;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Receive nr descriptors, HANDOFF_FDS_PER_MSG per message. Each message
+ * carries one byte, so a read never runs into the next one.
+ */
+static int receiveFds(int sd, handoff_buf_t *buf, int nr) {
+    buf->received = 1;
+    while (nr > 0) {
+        int batch = nr < HANDOFF_FDS_PER_MSG ? nr : HANDOFF_FDS_PER_MSG;
+        char byte;
+        char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = CMSG_SPACE(batch * sizeof(int))};
+        ssize_t n = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (n != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(batch * sizeof(int)) || (msg.msg_flags & MSG_CTRUNC)) {
+            errno = n < 0 ? errno : EPROTO;
+            return ERROR;
+        }
+        int fds[HANDOFF_FDS_PER_MSG];
+        memcpy(fds, CMSG_DATA(cmsg), batch * sizeof(int));
+        for (int i = 0; i < batch; i++)
+            pushFd(buf, fds[i]);
+        nr -= batch;
+    }
+    return buf->failed ? ERROR : SUCCESS;
+}
+
+static int sendFds(int sd, const int *fds, int nr) {
+    while (nr > 0) {
+        int batch = nr < HANDOFF_FDS_PER_MSG ? nr : HANDOFF_FDS_PER_MSG;
+        char byte = 0;
+        char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        memset(control, 0, sizeof(control));
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = CMSG_SPACE(batch * sizeof(int))};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, batch * sizeof(int));
+        ssize_t n = sendmsg(sd, &msg, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != 1)
+            return ERROR;
+        fds += batch;
+        nr -= batch;
+    }
+    return SUCCESS;
+}
+
+int handoff_receive(const char *path, handoff_buf_t *buf) {
+    struct sockaddr_un addr;
+    if (fillAddress(&addr, path) < 0)
+        return ERROR;
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+        return ERROR;
+    if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(sd);
+        /* nobody there, or a socket left by a server that is gone */
+        if (err == ENOENT || err == ECONNREFUSED)
+            return 0;
+        log_error("handoff socket %s: %s", path, strerror(err));
+        return ERROR;
+    }
+    struct timeval timeout = {HANDOFF_TIMEOUT_SEC, 0};
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char header[HANDOFF_HEADER];
+    uint32_t nr;
+    uint64_t len;
+    errno = 0;
+    if (writeFull(sd, HANDOFF_MAGIC, 8) < 0 || readFull(sd, header, sizeof(header)) < 0
+        || memcmp(header, HANDOFF_MAGIC, 8) != 0)
+        goto fail;
+    memcpy(&nr, header + 8, 4);
+    memcpy(&len, header + 12, 8);
+    if (receiveFds(sd, buf, (int) nr) < 0 || reserve(buf, len) < 0 || readFull(sd, buf->data, len) < 0)
+        goto fail;
+    buf->len = len;
+    close(sd);
+    return 1;
+fail:
+    log_error("taking over from %s: %s", path, errno != 0 ? strerror(errno) : "protocol error");
+    close(sd);
+    return ERROR;
+}
+
+static void *handoffLoop(void *arg) {
+    (void) arg;
+    struct pollfd pfd = {hand.listen_sd, POLLIN, 0};
+    while (!atomic_load(&handStop)) {
+        if (poll(&pfd, 1, HANDOFF_POLL_MS) <= 0)
+            continue;
+        int sd = accept4(hand.listen_sd, NULL, NULL, SOCK_CLOEXEC);
+        if (sd < 0)
+            continue;
+        char magic[8];
+        struct timeval timeout = {1, 0};
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (readFull(sd, magic, sizeof(magic)) < 0 || memcmp(magic, HANDOFF_MAGIC, 8) != 0) {
+            close(sd);
+            continue;
+        }
+        log_info("A new process asked to take over, handing off");
+        hand.peer_sd = sd;
+        atomic_store(&handRequested, 1);
+        hand.requested();
+        break;
+    }
+    return NULL;
+}
+
+int handoff_listen(const char *path, void (*requested)(void)) {
+    struct sockaddr_un addr;
+    if (fillAddress(&addr, path) < 0)
+        return ERROR;
+    strcpy(hand.path, path);
+    hand.requested = requested;
+    hand.listen_sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (hand.listen_sd < 0)
+        return ERROR;
+    unlink(path);
+    if (bind(hand.listen_sd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(hand.listen_sd, 1) < 0
+        || pthread_create(&hand.thread, NULL, handoffLoop, NULL) != 0) {
+        log_error("handoff socket %s: %m", path);
+        close(hand.listen_sd);
+        hand.listen_sd = -1;
+        return ERROR;
+    }
+    log_info("Handing off to a new process on request at %s", path);
+    return SUCCESS;
+}
+
+int handoff_requested(void) {
+    return atomic_load(&handRequested);
+}
+
+int handoff_send(handoff_buf_t *buf) {
+    char header[HANDOFF_HEADER];
+    uint32_t nr = (uint32_t) buf->nr_fds;
+    uint64_t len = buf->len;
+    memcpy(header, HANDOFF_MAGIC, 8);
+    memcpy(header + 8, &nr, 4);
+    memcpy(header + 12, &len, 8);
+    int sd = hand.peer_sd;
+    hand.peer_sd = -1;
+    if (buf->failed || writeFull(sd, header, sizeof(header)) < 0 || sendFds(sd, buf->fds, buf->nr_fds) < 0
+        || writeFull(sd, buf->data, buf->len) < 0) {
+        log_error("handing off: %s", buf->failed ? "out of memory" : strerror(errno));
+        close(sd);
+        return ERROR;
+    }
+    close(sd);
+    return SUCCESS;
+}
+
+void handoff_stop(void) {
+    if (hand.listen_sd < 0)
+        return;
+    atomic_store(&handStop, 1);
+    pthread_join(hand.thread, NULL);
+    close(hand.listen_sd);
+    hand.listen_sd = -1;
+    /* the successor binds the path again itself */
+    if (!atomic_load(&handRequested))
+        unlink(hand.path);
+    if (hand.peer_sd >= 0)
+        close(hand.peer_sd);
+}
@@ -0,0 +1,150 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hot restart: a running server hands its listening sockets and its client
+ * connections to a new process, without closing any of them.
+ *
+ * Both processes are started with --handoff PATH. A new process first
+ * connects to the Unix socket at PATH. If a server answers, that server
+ * stops serving and sends over every listening socket and connection
+ * (SCM_RIGHTS), each with its state: framing, room, unparsed input and the
+ * queue still to be written, the bodies of messages queued to several
+ * connections once. The old process exits once everything is sent. The new
+ * one resumes where it stopped, then listens on PATH for its own successor.
+ *
+ * The state travels as a byte stream built with the handoff_put*()
+ * functions and read back in the same order with handoff_get*(). The
+ * descriptors go first, a stream refers to them by index.
+ */
+
+/* Descriptors passed per message, below the kernel's SCM_MAX_FD. */
+#define HANDOFF_FDS_PER_MSG 250
+
+/*
+ * State being sent or received.
+ */
+typedef struct handoff_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    /* Read position. */
+    size_t pos;
+    /* Non-zero once a put ran out of memory or a get out of data. */
+    int failed;
+    /* Descriptors passed, and which of the received ones were taken (-1 for those). */
+    int *fds;
+    int nr_fds;
+    int fds_cap;
+    /* Non-zero if the descriptors were received, and are closed with the buffer. */
+    int received;
+    /* Shared objects put so far by address (sender) or got so far by index (receiver). */
+    const void **objects;
+    uint32_t nr_objects;
+    uint32_t objects_cap;
+    /* Open addressing index of objects by address, sender only. */
+    uint32_t *index;
+    uint32_t index_cap;
+} handoff_buf_t;
+
+/*
+ * Init an empty buffer.
+ */
+void handoff_init(handoff_buf_t *buf);
+
+/*
+ * Free a buffer, closing the received descriptors nobody took.
+ */
+void handoff_free(handoff_buf_t *buf);
+
+void handoff_put(handoff_buf_t *buf, const void *data, size_t len);
+void handoff_put8(handoff_buf_t *buf, uint8_t v);
+void handoff_put32(handoff_buf_t *buf, uint32_t v);
+
+/*
+ * Put a string of at most 255 bytes.
+ */
+void handoff_put_string(handoff_buf_t *buf, const char *s);
+
+/*
+ * Pass descriptor fd along. The sender keeps its own copy.
+ */
+void handoff_put_fd(handoff_buf_t *buf, int fd);
+
+/*
+ * Put a reference to a shared object.
+ * @ return value - non-zero the first time obj is put, the caller puts its
+ *   contents right after then
+ */
+int handoff_put_object(handoff_buf_t *buf, const void *obj);
+
+/*
+ * Copy the next len bytes to out.
+ * @ return value - 0 on success, -1 past the end of the data
+ */
+int handoff_get(handoff_buf_t *buf, void *out, size_t len);
+uint8_t handoff_get8(handoff_buf_t *buf);
+uint32_t handoff_get32(handoff_buf_t *buf);
+
+/*
+ * Get a string into out, which has room for 256 bytes.
+ * @ return value - its length
+ */
+int handoff_get_string(handoff_buf_t *buf, char *out);
+
+/*
+ * Take a passed descriptor, which the caller owns from now on.
+ * @ return value - the descriptor, -1 if there is none
+ */
+int handoff_get_fd(handoff_buf_t *buf);
+
+/*
+ * Get a reference to a shared object.
+ * @ obj - set to the object if it was got before, to NULL the first time:
+ *   its contents follow then, and the caller calls handoff_got_object()
+ * @ return value - 0 on success, -1 if the reference is invalid
+ */
+int handoff_get_object(handoff_buf_t *buf, const void **obj);
+
+/*
+ * Register the object a first reference stood for.
+ */
+void handoff_got_object(handoff_buf_t *buf, const void *obj);
+
+/*
+ * Take over from the server listening at path, if there is one: ask for its
+ * state and wait until all of it arrived, the old server stops serving
+ * meanwhile.
+ * @ return value - 1 if buf holds the state of a server, 0 if nobody
+ *   listens at path, -1 on failure (logged)
+ */
+int handoff_receive(const char *path, handoff_buf_t *buf);
+
+/*
+ * Listen at path for a successor from a thread of its own. When one asks,
+ * requested() is called on that thread, and the server is expected to stop
+ * and call handoff_send().
+ * @ return value - 0 on success, -1 on failure (logged)
+ */
+int handoff_listen(const char *path, void (*requested)(void));
+
+/*
+ * Is a successor waiting for handoff_send()?
+ */
+int handoff_requested(void);
+
+/*
+ * Send buf to the successor, with its descriptors.
+ * @ return value - 0 on success, -1 on failure (logged)
+ */
+int handoff_send(handoff_buf_t *buf);
+
+/*
+ * Stop listening at path, removing the socket unless a successor took over.
+ */
+void handoff_stop(void);
+
+#endif
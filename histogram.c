@@ -0,0 +1,56 @@
+#include <string.h>
+#include "histogram.h"
+
+uint64_t hist_bucket_value(int bucket) {
+    if (bucket < HIST_SUB_COUNT)
+        return (uint64_t) bucket;
+    int exp = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (bucket % HIST_SUB_COUNT) | HIST_SUB_COUNT;
+    return sub << (exp - HIST_SUB_BITS);
+}
+
+void hist_init(histogram_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(histogram_t *dst, const histogram_t *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_percentile(const histogram_t *h, double q) {
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (q * (double) h->total);
+    if (rank >= h->total)
+        rank = h->total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return hist_bucket_value(i);
+    }
+    return h->max;
+}
+
+void shared_hist_init(shared_histogram_t *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        atomic_init(&h->counts[i], 0);
+    atomic_init(&h->sum, 0);
+    atomic_init(&h->max, 0);
+}
+
+void shared_hist_snapshot(const shared_histogram_t *h, histogram_t *out) {
+    /* the total is counted from the buckets, so it always matches them */
+    out->total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        out->counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        out->total += out->counts[i];
+    }
+    out->sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    out->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+}
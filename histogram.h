@@ -0,0 +1,110 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Sub-buckets per power of two, 1 << HIST_SUB_BITS. Values are recorded with
+ * a relative error below 1 / (1 << HIST_SUB_BITS).
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+/* Buckets covering every uint64_t value. */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/*
+ * Log-linear (HDR style) histogram of 64 bit values, typically nanoseconds.
+ * Values below HIST_SUB_COUNT get a bucket each, every power of two above
+ * is split into HIST_SUB_COUNT equal buckets.
+ */
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    /* Number of values recorded. */
+    uint64_t total;
+    /* Sum and largest of the values recorded. */
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+/*
+ * Bucket holding value.
+ */
+static inline int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_COUNT)
+        return (int) value;
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (int) (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+/*
+ * Smallest value falling into bucket.
+ */
+uint64_t hist_bucket_value(int bucket);
+
+/*
+ * Reset a histogram to empty.
+ */
+void hist_init(histogram_t *h);
+
+/*
+ * Count one value.
+ */
+static inline void hist_record(histogram_t *h, uint64_t value) {
+    h->counts[hist_bucket(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/*
+ * Add the values of src to dst.
+ */
+void hist_merge(histogram_t *dst, const histogram_t *src);
+
+/*
+ * Histogram written by one thread and read by others at any time.
+ *
+ * Only the owner records, so an update is a relaxed load and store per
+ * field, no locked instruction. A reader takes a snapshot, which may be a
+ * few values behind but never torn per field.
+ */
+typedef struct shared_histogram {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} shared_histogram_t;
+
+static inline void shared_hist_bump(_Atomic uint64_t *field, uint64_t n) {
+    atomic_store_explicit(field, atomic_load_explicit(field, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ * Count one value, only callable by the owner.
+ */
+static inline void shared_hist_record(shared_histogram_t *h, uint64_t value) {
+    shared_hist_bump(&h->counts[hist_bucket(value)], 1);
+    shared_hist_bump(&h->sum, value);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+/*
+ * Reset a shared histogram to empty, before any thread uses it.
+ */
+void shared_hist_init(shared_histogram_t *h);
+
+/*
+ * Copy the current values of a shared histogram, callable from any thread.
+ */
+void shared_hist_snapshot(const shared_histogram_t *h, histogram_t *out);
+
+/*
+ * Value below which the fraction q (0 to 1) of the recorded values fall.
+ * @ return value - the lower bound of the bucket reaching q, 0 when empty
+ */
+uint64_t hist_percentile(const histogram_t *h, double q);
+
+#endif
@@ -0,0 +1,525 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "journal.h"
+#include "log.h"
+#include "worker.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/*
+ * Every record starts with the size and the CRC-32 of the rest of it, in
+ * host byte order (a journal stays on its machine), followed by the length
+ * of the room name, the name and the message. A size of 0, where the segment
+ * is still zeroed, ends the segment, so does a CRC that does not match (a
+ * record torn by a crash).
+ */
+#define RECORD_HEADER 8
+/* Segments are named by number, zero padded so they list in order. */
+#define SEGMENT_NAME "%010u.journal"
+#define SEGMENT_NAME_MAX 32
+/* The next segment, made ahead of time by the sync thread. */
+#define SPARE_NAME "spare.journal"
+
+typedef struct segment {
+    int fd;
+    uint32_t number;
+    char *map;
+    size_t size;
+    /* Bytes appended, and bytes the sync thread wrote back. */
+    size_t used;
+    size_t synced;
+    struct segment *next;
+} segment_t;
+
+static struct {
+    room_registry_t *registry;
+    int dirfd;
+    uint64_t sync_ns;
+    size_t sync_bytes;
+    size_t segment_bytes;
+    int keep;
+    size_t page;
+    pthread_t thread;
+    /* Everything below is under lock. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    /* Segment appended to, and the full ones the sync thread is to close, oldest first. */
+    segment_t *current;
+    segment_t *retired;
+    /* Segment ready to take over from current, NULL until the sync thread made it. */
+    segment_t *spare;
+    /* Number of the next segment, and of the oldest one on disk. */
+    uint32_t next_number;
+    uint32_t oldest;
+    /* The sync thread waits for a first message, or has to sync right away. */
+    int idle;
+    int kicked;
+    int stop;
+} jr = {.dirfd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static atomic_int journalOpen = 0;
+
+/* Counters, written under the lock or by the sync thread only. */
+static metric_t records;
+static metric_t recordBytes;
+static metric_t failures;
+static metric_t syncs;
+static metric_t syncNs;
+static metric_t replayed;
+
+/*
+ * Create a segment file of size bytes, blocks allocated, and map it.
+ */
+static segment_t *createSegment(const char *name, uint32_t number, size_t size) {
+    segment_t *seg = calloc(1, sizeof(segment_t));
+    if (seg == NULL)
+        return NULL;
+    seg->fd = openat(jr.dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd < 0)
+        goto fail;
+    /* with the blocks allocated now, writing to the mapping cannot run out of space (SIGBUS) */
+    int err = posix_fallocate(seg->fd, 0, (off_t) size);
+    if (err != 0) {
+        errno = err;
+        goto fail;
+    }
+    seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED)
+        goto fail;
+    seg->number = number;
+    seg->size = size;
+    return seg;
+fail:
+    log_error("journal segment %s: %m", name);
+    if (seg->fd >= 0) {
+        close(seg->fd);
+        unlinkat(jr.dirfd, name, 0);
+    }
+    free(seg);
+    return NULL;
+}
+
+/*
+ * Give a spare segment its number, making it the newest one on disk.
+ */
+static int nameSegment(segment_t *seg, uint32_t number) {
+    char name[SEGMENT_NAME_MAX];
+    snprintf(name, sizeof(name), SEGMENT_NAME, number);
+    if (renameat(jr.dirfd, SPARE_NAME, jr.dirfd, name) < 0) {
+        log_error("journal segment %s: %m", name);
+        return ERROR;
+    }
+    seg->number = number;
+    return SUCCESS;
+}
+
+/*
+ * Write back what seg holds beyond from, a whole number of pages.
+ */
+static void syncRange(segment_t *seg, size_t from, size_t to) {
+    uint64_t start = metrics_now();
+    from -= from % jr.page;
+    if (msync(seg->map + from, to - from, MS_SYNC) < 0)
+        log_error("journal segment %u: msync: %m", seg->number);
+    metric_add(&syncs, 1);
+    metric_add(&syncNs, metrics_now() - start);
+}
+
+/*
+ * Write back and unmap a segment, cut to its used length.
+ */
+static void closeSegment(segment_t *seg) {
+    if (seg->used > seg->synced)
+        syncRange(seg, seg->synced, seg->used);
+    munmap(seg->map, seg->size);
+    if (ftruncate(seg->fd, (off_t) seg->used) < 0 || fsync(seg->fd) < 0)
+        log_error("journal segment %u: %m", seg->number);
+    close(seg->fd);
+    free(seg);
+}
+
+/*
+ * Remove the segments older than the newest keep.
+ */
+static void trimSegments(uint32_t newest) {
+    while (newest - jr.oldest >= (uint32_t) jr.keep) {
+        char name[SEGMENT_NAME_MAX];
+        snprintf(name, sizeof(name), SEGMENT_NAME, jr.oldest++);
+        if (unlinkat(jr.dirfd, name, 0) < 0 && errno != ENOENT)
+            log_warn("journal segment %s: %m", name);
+    }
+}
+
+/*
+ * Start a new segment big enough for need bytes, the spare if it is. Under lock.
+ */
+static int rotate(size_t need) {
+    segment_t *seg = NULL;
+    uint32_t number = jr.next_number;
+    if (jr.spare != NULL && jr.spare->size >= need && nameSegment(jr.spare, number) == SUCCESS) {
+        seg = jr.spare;
+        jr.spare = NULL;
+    } else {
+        char name[SEGMENT_NAME_MAX];
+        snprintf(name, sizeof(name), SEGMENT_NAME, number);
+        seg = createSegment(name, number, need > jr.segment_bytes ? need : jr.segment_bytes);
+        if (seg == NULL)
+            return ERROR;
+    }
+    jr.next_number++;
+    segment_t **tail = &jr.retired;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = jr.current;
+    jr.current = seg;
+    jr.idle = 0;
+    jr.kicked = 1;
+    pthread_cond_signal(&jr.wake);
+    return SUCCESS;
+}
+
+/*
+ * Does the sync thread have anything to do? Under lock.
+ */
+static int syncDue(void) {
+    return jr.current->used > jr.current->synced || jr.retired != NULL || jr.spare == NULL || jr.stop;
+}
+
+/*
+ * Group commit: sleep until a message arrives, give it sync_ns to be joined
+ * by others (or until sync_bytes are waiting), write them all back at once.
+ * Full segments are closed and a spare one is made in the same pass.
+ */
+static void *syncLoop(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&jr.lock);
+    while (1) {
+        if (!syncDue()) {
+            jr.idle = 1;
+            while (jr.idle && !jr.stop)
+                pthread_cond_wait(&jr.wake, &jr.lock);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t) (jr.sync_ns / 1000000000);
+        deadline.tv_nsec += (long) (jr.sync_ns % 1000000000);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!jr.kicked && !jr.stop && pthread_cond_timedwait(&jr.wake, &jr.lock, &deadline) != ETIMEDOUT);
+        jr.kicked = 0;
+        segment_t *seg = jr.current;
+        size_t from = seg->synced;
+        size_t to = seg->used;
+        segment_t *retired = jr.retired;
+        jr.retired = NULL;
+        int makeSpare = jr.spare == NULL && !jr.stop;
+        int stop = jr.stop;
+        pthread_mutex_unlock(&jr.lock);
+
+        while (retired != NULL) {
+            segment_t *next = retired->next;
+            closeSegment(retired);
+            retired = next;
+        }
+        trimSegments(seg->number);
+        if (to > from)
+            syncRange(seg, from, to);
+        segment_t *spare = makeSpare ? createSegment(SPARE_NAME, 0, jr.segment_bytes) : NULL;
+
+        pthread_mutex_lock(&jr.lock);
+        /* a segment retired meanwhile waits on the list, only this thread frees it */
+        if (to > seg->synced)
+            seg->synced = to;
+        if (makeSpare)
+            jr.spare = spare;
+        if (stop)
+            break;
+        if (makeSpare && spare == NULL) {
+            /* the disk is full or failing, try again in a while instead of spinning */
+            pthread_mutex_unlock(&jr.lock);
+            sleep(1);
+            pthread_mutex_lock(&jr.lock);
+        }
+    }
+    pthread_mutex_unlock(&jr.lock);
+    return NULL;
+}
+
+/*
+ * Read the record at pos of a segment.
+ * @ return value - offset of the next record, 0 at the end of the segment
+ */
+static size_t readRecord(const char *map, size_t size, size_t pos, const char **room, int *roomLen,
+                         const char **data, int *len) {
+    uint32_t header[2];
+    if (size - pos < RECORD_HEADER)
+        return 0;
+    memcpy(header, map + pos, RECORD_HEADER);
+    const char *p = map + pos + RECORD_HEADER;
+    if (header[0] == 0 || header[0] > size - pos - RECORD_HEADER)
+        return 0;
+    *roomLen = (unsigned char) p[0];
+    if ((uint32_t) *roomLen + 1 > header[0] || crc32(0L, (const Bytef *) p, header[0]) != header[1])
+        return 0;
+    *room = p + 1;
+    *data = p + 1 + *roomLen;
+    *len = (int) (header[0] - 1 - (uint32_t) *roomLen);
+    return pos + RECORD_HEADER + header[0];
+}
+
+/*
+ * Map segment number read-only.
+ * @ return value - the mapping, NULL if it is empty or cannot be read
+ */
+static const char *mapSegment(uint32_t number, size_t *size) {
+    char name[SEGMENT_NAME_MAX];
+    snprintf(name, sizeof(name), SEGMENT_NAME, number);
+    int fd = openat(jr.dirfd, name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_warn("journal segment %s: %m", name);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    void *map = *size > 0 ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, *size, MADV_SEQUENTIAL);
+    return map;
+}
+
+static int roomId(const char *room, int roomLen) {
+    return roomLen == 0 ? LOBBY_ROOM : room_lookup(jr.registry, room, roomLen);
+}
+
+/*
+ * Read segments first..last back into the histories of group. The first pass
+ * counts the messages of every room, the second skips those the history
+ * bounds would push out again, so only the tail of each room is copied.
+ */
+static void replay(uint32_t first, uint32_t last, worker_group_t *group) {
+    int max = jr.registry->history_msgs;
+    int *skip = calloc(MAX_ROOMS, sizeof(int));
+    if (skip == NULL)
+        return;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t number = first; number <= last; number++) {
+            size_t size;
+            const char *map = mapSegment(number, &size);
+            if (map == NULL)
+                continue;
+            const char *room, *data;
+            int roomLen, len;
+            for (size_t pos = 0; (pos = readRecord(map, size, pos, &room, &roomLen, &data, &len)) != 0;) {
+                int id = roomId(room, roomLen);
+                if (id < 0)
+                    continue;
+                if (pass == 0) {
+                    skip[id]++;
+                    continue;
+                }
+                if (skip[id]-- > max)
+                    continue;
+                msg_body_t *body = msg_body_create(data, len);
+                if (body == NULL)
+                    break;
+                body->room = id;
+                for (int i = 0; i < group->nr_workers; i++)
+                    restore_history(body, group->workers[i].pool);
+                msg_body_unref(body);
+                metric_add(&replayed, 1);
+            }
+            munmap((void *) map, size);
+        }
+    }
+    free(skip);
+}
+
+static int compareNumbers(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Find the segments on disk: jr.oldest and jr.next_number bound them.
+ * @ return value - how many there are, -1 if the directory cannot be read
+ */
+static int scanSegments(void) {
+    int fd = dup(jr.dirfd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return ERROR;
+    }
+    uint32_t *numbers = NULL;
+    int nr = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long number = strtoul(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".journal") != 0 || number == 0 || number >= UINT32_MAX)
+            continue;
+        if (nr == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(numbers, cap * sizeof(uint32_t));
+            if (grown == NULL)
+                break;
+            numbers = grown;
+        }
+        numbers[nr++] = (uint32_t) number;
+    }
+    closedir(dir);
+    qsort(numbers, nr, sizeof(uint32_t), compareNumbers);
+    jr.oldest = nr > 0 ? numbers[0] : 1;
+    jr.next_number = nr > 0 ? numbers[nr - 1] + 1 : 1;
+    free(numbers);
+    return nr;
+}
+
+int journal_open(const journal_config_t *config, worker_group_t *group) {
+    jr.registry = group->workers[0].pool->registry;
+    jr.sync_ns = (uint64_t) config->sync_ms * 1000000;
+    jr.sync_bytes = config->sync_bytes;
+    jr.segment_bytes = config->segment_bytes;
+    jr.keep = config->keep;
+    jr.page = (size_t) sysconf(_SC_PAGESIZE);
+    if (mkdir(config->dir, 0755) < 0 && errno != EEXIST) {
+        log_error("journal directory %s: %m", config->dir);
+        return ERROR;
+    }
+    int nr;
+    if ((jr.dirfd = open(config->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || (nr = scanSegments()) < 0) {
+        log_error("journal directory %s: %m", config->dir);
+        return ERROR;
+    }
+    /* a spare left by the last run was never written to */
+    unlinkat(jr.dirfd, SPARE_NAME, 0);
+    if (nr > 0 && jr.registry->history_msgs > 0)
+        replay(jr.oldest, jr.next_number - 1, group);
+    char name[SEGMENT_NAME_MAX];
+    snprintf(name, sizeof(name), SEGMENT_NAME, jr.next_number);
+    if ((jr.current = createSegment(name, jr.next_number, jr.segment_bytes)) == NULL)
+        return ERROR;
+    jr.next_number++;
+    /* the new segment's name must survive a crash too */
+    fsync(jr.dirfd);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&jr.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&jr.thread, NULL, syncLoop, NULL) != 0)
+        return ERROR;
+    atomic_store(&journalOpen, 1);
+    log_info("Journal in %s, %d segment(s) found, %llu message(s) replayed", config->dir, nr,
+             (unsigned long long) metric_get(&replayed));
+    return SUCCESS;
+}
+
+void journal_close(void) {
+    if (!atomic_load(&journalOpen))
+        return;
+    atomic_store(&journalOpen, 0);
+    pthread_mutex_lock(&jr.lock);
+    jr.stop = 1;
+    pthread_cond_signal(&jr.wake);
+    pthread_mutex_unlock(&jr.lock);
+    pthread_join(jr.thread, NULL);
+    if (jr.current->used == 0) {
+        /* nothing was said this run */
+        char name[SEGMENT_NAME_MAX];
+        snprintf(name, sizeof(name), SEGMENT_NAME, jr.current->number);
+        unlinkat(jr.dirfd, name, 0);
+    }
+    closeSegment(jr.current);
+    jr.current = NULL;
+    if (jr.spare != NULL) {
+        munmap(jr.spare->map, jr.spare->size);
+        close(jr.spare->fd);
+        unlinkat(jr.dirfd, SPARE_NAME, 0);
+        free(jr.spare);
+        jr.spare = NULL;
+    }
+    fsync(jr.dirfd);
+    close(jr.dirfd);
+    pthread_cond_destroy(&jr.wake);
+}
+
+void journal_append(const msg_body_t *body) {
+    if (!atomic_load_explicit(&journalOpen, memory_order_relaxed))
+        return;
+    const char *room = room_info(jr.registry, body->room)->name;
+    unsigned char roomLen = (unsigned char) strlen(room);
+    uint32_t header[2];
+    header[0] = 1 + (uint32_t) roomLen + (uint32_t) body->size;
+    /* the checksum is taken outside the lock */
+    uLong crc = crc32(0L, &roomLen, 1);
+    crc = crc32(crc, (const Bytef *) room, roomLen);
+    header[1] = (uint32_t) crc32(crc, (const Bytef *) body->data, (uInt) body->size);
+    size_t need = RECORD_HEADER + header[0];
+
+    pthread_mutex_lock(&jr.lock);
+    if (jr.current->used + need > jr.current->size && rotate(need) < 0) {
+        metric_add(&failures, 1);
+        pthread_mutex_unlock(&jr.lock);
+        return;
+    }
+    segment_t *seg = jr.current;
+    char *p = seg->map + seg->used;
+    /* the header goes first: until the rest is there too, its checksum does not match */
+    memcpy(p, header, RECORD_HEADER);
+    p[RECORD_HEADER] = (char) roomLen;
+    memcpy(p + RECORD_HEADER + 1, room, roomLen);
+    memcpy(p + RECORD_HEADER + 1 + roomLen, body->data, body->size);
+    seg->used += need;
+    metric_add(&records, 1);
+    metric_add(&recordBytes, need);
+    if (jr.idle) {
+        /* the first message of a group starts the sync window */
+        jr.idle = 0;
+        pthread_cond_signal(&jr.wake);
+    } else if (!jr.kicked && seg->used - seg->synced >= jr.sync_bytes) {
+        jr.kicked = 1;
+        pthread_cond_signal(&jr.wake);
+    }
+    pthread_mutex_unlock(&jr.lock);
+}
+
+void journal_write_metrics(FILE *out) {
+    if (jr.registry == NULL)
+        return;
+    fprintf(out, "# HELP chat_journal_records_total Messages appended to the journal.\n"
+                 "# TYPE chat_journal_records_total counter\nchat_journal_records_total %llu\n",
+            (unsigned long long) metric_get(&records));
+    fprintf(out, "# HELP chat_journal_bytes_total Bytes appended to the journal, record headers included.\n"
+                 "# TYPE chat_journal_bytes_total counter\nchat_journal_bytes_total %llu\n",
+            (unsigned long long) metric_get(&recordBytes));
+    fprintf(out, "# HELP chat_journal_failures_total Messages the journal could not take.\n"
+                 "# TYPE chat_journal_failures_total counter\nchat_journal_failures_total %llu\n",
+            (unsigned long long) metric_get(&failures));
+    fprintf(out, "# HELP chat_journal_syncs_total Group commits, one msync each.\n"
+                 "# TYPE chat_journal_syncs_total counter\nchat_journal_syncs_total %llu\n",
+            (unsigned long long) metric_get(&syncs));
+    fprintf(out, "# HELP chat_journal_sync_seconds_total Time spent in group commits.\n"
+                 "# TYPE chat_journal_sync_seconds_total counter\nchat_journal_sync_seconds_total %.6f\n",
+            (double) metric_get(&syncNs) / 1e9);
+    fprintf(out, "# HELP chat_journal_replayed_total Messages read back into the room histories at startup.\n"
+                 "# TYPE chat_journal_replayed_total counter\nchat_journal_replayed_total %llu\n",
+            (unsigned long long) metric_get(&replayed));
+}
@@ -0,0 +1,74 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Append-only journal of every message the server fans out.
+ *
+ * The journal is a directory of numbered segment files. Each is allocated
+ * at its full size up front and mapped shared: appending a message is a
+ * memcpy under a lock, no system call. A sync thread writes the mapping
+ * back (msync) every sync_ms, or sooner once sync_bytes are waiting, so
+ * one flush makes a whole group of messages durable. A crash of the process
+ * loses nothing, the page cache has every message; a crash of the machine
+ * loses at most one sync window.
+ *
+ * A segment that fills up is cut to its used length and a new one started,
+ * only the newest keep segments are kept. Every run starts a segment of its
+ * own, after reading the ones there back into the room histories.
+ */
+
+/* Defaults of the journal options. */
+#define JOURNAL_SYNC_MS 20
+#define JOURNAL_SYNC_BYTES (1024 * 1024)
+#define JOURNAL_SEGMENT_BYTES (64 * 1024 * 1024)
+#define JOURNAL_KEEP 8
+
+struct msg_body;
+struct worker_group;
+
+/*
+ * Journal options of the server.
+ */
+typedef struct journal_config {
+    /* Directory of the segments, NULL with the journal off. */
+    const char *dir;
+    /* Longest a message waits before it is synced, and the bytes that trigger a sync sooner. */
+    int sync_ms;
+    size_t sync_bytes;
+    /* Size of a segment, a bigger message gets a segment its size. */
+    size_t segment_bytes;
+    /* Segments kept, the current one included. */
+    int keep;
+} journal_config_t;
+
+/*
+ * Replay the segments in config->dir into the room histories of the workers
+ * of group (if they keep any), then start a new segment and the sync
+ * thread. Called before the workers run.
+ * @ return value - 0 on success, -1 on failure (logged)
+ */
+int journal_open(const journal_config_t *config, struct worker_group *group);
+
+/*
+ * Sync what is left, stop the sync thread and cut the current segment to
+ * its used length. Does nothing if the journal was not opened. The workers
+ * must have stopped already.
+ */
+void journal_close(void);
+
+/*
+ * Append body to the journal, from any worker. Does nothing with the
+ * journal off.
+ */
+void journal_append(const struct msg_body *body);
+
+/*
+ * Write the journal counters in Prometheus text exposition format.
+ */
+void journal_write_metrics(FILE *out);
+
+#endif
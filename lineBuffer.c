@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "lineBuffer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define MASK (LINE_BUFFER_SIZE - 1)
+
+static const char *findNewlineScalar(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == '\n')
+            return p + i;
+    }
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static const char *findNewlineSse2(const char *p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        if (mask != 0)
+            return p + i + __builtin_ctz(mask);
+    }
+    return findNewlineScalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *findNewlineAvx2(const char *p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (p + i));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+        if (mask != 0)
+            return p + i + __builtin_ctz(mask);
+    }
+    return findNewlineSse2(p + i, len - i);
+}
+
+#endif
+
+static const char *(*findNewlineImpl)(const char *, size_t) = findNewlineScalar;
+
+/* Pick the widest implementation the CPU supports, once at startup. */
+__attribute__((constructor))
+static void selectFindNewline(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        findNewlineImpl = findNewlineAvx2;
+    else if (__builtin_cpu_supports("sse2"))
+        findNewlineImpl = findNewlineSse2;
+#endif
+}
+
+const char *find_newline(const char *p, size_t len) {
+    return findNewlineImpl(p, len);
+}
+
+void line_buffer_init(line_buffer_t *lb) {
+    lb->data = NULL;
+    lb->head = 0;
+    lb->scanned = 0;
+    lb->tail = 0;
+}
+
+void line_buffer_free(line_buffer_t *lb) {
+    free(lb->data);
+    line_buffer_init(lb);
+}
+
+ssize_t line_buffer_read(line_buffer_t *lb, int fd) {
+    if (lb->data == NULL) {
+        lb->data = malloc(LINE_BUFFER_SIZE);
+        if (lb->data == NULL)
+            return -1;
+    }
+    unsigned int used = lb->tail - lb->head;
+    if (used == LINE_BUFFER_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    /* the free space is at most two pieces: up to the end, then from the start */
+    unsigned int start = lb->tail & MASK;
+    unsigned int space = LINE_BUFFER_SIZE - used;
+    struct iovec iov[2];
+    int count = 1;
+    iov[0].iov_base = lb->data + start;
+    iov[0].iov_len = space;
+    if (start + space > LINE_BUFFER_SIZE) {
+        iov[0].iov_len = LINE_BUFFER_SIZE - start;
+        iov[1].iov_base = lb->data;
+        iov[1].iov_len = space - iov[0].iov_len;
+        count = 2;
+    }
+    ssize_t length = readv(fd, iov, count);
+    if (length > 0)
+        lb->tail += (unsigned int) length;
+    return length;
+}
+
+int line_buffer_space(line_buffer_t *lb, char **space) {
+    if (lb->data == NULL) {
+        lb->data = malloc(LINE_BUFFER_SIZE);
+        if (lb->data == NULL)
+            return -1;
+    }
+    unsigned int room = LINE_BUFFER_SIZE - (lb->tail - lb->head);
+    unsigned int start = lb->tail & MASK;
+    *space = lb->data + start;
+    return (int) (LINE_BUFFER_SIZE - start < room ? LINE_BUFFER_SIZE - start : room);
+}
+
+void line_buffer_commit(line_buffer_t *lb, int len) {
+    lb->tail += (unsigned int) len;
+}
+
+int line_buffer_append(line_buffer_t *lb, const char *data, int len) {
+    if (lb->data == NULL) {
+        lb->data = malloc(LINE_BUFFER_SIZE);
+        if (lb->data == NULL)
+            return -1;
+    }
+    unsigned int space = LINE_BUFFER_SIZE - (lb->tail - lb->head);
+    unsigned int count = (unsigned int) len < space ? (unsigned int) len : space;
+    unsigned int start = lb->tail & MASK;
+    unsigned int first = LINE_BUFFER_SIZE - start < count ? LINE_BUFFER_SIZE - start : count;
+    memcpy(lb->data + start, data, first);
+    memcpy(lb->data, data + first, count - first);
+    lb->tail += count;
+    return (int) count;
+}
+
+/*
+ * Return a contiguous view of len bytes starting at head, copying into
+ * scratch only when they wrap around the end of the ring.
+ */
+static const char *viewAt(line_buffer_t *lb, unsigned int len, char *scratch) {
+    unsigned int start = lb->head & MASK;
+    if (start + len <= LINE_BUFFER_SIZE)
+        return lb->data + start;
+    unsigned int first = LINE_BUFFER_SIZE - start;
+    memcpy(scratch, lb->data + start, first);
+    memcpy(scratch + first, lb->data, len - first);
+    return scratch;
+}
+
+int line_buffer_next(line_buffer_t *lb, const char **line, char *scratch, int force) {
+    while (lb->scanned != lb->tail) {
+        /* search the unscanned bytes, in at most two contiguous pieces */
+        unsigned int start = lb->scanned & MASK;
+        unsigned int len = lb->tail - lb->scanned;
+        if (start + len > LINE_BUFFER_SIZE)
+            len = LINE_BUFFER_SIZE - start;
+        const char *nl = find_newline(lb->data + start, len);
+        if (nl == NULL) {
+            lb->scanned += len;
+            continue;
+        }
+        lb->scanned += (unsigned int) (nl - (lb->data + start)) + 1;
+        unsigned int lineLen = lb->scanned - lb->head;
+        *line = viewAt(lb, lineLen, scratch);
+        lb->head = lb->scanned;
+        return (int) lineLen;
+    }
+    if (!force || lb->head == lb->tail)
+        return 0;
+    unsigned int lineLen = lb->tail - lb->head;
+    *line = viewAt(lb, lineLen, scratch);
+    lb->head = lb->tail;
+    return (int) lineLen;
+}
+
+/*
+ * Copy len buffered bytes starting at offset pos of the ring to out.
+ */
+static void copyOut(const line_buffer_t *lb, unsigned int pos, char *out, unsigned int len) {
+    unsigned int start = pos & MASK;
+    unsigned int first = LINE_BUFFER_SIZE - start < len ? LINE_BUFFER_SIZE - start : len;
+    memcpy(out, lb->data + start, first);
+    memcpy(out + first, lb->data, len - first);
+}
+
+int line_buffer_peek(const line_buffer_t *lb, char *out, int max) {
+    unsigned int used = lb->tail - lb->head;
+    unsigned int count = (unsigned int) max < used ? (unsigned int) max : used;
+    if (count > 0)
+        copyOut(lb, lb->head, out, count);
+    return (int) count;
+}
+
+int line_buffer_take(line_buffer_t *lb, char *out, int len) {
+    unsigned int used = lb->tail - lb->head;
+    unsigned int count = (unsigned int) len < used ? (unsigned int) len : used;
+    if (out != NULL && count > 0)
+        copyOut(lb, lb->head, out, count);
+    lb->head += count;
+    /* nothing before head is ever searched again */
+    if ((int) (lb->scanned - lb->head) < 0)
+        lb->scanned = lb->head;
+    return (int) count;
+}
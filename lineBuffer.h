@@ -0,0 +1,99 @@
+#ifndef LINE_BUFFER_H
+#define LINE_BUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Capacity of a connection's input ring, must be a power of two. */
+#define LINE_BUFFER_SIZE 4096
+
+/*
+ * Per-connection input ring that splits the byte stream into lines.
+ *
+ * The positions are free-running counters, masked with (LINE_BUFFER_SIZE - 1)
+ * when indexing data. Bytes in [head, scanned) are known not to contain a
+ * newline, bytes in [scanned, tail) have not been looked at yet. The storage
+ * is allocated on the first read, so idle connections hold no input memory.
+ */
+typedef struct line_buffer {
+    /* LINE_BUFFER_SIZE bytes of storage, NULL until the first read. */
+    char *data;
+    /* Start of the first incomplete line. */
+    unsigned int head;
+    /* End of the bytes searched for a newline so far. */
+    unsigned int scanned;
+    /* End of the bytes read from the socket. */
+    unsigned int tail;
+} line_buffer_t;
+
+/*
+ * Find the first '\n' in p[0..len). Uses AVX2 or SSE2 when the CPU has them
+ * and a scalar loop otherwise.
+ * @ return value - pointer to the newline, NULL if there is none
+ */
+const char *find_newline(const char *p, size_t len);
+
+/*
+ * Init an empty line buffer, no memory is allocated yet.
+ */
+void line_buffer_init(line_buffer_t *lb);
+
+/*
+ * Free the storage of a line buffer.
+ */
+void line_buffer_free(line_buffer_t *lb);
+
+/*
+ * Read as much as fits from fd into the free space of the ring.
+ * @ return value - as read(): bytes read, 0 on end of file, -1 on error.
+ *   Returns -1 with errno ENOBUFS when the ring is full.
+ */
+ssize_t line_buffer_read(line_buffer_t *lb, int fd);
+
+/*
+ * The first contiguous piece of free space of the ring, for a reader that
+ * cannot scatter (OpenSSL). The bytes put there count once committed.
+ * @ space - set to the start of the piece
+ * @ return value - its length (0 when the ring is full), -1 on failure
+ */
+int line_buffer_space(line_buffer_t *lb, char **space);
+
+/*
+ * Add len bytes written to the space line_buffer_space() returned.
+ */
+void line_buffer_commit(line_buffer_t *lb, int len);
+
+/*
+ * Copy bytes received elsewhere into the free space of the ring.
+ * @ return value - number of bytes copied (0 when the ring is full), -1 on failure
+ */
+int line_buffer_append(line_buffer_t *lb, const char *data, int len);
+
+/*
+ * Take the next complete line (including its '\n') out of the ring.
+ *
+ * The returned view points into the ring when the line is contiguous and into
+ * scratch (LINE_BUFFER_SIZE bytes) when it wraps around the end. It stays
+ * valid until the next line_buffer_read().
+ * @ line - set to the start of the line
+ * @ force - if non-zero and there is no complete line, return whatever is
+ *   buffered instead (a full ring or a closing connection)
+ * @ return value - length of the line, 0 if there is none
+ */
+int line_buffer_next(line_buffer_t *lb, const char **line, char *scratch, int force);
+
+/*
+ * Copy up to max bytes from the start of the ring to out, leaving them there.
+ * @ return value - number of bytes copied
+ */
+int line_buffer_peek(const line_buffer_t *lb, char *out, int max);
+
+/*
+ * Move up to len bytes from the start of the ring to out, for input that is
+ * framed by length instead of by newlines.
+ * @ out - where the bytes go, NULL to drop them
+ * @ return value - number of bytes taken
+ */
+int line_buffer_take(line_buffer_t *lb, char *out, int len);
+
+#endif
@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/* Records in the ring, must be a power of two. */
+#define LOG_RING_SIZE 4096
+/* Longest message text kept, longer ones are truncated. */
+#define LOG_TEXT_SIZE 224
+/* How long the logging thread sleeps when the ring is empty. */
+#define LOG_IDLE_NS (2 * 1000 * 1000)
+/* Output buffered per stream before it is written. */
+#define LOG_OUT_SIZE (64 * 1024)
+
+/*
+ * One slot of the ring. seq tells who may use it: it equals the position
+ * of the next record to be written into it while the slot is free, and that
+ * position + 1 once the record is complete.
+ */
+typedef struct log_record {
+    atomic_size_t seq;
+    log_level_t level;
+    int len;
+    struct timespec time;
+    char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+/*
+ * Bounded lock-free multi-producer ring (Vyukov), drained by the logging
+ * thread alone. Producers claim a position with one compare-and-swap.
+ */
+static struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) size_t tail;
+    atomic_ulong dropped;
+    log_record_t records[LOG_RING_SIZE];
+} ring;
+
+log_level_t log_level = LL_INFO;
+
+static const char *levelNames[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static atomic_int running = 0;
+static atomic_int stopping = 0;
+static pthread_t logThread;
+
+/*
+ * Buffered output of the logging thread to one descriptor.
+ */
+typedef struct log_out {
+    int fd;
+    size_t len;
+    char data[LOG_OUT_SIZE];
+} log_out_t;
+
+static log_out_t outs[2] = {{STDOUT_FILENO, 0, {0}}, {STDERR_FILENO, 0, {0}}};
+
+int log_parse_level(const char *name, log_level_t *level) {
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (int i = LL_DEBUG; i <= LL_OFF; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (log_level_t) i;
+            return SUCCESS;
+        }
+    }
+    return ERROR;
+}
+
+static void flushOut(log_out_t *out) {
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(out->fd, out->data + done, out->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t) n;
+    }
+    out->len = 0;
+}
+
+static void appendOut(log_out_t *out, const char *text, size_t len) {
+    if (out->len + len > LOG_OUT_SIZE)
+        flushOut(out);
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+}
+
+/*
+ * Format the prefix (wall clock time and level) of a record.
+ */
+static int formatPrefix(char *buf, size_t size, log_level_t level, const struct timespec *time) {
+    struct tm tm;
+    localtime_r(&time->tv_sec, &tm);
+    return snprintf(buf, size, "%02d:%02d:%02d.%06ld %-5s ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                    time->tv_nsec / 1000, levelNames[level]);
+}
+
+/*
+ * Write out every complete record of the ring.
+ * @ return value - number of records written
+ */
+static int drainRing(void) {
+    char line[64 + LOG_TEXT_SIZE];
+    int count = 0;
+    unsigned long dropped = atomic_exchange_explicit(&ring.dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        int len = snprintf(line, sizeof(line), "%lu log records dropped, the ring was full\n", dropped);
+        appendOut(&outs[1], line, (size_t) len);
+    }
+    while (1) {
+        log_record_t *rec = &ring.records[ring.tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != ring.tail + 1)
+            break;
+        int len = formatPrefix(line, sizeof(line), rec->level, &rec->time);
+        memcpy(line + len, rec->text, rec->len);
+        len += rec->len;
+        line[len++] = '\n';
+        appendOut(&outs[rec->level >= LL_WARN], line, (size_t) len);
+        atomic_store_explicit(&rec->seq, ring.tail + LOG_RING_SIZE, memory_order_release);
+        ring.tail++;
+        count++;
+    }
+    flushOut(&outs[0]);
+    flushOut(&outs[1]);
+    return count;
+}
+
+static void *logLoop(void *arg) {
+    (void) arg;
+    struct timespec idle = {0, LOG_IDLE_NS};
+    while (1) {
+        int stop = atomic_load_explicit(&stopping, memory_order_acquire);
+        if (drainRing() == 0) {
+            if (stop)
+                break;
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    atomic_store_explicit(&ring.head, 0, memory_order_relaxed);
+    ring.tail = 0;
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_store_explicit(&ring.records[i].seq, i, memory_order_relaxed);
+    atomic_store(&stopping, 0);
+    /* what stdio buffered so far has to come first */
+    fflush(stdout);
+    if (pthread_create(&logThread, NULL, logLoop, NULL) != 0)
+        return ERROR;
+    atomic_store(&running, 1);
+    return SUCCESS;
+}
+
+void log_stop(void) {
+    if (!atomic_load(&running))
+        return;
+    atomic_store(&running, 0);
+    atomic_store_explicit(&stopping, 1, memory_order_release);
+    pthread_join(logThread, NULL);
+}
+
+/*
+ * Claim the next free slot of the ring.
+ * @ return value - the slot, NULL if the ring is full
+ */
+static log_record_t *claimRecord(size_t *pos) {
+    size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    while (1) {
+        log_record_t *rec = &ring.records[head & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) head;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring.head, &head, head + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos = head;
+                return rec;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        }
+    }
+}
+
+void log_write(log_level_t level, const char *fmt, ...) {
+    va_list ap;
+    if (level < LL_DEBUG || level >= LL_OFF)
+        return;
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        /* no logging thread (yet or any more): write it out right away */
+        char prefix[64];
+        struct timespec now;
+        FILE *out = level >= LL_WARN ? stderr : stdout;
+        clock_gettime(CLOCK_REALTIME, &now);
+        formatPrefix(prefix, sizeof(prefix), level, &now);
+        fputs(prefix, out);
+        va_start(ap, fmt);
+        vfprintf(out, fmt, ap);
+        va_end(ap);
+        fputc('\n', out);
+        return;
+    }
+    size_t pos;
+    log_record_t *rec = claimRecord(&pos);
+    if (rec == NULL) {
+        atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    rec->level = level;
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    va_start(ap, fmt);
+    int len = vsnprintf(rec->text, LOG_TEXT_SIZE, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    rec->len = len < LOG_TEXT_SIZE ? len : LOG_TEXT_SIZE - 1;
+    atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+}
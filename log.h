@@ -0,0 +1,67 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Severity of a log record.
+ */
+typedef enum log_level {
+    LL_DEBUG,
+    LL_INFO,
+    LL_WARN,
+    LL_ERROR,
+    /* Only as a threshold: log nothing. */
+    LL_OFF
+} log_level_t;
+
+/*
+ * Least severe level compiled in. Calls below it are removed by the compiler
+ * together with the evaluation of their arguments.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LL_DEBUG
+#endif
+
+/* Least severe level written, set before the logger is started. */
+extern log_level_t log_level;
+
+/*
+ * Log a printf-style record at level. A record below log_level costs one
+ * branch, nothing is formatted.
+ */
+#define log_at(level, ...)                                      \
+    do {                                                        \
+        if ((level) >= LOG_MIN_LEVEL && (level) >= log_level)   \
+            log_write((level), __VA_ARGS__);                    \
+    } while (0)
+
+#define log_debug(...) log_at(LL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LL_ERROR, __VA_ARGS__)
+
+/*
+ * Parse a level name ("debug", "info", "warn", "error", "off").
+ * @ return value - 0 on success, -1 if name is not a level
+ */
+int log_parse_level(const char *name, log_level_t *level);
+
+/*
+ * Start the thread writing out the records. Before log_start() and after
+ * log_stop() records are written synchronously through stdio.
+ * @ return value - 0 on success, -1 on failure
+ */
+int log_start(void);
+
+/*
+ * Write out the records still buffered and stop the logging thread.
+ */
+void log_stop(void);
+
+/*
+ * Format a record into the log ring, callable from any thread. Never blocks:
+ * when the ring is full the record is dropped and counted. Debug and info
+ * records go to stdout, warnings and errors to stderr.
+ */
+void log_write(log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
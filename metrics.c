@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+#include "federation.h"
+#include "journal.h"
+#include "metrics.h"
+#include "worker.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/* How often the admin thread looks at the stop flag, in milliseconds. */
+#define ADMIN_POLL_MS 200
+
+/* Upper bounds (seconds) of the exported histogram buckets, a 1-2.5-5 series. */
+static const double bucketBounds[] = {
+        1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+        1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static pthread_t adminThread;
+static int adminSD = -1;
+static atomic_int adminStop = 0;
+
+void metrics_init(worker_metrics_t *m) {
+    atomic_init(&m->accepted, 0);
+    atomic_init(&m->closed, 0);
+    atomic_init(&m->connections, 0);
+    atomic_init(&m->msgs_in, 0);
+    atomic_init(&m->bytes_in, 0);
+    atomic_init(&m->msgs_out, 0);
+    atomic_init(&m->bytes_out, 0);
+    atomic_init(&m->writes, 0);
+    atomic_init(&m->queued_msgs, 0);
+    atomic_init(&m->queued_bytes, 0);
+    atomic_init(&m->idle_timeouts, 0);
+    atomic_init(&m->write_timeouts, 0);
+    atomic_init(&m->pings, 0);
+    atomic_init(&m->throttles, 0);
+    atomic_init(&m->throttled_ns, 0);
+    atomic_init(&m->throttled, 0);
+    atomic_init(&m->history_replayed, 0);
+    atomic_init(&m->compressed, 0);
+    atomic_init(&m->compress_ns, 0);
+    atomic_init(&m->compress_in, 0);
+    atomic_init(&m->compress_out, 0);
+    atomic_init(&m->compress_saved, 0);
+    atomic_init(&m->tls_handshakes, 0);
+    atomic_init(&m->tls_failures, 0);
+    atomic_init(&m->ktls_send, 0);
+    atomic_init(&m->ktls_recv, 0);
+    atomic_init(&m->ws_upgrades, 0);
+    atomic_init(&m->ws_rejected, 0);
+    atomic_init(&m->ws_frames, 0);
+    atomic_init(&m->loop_iterations, 0);
+    shared_hist_init(&m->loop_time);
+    shared_hist_init(&m->queue_time);
+}
+
+/*
+ * One worker_metrics_t field exported as a metric family with a worker label.
+ */
+static void writeFamily(FILE *out, worker_group_t *group, const char *name, const char *type,
+                        const char *help, size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < group->nr_workers; i++) {
+        metric_t *m = (metric_t *) ((char *) &group->workers[i].pool->metrics + offset);
+        fprintf(out, "%s{worker=\"%d\"} %llu\n", name, i, (unsigned long long) metric_get(m));
+    }
+}
+
+/*
+ * A nanosecond histogram exported as a Prometheus histogram in seconds.
+ */
+static void writeHistogram(FILE *out, worker_group_t *group, const char *name, const char *help, size_t offset) {
+    static histogram_t snapshot;
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < group->nr_workers; i++) {
+        shared_histogram_t *h = (shared_histogram_t *) ((char *) &group->workers[i].pool->metrics + offset);
+        shared_hist_snapshot(h, &snapshot);
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for (size_t b = 0; b < sizeof(bucketBounds) / sizeof(bucketBounds[0]); b++) {
+            uint64_t bound = (uint64_t) (bucketBounds[b] * 1e9);
+            for (; bucket < HIST_BUCKETS && hist_bucket_value(bucket) <= bound; bucket++)
+                cumulative += snapshot.counts[bucket];
+            fprintf(out, "%s_bucket{worker=\"%d\",le=\"%g\"} %llu\n", name, i, bucketBounds[b],
+                    (unsigned long long) cumulative);
+        }
+        fprintf(out, "%s_bucket{worker=\"%d\",le=\"+Inf\"} %llu\n", name, i, (unsigned long long) snapshot.total);
+        fprintf(out, "%s_sum{worker=\"%d\"} %.9f\n", name, i, (double) snapshot.sum / 1e9);
+        fprintf(out, "%s_count{worker=\"%d\"} %llu\n", name, i, (unsigned long long) snapshot.total);
+    }
+}
+
+void metrics_write_prometheus(FILE *out, worker_group_t *group) {
+    writeFamily(out, group, "chat_connections", "gauge", "Client connections open.",
+                offsetof(worker_metrics_t, connections));
+    writeFamily(out, group, "chat_accepted_total", "counter", "Client connections accepted.",
+                offsetof(worker_metrics_t, accepted));
+    writeFamily(out, group, "chat_closed_total", "counter", "Client connections closed.",
+                offsetof(worker_metrics_t, closed));
+    writeFamily(out, group, "chat_messages_in_total", "counter", "Lines read from clients.",
+                offsetof(worker_metrics_t, msgs_in));
+    writeFamily(out, group, "chat_bytes_in_total", "counter", "Bytes of the lines read from clients.",
+                offsetof(worker_metrics_t, bytes_in));
+    writeFamily(out, group, "chat_messages_out_total", "counter", "Messages written out to clients.",
+                offsetof(worker_metrics_t, msgs_out));
+    writeFamily(out, group, "chat_bytes_out_total", "counter", "Bytes written to clients.",
+                offsetof(worker_metrics_t, bytes_out));
+    writeFamily(out, group, "chat_writes_total", "counter", "Writes to clients, each carrying one or more messages.",
+                offsetof(worker_metrics_t, writes));
+    writeFamily(out, group, "chat_queued_messages", "gauge", "Messages waiting in outbound queues.",
+                offsetof(worker_metrics_t, queued_msgs));
+    writeFamily(out, group, "chat_queued_bytes", "gauge", "Bytes waiting in outbound queues.",
+                offsetof(worker_metrics_t, queued_bytes));
+    writeFamily(out, group, "chat_idle_timeouts_total", "counter", "Connections closed for being idle.",
+                offsetof(worker_metrics_t, idle_timeouts));
+    writeFamily(out, group, "chat_write_timeouts_total", "counter",
+                "Connections closed because their queue was not written to in time.",
+                offsetof(worker_metrics_t, write_timeouts));
+    writeFamily(out, group, "chat_pings_total", "counter", "Pings sent to idle connections.",
+                offsetof(worker_metrics_t, pings));
+    writeFamily(out, group, "chat_throttled_total", "counter",
+                "Times a connection went over its ingest rate and was no longer read from.",
+                offsetof(worker_metrics_t, throttles));
+    fprintf(out, "# HELP chat_throttled_seconds_total Time connections were not read from for their ingest rate.\n"
+                 "# TYPE chat_throttled_seconds_total counter\n");
+    for (int i = 0; i < group->nr_workers; i++)
+        fprintf(out, "chat_throttled_seconds_total{worker=\"%d\"} %.9f\n", i,
+                metric_get(&group->workers[i].pool->metrics.throttled_ns) / 1e9);
+    writeFamily(out, group, "chat_throttled_connections", "gauge",
+                "Connections not read from for being over their ingest rate.", offsetof(worker_metrics_t, throttled));
+    writeFamily(out, group, "chat_history_replayed_total", "counter",
+                "Messages sent from room histories to joining connections.",
+                offsetof(worker_metrics_t, history_replayed));
+    writeFamily(out, group, "chat_loop_iterations_total", "counter", "Event loop iterations.",
+                offsetof(worker_metrics_t, loop_iterations));
+    writeFamily(out, group, "chat_compressed_messages_total", "counter", "Messages compressed at ingest.",
+                offsetof(worker_metrics_t, compressed));
+    fprintf(out, "# HELP chat_compress_seconds_total Time spent compressing messages.\n"
+                 "# TYPE chat_compress_seconds_total counter\n");
+    for (int i = 0; i < group->nr_workers; i++)
+        fprintf(out, "chat_compress_seconds_total{worker=\"%d\"} %.9f\n", i,
+                metric_get(&group->workers[i].pool->metrics.compress_ns) / 1e9);
+    writeFamily(out, group, "chat_compress_in_bytes_total", "counter",
+                "Bytes of the messages given to the compressor.", offsetof(worker_metrics_t, compress_in));
+    writeFamily(out, group, "chat_compress_out_bytes_total", "counter",
+                "Bytes of the compressed copies kept.", offsetof(worker_metrics_t, compress_out));
+    writeFamily(out, group, "chat_compress_saved_bytes_total", "counter",
+                "Bytes not written to clients thanks to compressed copies.",
+                offsetof(worker_metrics_t, compress_saved));
+    writeFamily(out, group, "chat_tls_handshakes_total", "counter", "TLS handshakes completed.",
+                offsetof(worker_metrics_t, tls_handshakes));
+    writeFamily(out, group, "chat_tls_handshake_failures_total", "counter", "TLS handshakes that failed.",
+                offsetof(worker_metrics_t, tls_failures));
+    writeFamily(out, group, "chat_ktls_send_total", "counter",
+                "TLS connections whose records the kernel encrypts.", offsetof(worker_metrics_t, ktls_send));
+    writeFamily(out, group, "chat_ktls_recv_total", "counter",
+                "TLS connections whose records the kernel decrypts.", offsetof(worker_metrics_t, ktls_recv));
+    writeFamily(out, group, "chat_ws_upgrades_total", "counter", "WebSocket upgrades completed.",
+                offsetof(worker_metrics_t, ws_upgrades));
+    writeFamily(out, group, "chat_ws_rejected_total", "counter", "WebSocket upgrade requests refused.",
+                offsetof(worker_metrics_t, ws_rejected));
+    writeFamily(out, group, "chat_ws_frames_built_total", "counter",
+                "WebSocket frames built at ingest, shared by all WebSocket recipients.",
+                offsetof(worker_metrics_t, ws_frames));
+
+    static const char *policies[] = {"disconnect", "drop_oldest", "drop_newest", "pause"};
+    fprintf(out, "# HELP chat_slow_consumer_total Times a slow consumer policy fired.\n"
+                 "# TYPE chat_slow_consumer_total counter\n");
+    for (int i = 0; i < group->nr_workers; i++) {
+        queue_stats_t *stats = &group->workers[i].pool->queue_stats;
+        unsigned long counts[] = {atomic_load(&stats->disconnects), atomic_load(&stats->dropped_oldest),
+                                  atomic_load(&stats->dropped_newest), atomic_load(&stats->pauses)};
+        for (int p = 0; p < 4; p++)
+            fprintf(out, "chat_slow_consumer_total{worker=\"%d\",action=\"%s\"} %lu\n", i, policies[p], counts[p]);
+    }
+    queue_limits_t *limits = group->workers[0].pool->limits;
+    fprintf(out, "# HELP chat_queue_budget_used_bytes Bytes counted against the global queue budget.\n"
+                 "# TYPE chat_queue_budget_used_bytes gauge\n"
+                 "chat_queue_budget_used_bytes %zu\n",
+            atomic_load_explicit(&limits->queued_bytes, memory_order_relaxed));
+
+    writeHistogram(out, group, "chat_loop_duration_seconds", "Time an event loop iteration spent outside the wait.",
+                   offsetof(worker_metrics_t, loop_time));
+    writeHistogram(out, group, "chat_queue_time_seconds", "Time from reading a line to writing it to a recipient.",
+                   offsetof(worker_metrics_t, queue_time));
+    federation_write_metrics(out);
+    journal_write_metrics(out);
+}
+
+static void writeAll(int sd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(sd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        data += n;
+        len -= (size_t) n;
+    }
+}
+
+/*
+ * Answer one HTTP request on a blocking socket and close it.
+ */
+static void serveRequest(int sd, worker_group_t *group) {
+    char request[1024];
+    struct timeval timeout = {1, 0};
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ssize_t n = read(sd, request, sizeof(request) - 1);
+    if (n <= 0) {
+        close(sd);
+        return;
+    }
+    request[n] = '\0';
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        static const char notFound[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        writeAll(sd, notFound, sizeof(notFound) - 1);
+        close(sd);
+        return;
+    }
+    char *body = NULL;
+    size_t bodyLen = 0;
+    FILE *out = open_memstream(&body, &bodyLen);
+    if (out == NULL) {
+        close(sd);
+        return;
+    }
+    metrics_write_prometheus(out, group);
+    fclose(out);
+    char header[160];
+    int headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodyLen);
+    writeAll(sd, header, (size_t) headerLen);
+    writeAll(sd, body, bodyLen);
+    free(body);
+    close(sd);
+}
+
+static void *adminLoop(void *arg) {
+    worker_group_t *group = arg;
+    struct pollfd pfd = {adminSD, POLLIN, 0};
+    while (!atomic_load(&adminStop)) {
+        if (poll(&pfd, 1, ADMIN_POLL_MS) <= 0)
+            continue;
+        int sd = accept(adminSD, NULL, NULL);
+        if (sd >= 0)
+            serveRequest(sd, group);
+    }
+    return NULL;
+}
+
+int start_admin_listener(const char *addr, int port, worker_group_t *group) {
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        errno = EINVAL;
+        return ERROR;
+    }
+    adminSD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (adminSD < 0)
+        return ERROR;
+    int on = 1;
+    setsockopt(adminSD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(adminSD, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(adminSD, 16) < 0
+        || pthread_create(&adminThread, NULL, adminLoop, group) != 0) {
+        close(adminSD);
+        adminSD = -1;
+        return ERROR;
+    }
+    log_info("Serving metrics on %s:%d", addr, port);
+    return SUCCESS;
+}
+
+void stop_admin_listener(void) {
+    if (adminSD < 0)
+        return;
+    atomic_store(&adminStop, 1);
+    pthread_join(adminThread, NULL);
+    close(adminSD);
+    adminSD = -1;
+}
@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "histogram.h"
+
+/*
+ * Counter or gauge with a single writer. Updates are a relaxed load and
+ * store, readers on other threads see a recent value.
+ */
+typedef _Atomic uint64_t metric_t;
+
+/*
+ * Counters and histograms of one worker, updated only by that worker and
+ * read by the admin listener.
+ */
+typedef struct worker_metrics {
+    /* Connections accepted and closed, and currently open. */
+    metric_t accepted;
+    metric_t closed;
+    metric_t connections;
+    /* Lines read from clients and their bytes. */
+    metric_t msgs_in;
+    metric_t bytes_in;
+    /* Messages written out completely to clients and the bytes written. */
+    metric_t msgs_out;
+    metric_t bytes_out;
+    /* Writes to clients: writev() calls, or writes submitted to a completion backend. */
+    metric_t writes;
+    /* Messages and bytes waiting in the queues of this worker's connections. */
+    metric_t queued_msgs;
+    metric_t queued_bytes;
+    /* Connections closed for being idle or for not taking their queue, and pings sent. */
+    metric_t idle_timeouts;
+    metric_t write_timeouts;
+    metric_t pings;
+    /*
+     * Times a connection went over its ingest rate and was no longer read
+     * from, the time connections spent so (ns), and those held back now.
+     */
+    metric_t throttles;
+    metric_t throttled_ns;
+    metric_t throttled;
+    /* Messages queued from room histories to joining connections. */
+    metric_t history_replayed;
+    /*
+     * Messages compressed at ingest, the time spent compressing (ns), the
+     * bytes that went in and came out, and the bytes compressed copies saved
+     * on the wire.
+     */
+    metric_t compressed;
+    metric_t compress_ns;
+    metric_t compress_in;
+    metric_t compress_out;
+    metric_t compress_saved;
+    /*
+     * TLS handshakes done and failed, and the connections whose encryption
+     * and decryption the kernel took over (kTLS).
+     */
+    metric_t tls_handshakes;
+    metric_t tls_failures;
+    metric_t ktls_send;
+    metric_t ktls_recv;
+    /*
+     * WebSocket upgrades done and refused, and the WebSocket frames built at
+     * ingest (one per message, whatever the number of WebSocket recipients).
+     */
+    metric_t ws_upgrades;
+    metric_t ws_rejected;
+    metric_t ws_frames;
+    /* Event loop iterations, and the time each spent outside the wait (ns). */
+    metric_t loop_iterations;
+    shared_histogram_t loop_time;
+    /* Time from reading a line to having written it to a recipient (ns). */
+    shared_histogram_t queue_time;
+} worker_metrics_t;
+
+static inline void metric_add(metric_t *m, uint64_t n) {
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metric_sub(metric_t *m, uint64_t n) {
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) - n, memory_order_relaxed);
+}
+
+static inline uint64_t metric_get(const metric_t *m) {
+    return atomic_load_explicit(m, memory_order_relaxed);
+}
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, a vDSO call.
+ */
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Zero the metrics of a worker before it starts.
+ */
+void metrics_init(worker_metrics_t *m);
+
+struct worker_group;
+
+/*
+ * Write the metrics of all workers in Prometheus text exposition format.
+ */
+void metrics_write_prometheus(FILE *out, struct worker_group *group);
+
+/*
+ * Serve GET /metrics over HTTP on port from a thread of its own.
+ * @ addr - IPv4 address to bind, the metrics tell a lot about the traffic
+ * @ return value - 0 on success, -1 on failure
+ */
+int start_admin_listener(const char *addr, int port, struct worker_group *group);
+
+/*
+ * Stop the admin listener thread, if it was started.
+ */
+void stop_admin_listener(void);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "room.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+static uint32_t hashName(const char *name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * Slot of name in the index: the slot holding its id, or the empty one
+ * where it belongs.
+ */
+static int findSlot(room_registry_t *reg, int *index, int cap, const char *name, int len) {
+    int slot = (int) (hashName(name, len) & (uint32_t) (cap - 1));
+    while (index[slot] >= 0) {
+        const char *other = room_info(reg, index[slot])->name;
+        if ((int) strlen(other) == len && memcmp(other, name, len) == 0)
+            break;
+        slot = (slot + 1) & (cap - 1);
+    }
+    return slot;
+}
+
+/*
+ * Double the index, keeping it at most half full.
+ */
+static int growIndex(room_registry_t *reg) {
+    int cap = reg->index_cap ? reg->index_cap * 2 : 256;
+    int *index = malloc(cap * sizeof(int));
+    if (index == NULL)
+        return ERROR;
+    memset(index, 0xff, cap * sizeof(int));
+    int nrRooms = atomic_load_explicit(&reg->nr_rooms, memory_order_relaxed);
+    for (int id = 0; id < nrRooms; id++) {
+        const char *name = room_info(reg, id)->name;
+        index[findSlot(reg, index, cap, name, (int) strlen(name))] = id;
+    }
+    free(reg->index);
+    reg->index = index;
+    reg->index_cap = cap;
+    return SUCCESS;
+}
+
+/*
+ * Create a room with the next id, the lock must be held.
+ * @ return value - the id, -1 on failure
+ */
+static int createRoom(room_registry_t *reg, const char *name, int len) {
+    int id = atomic_load_explicit(&reg->nr_rooms, memory_order_relaxed);
+    if (id == MAX_ROOMS)
+        return ERROR;
+    if ((id + 1) * 2 > reg->index_cap && growIndex(reg) < 0)
+        return ERROR;
+    room_info_t *chunk = atomic_load_explicit(&reg->chunks[id / ROOM_CHUNK], memory_order_relaxed);
+    if (chunk == NULL) {
+        chunk = calloc(ROOM_CHUNK, sizeof(room_info_t));
+        atomic_int *presence = calloc((size_t) ROOM_CHUNK * reg->nr_workers, sizeof(atomic_int));
+        if (chunk == NULL || presence == NULL) {
+            free(chunk);
+            free(presence);
+            return ERROR;
+        }
+        for (int i = 0; i < ROOM_CHUNK; i++)
+            chunk[i].presence = presence + (size_t) i * reg->nr_workers;
+        atomic_store_explicit(&reg->chunks[id / ROOM_CHUNK], chunk, memory_order_release);
+    }
+    room_info_t *room = &chunk[id % ROOM_CHUNK];
+    memcpy(room->name, name, len);
+    room->name[len] = '\0';
+    reg->index[findSlot(reg, reg->index, reg->index_cap, name, len)] = id;
+    atomic_store_explicit(&reg->nr_rooms, id + 1, memory_order_release);
+    return id;
+}
+
+int room_registry_init(room_registry_t *reg, int nr_workers, int history_msgs, size_t history_bytes) {
+    memset(reg->chunks, 0, sizeof(reg->chunks));
+    pthread_mutex_init(&reg->lock, NULL);
+    reg->nr_workers = nr_workers;
+    reg->history_msgs = history_msgs;
+    reg->history_bytes = history_bytes;
+    atomic_init(&reg->nr_rooms, 0);
+    reg->index = NULL;
+    reg->index_cap = 0;
+    return createRoom(reg, "", 0) == LOBBY_ROOM ? SUCCESS : ERROR;
+}
+
+void room_registry_destroy(room_registry_t *reg) {
+    for (int i = 0; i < MAX_ROOMS / ROOM_CHUNK; i++) {
+        room_info_t *chunk = atomic_load_explicit(&reg->chunks[i], memory_order_relaxed);
+        if (chunk == NULL)
+            break;
+        /* the presence counters of a chunk are one allocation */
+        free(chunk[0].presence);
+        free(chunk);
+    }
+    free(reg->index);
+    pthread_mutex_destroy(&reg->lock);
+}
+
+int room_lookup(room_registry_t *reg, const char *name, int len) {
+    if (len > ROOM_NAME_MAX)
+        return ERROR;
+    for (int i = 0; i < len; i++) {
+        if ((unsigned char) name[i] <= ' ')
+            return ERROR;
+    }
+    pthread_mutex_lock(&reg->lock);
+    int id = reg->index[findSlot(reg, reg->index, reg->index_cap, name, len)];
+    if (id < 0)
+        id = createRoom(reg, name, len);
+    pthread_mutex_unlock(&reg->lock);
+    return id;
+}
@@ -0,0 +1,88 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Longest room name. */
+#define ROOM_NAME_MAX 64
+/* Most rooms a server ever creates, ids are never reused. */
+#define MAX_ROOMS 65536
+/* Rooms allocated at a time, chunks never move once published. */
+#define ROOM_CHUNK 256
+/* Room every connection starts in. */
+#define LOBBY_ROOM 0
+
+/*
+ * Server wide part of a room.
+ */
+typedef struct room_info {
+    /* NUL terminated name, "" for the lobby. */
+    char name[ROOM_NAME_MAX + 1];
+    /* Members per worker, lets a worker skip peers without any. */
+    atomic_int *presence;
+} room_info_t;
+
+/*
+ * Names and ids of all rooms, shared by the workers.
+ *
+ * Looking a name up (on /join) takes the lock, everything on the message
+ * path goes by id without it: the chunks holding the rooms are published
+ * with a release store and never move.
+ */
+typedef struct room_registry {
+    pthread_mutex_t lock;
+    int nr_workers;
+    /* Bounds of the history every worker keeps per room, 0 messages for none. */
+    int history_msgs;
+    size_t history_bytes;
+    atomic_int nr_rooms;
+    _Atomic(room_info_t *) chunks[MAX_ROOMS / ROOM_CHUNK];
+    /* Open addressing hash of room ids by name, under lock. */
+    int *index;
+    int index_cap;
+} room_registry_t;
+
+/*
+ * Init a registry holding the lobby only.
+ * @ history_msgs, history_bytes - bounds of the room histories
+ * @ return value - 0 on success, -1 on failure
+ */
+int room_registry_init(room_registry_t *reg, int nr_workers, int history_msgs, size_t history_bytes);
+
+/*
+ * Free a registry and all of its rooms.
+ */
+void room_registry_destroy(room_registry_t *reg);
+
+/*
+ * Find the id of a room by name, creating the room if there is none.
+ * @ name - the name, len bytes without a terminator
+ * @ return value - the id, -1 if the name is invalid or there is no room left
+ */
+int room_lookup(room_registry_t *reg, const char *name, int len);
+
+/*
+ * The server wide part of room id, which must exist.
+ */
+static inline room_info_t *room_info(room_registry_t *reg, int id) {
+    room_info_t *chunk = atomic_load_explicit(&reg->chunks[id / ROOM_CHUNK], memory_order_acquire);
+    return &chunk[id % ROOM_CHUNK];
+}
+
+/*
+ * Number of members room id has on a worker.
+ */
+static inline int room_present(room_registry_t *reg, int id, int worker) {
+    return atomic_load_explicit(&room_info(reg, id)->presence[worker], memory_order_relaxed);
+}
+
+/*
+ * Count a member joining (delta 1) or leaving (-1) room id on a worker.
+ */
+static inline void room_presence_add(room_registry_t *reg, int id, int worker, int delta) {
+    atomic_fetch_add_explicit(&room_info(reg, id)->presence[worker], delta, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "slab.h"
+
+/* Objects are aligned to 16 bytes, the chunk header takes the first slot. */
+#define SLAB_ALIGN 16
+
+static _Thread_local mem_arena_t *currentArena = NULL;
+
+void slab_init(slab_pool_t *slab, size_t obj_size, mem_arena_t *arena) {
+    if (obj_size < sizeof(void *))
+        obj_size = sizeof(void *);
+    slab->obj_size = (obj_size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+    slab->arena = arena;
+    slab->free_list = NULL;
+    atomic_init(&slab->remote_free, NULL);
+    slab->chunks = NULL;
+    atomic_init(&slab->nr_chunks, 0);
+    atomic_init(&slab->capacity, 0);
+    atomic_init(&slab->in_use, 0);
+}
+
+void slab_destroy(slab_pool_t *slab) {
+    void *chunk = slab->chunks;
+    while (chunk != NULL) {
+        void *next = *(void **) chunk;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+    atomic_store_explicit(&slab->remote_free, NULL, memory_order_relaxed);
+}
+
+/*
+ * Carve a new chunk into objects and put them on the free list.
+ */
+static int growSlab(slab_pool_t *slab) {
+    size_t header = (sizeof(void *) + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+    size_t count = (SLAB_CHUNK_BYTES - header) / slab->obj_size;
+    if (count < 1)
+        count = 1;
+    char *chunk = aligned_alloc(SLAB_ALIGN, header + count * slab->obj_size);
+    if (chunk == NULL)
+        return -1;
+    *(void **) chunk = slab->chunks;
+    slab->chunks = chunk;
+    for (size_t i = count; i > 0; i--) {
+        void *obj = chunk + header + (i - 1) * slab->obj_size;
+        *(void **) obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    atomic_fetch_add_explicit(&slab->nr_chunks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slab->capacity, count, memory_order_relaxed);
+    return 0;
+}
+
+void *slab_alloc(slab_pool_t *slab) {
+    if (slab->free_list == NULL) {
+        /* take over everything other threads gave back before growing */
+        slab->free_list = atomic_exchange_explicit(&slab->remote_free, NULL, memory_order_acquire);
+        if (slab->free_list == NULL && growSlab(slab) < 0)
+            return NULL;
+    }
+    void *obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+    atomic_fetch_add_explicit(&slab->in_use, 1, memory_order_relaxed);
+    return obj;
+}
+
+void slab_free(slab_pool_t *slab, void *obj) {
+    atomic_fetch_sub_explicit(&slab->in_use, 1, memory_order_relaxed);
+    if (slab->arena == currentArena) {
+        *(void **) obj = slab->free_list;
+        slab->free_list = obj;
+        return;
+    }
+    void *head = atomic_load_explicit(&slab->remote_free, memory_order_relaxed);
+    do {
+        *(void **) obj = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slab->remote_free, &head, obj,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+void arena_init(mem_arena_t *arena, size_t conn_size, size_t msg_size, size_t forward_size) {
+    slab_init(&arena->conns, conn_size, arena);
+    slab_init(&arena->msgs, msg_size, arena);
+    slab_init(&arena->forwards, forward_size, arena);
+    for (int i = 0; i < NR_BODY_CLASSES; i++)
+        slab_init(&arena->bodies[i], (size_t) MIN_BODY_CLASS << i, arena);
+}
+
+void arena_destroy(mem_arena_t *arena) {
+    slab_destroy(&arena->conns);
+    slab_destroy(&arena->msgs);
+    slab_destroy(&arena->forwards);
+    for (int i = 0; i < NR_BODY_CLASSES; i++)
+        slab_destroy(&arena->bodies[i]);
+}
+
+void arena_set_current(mem_arena_t *arena) {
+    currentArena = arena;
+}
+
+mem_arena_t *arena_current(void) {
+    return currentArena;
+}
+
+slab_pool_t *arena_body_class(mem_arena_t *arena, size_t size) {
+    for (int i = 0; i < NR_BODY_CLASSES; i++) {
+        if (size <= (size_t) MIN_BODY_CLASS << i)
+            return &arena->bodies[i];
+    }
+    return NULL;
+}
+
+static void printSlab(FILE *out, const char *name, const char *slabName, slab_pool_t *slab) {
+    size_t capacity = atomic_load_explicit(&slab->capacity, memory_order_relaxed);
+    size_t inUse = atomic_load_explicit(&slab->in_use, memory_order_relaxed);
+    if (capacity == 0)
+        return;
+    fprintf(out, "%s %-12s size %6zu chunks %4zu capacity %8zu in use %8zu (%zu%%)\n",
+            name, slabName, slab->obj_size, atomic_load_explicit(&slab->nr_chunks, memory_order_relaxed),
+            capacity, inUse, inUse * 100 / capacity);
+}
+
+void arena_print_stats(FILE *out, const char *name, mem_arena_t *arena) {
+    char slabName[32];
+    printSlab(out, name, "conn", &arena->conns);
+    printSlab(out, name, "msg", &arena->msgs);
+    printSlab(out, name, "forward", &arena->forwards);
+    for (int i = 0; i < NR_BODY_CLASSES; i++) {
+        snprintf(slabName, sizeof(slabName), "body<=%zu", arena->bodies[i].obj_size);
+        printSlab(out, name, slabName, &arena->bodies[i]);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Bytes carved into objects at a time when a slab runs out. */
+#define SLAB_CHUNK_BYTES (64 * 1024)
+
+/* Size classes of message bodies, bigger bodies go to malloc. */
+#define NR_BODY_CLASSES 8
+#define MIN_BODY_CLASS 64
+
+/*
+ * Pool of fixed-size objects with an intrusive free list.
+ *
+ * A slab belongs to the arena of one worker. The owner allocates and frees
+ * without atomics; any other thread that frees an object pushes it onto the
+ * lock-free remote list, which the owner takes over in one exchange when its
+ * own free list runs dry. Memory is never returned to the system, freed
+ * objects are reused for whatever connection needs one next.
+ */
+typedef struct slab_pool {
+    /* Size of one object, rounded up to 16 bytes. */
+    size_t obj_size;
+    /* Arena this slab belongs to. */
+    struct mem_arena *arena;
+    /* Free objects, only touched by the owner. */
+    void *free_list;
+    /* Objects freed by other threads. */
+    _Atomic(void *) remote_free;
+    /* Chunks carved into objects, linked through their first word. */
+    void *chunks;
+    /* Number of chunks and objects carved out of them. */
+    atomic_size_t nr_chunks;
+    atomic_size_t capacity;
+    /* Objects currently handed out. */
+    atomic_size_t in_use;
+} slab_pool_t;
+
+/*
+ * Per-worker allocator for the server's hot objects.
+ */
+typedef struct mem_arena {
+    /* conn_t objects. */
+    slab_pool_t conns;
+    /* msg_t queue nodes. */
+    slab_pool_t msgs;
+    /* Nodes of the cross-worker inboxes. */
+    slab_pool_t forwards;
+    /* Message bodies, by size class MIN_BODY_CLASS << i. */
+    slab_pool_t bodies[NR_BODY_CLASSES];
+} mem_arena_t;
+
+/*
+ * Init an empty slab of objects of obj_size bytes.
+ */
+void slab_init(slab_pool_t *slab, size_t obj_size, mem_arena_t *arena);
+
+/*
+ * Release all chunks of a slab. Objects still in use become invalid.
+ */
+void slab_destroy(slab_pool_t *slab);
+
+/*
+ * Take an object, only callable by the arena's owner.
+ * @ return value - the object, NULL on failure
+ */
+void *slab_alloc(slab_pool_t *slab);
+
+/*
+ * Give an object back, callable from any thread.
+ */
+void slab_free(slab_pool_t *slab, void *obj);
+
+/*
+ * Init an arena with slabs for the given object sizes.
+ */
+void arena_init(mem_arena_t *arena, size_t conn_size, size_t msg_size, size_t forward_size);
+
+/*
+ * Release all memory of an arena.
+ */
+void arena_destroy(mem_arena_t *arena);
+
+/*
+ * Make arena the one owned by the calling thread, NULL for none.
+ */
+void arena_set_current(mem_arena_t *arena);
+
+/*
+ * The arena owned by the calling thread, NULL if it has none.
+ */
+mem_arena_t *arena_current(void);
+
+/*
+ * Slab of the smallest body class holding size bytes.
+ * @ return value - the slab, NULL if size is above the largest class
+ */
+slab_pool_t *arena_body_class(mem_arena_t *arena, size_t size);
+
+/*
+ * Print occupancy (chunks, capacity, objects in use) of every slab.
+ * @ name - label of the arena
+ */
+void arena_print_stats(FILE *out, const char *name, mem_arena_t *arena);
+
+#endif
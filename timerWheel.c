@@ -0,0 +1,82 @@
+#include "timerWheel.h"
+
+#define TICK_NS ((uint64_t) WHEEL_TICK_MS * 1000000)
+
+void wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].next = &wheel->slots[i];
+    }
+    wheel->tick = now / TICK_NS;
+    wheel->nr_timers = 0;
+}
+
+static void detach(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+void wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t when) {
+    if (wheel_timer_pending(timer))
+        detach(timer);
+    else
+        wheel->nr_timers++;
+    timer->expires = (when + TICK_NS - 1) / TICK_NS;
+    /* never into the slot being looked at or one already passed */
+    if (timer->expires <= wheel->tick)
+        timer->expires = wheel->tick + 1;
+    wheel_timer_t *head = &wheel->slots[timer->expires % WHEEL_SLOTS];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (!wheel_timer_pending(timer))
+        return;
+    detach(timer);
+    wheel->nr_timers--;
+}
+
+void wheel_advance(timer_wheel_t *wheel, uint64_t now, void *arg) {
+    uint64_t target = now / TICK_NS;
+    /* after a long stall one revolution visits every slot */
+    if (target - wheel->tick > WHEEL_SLOTS)
+        wheel->tick = target - WHEEL_SLOTS;
+    while (wheel->tick < target && wheel->nr_timers > 0) {
+        wheel->tick++;
+        wheel_timer_t *head = &wheel->slots[wheel->tick % WHEEL_SLOTS];
+        /*
+         * Timers due are moved to a list of their own first: fire functions
+         * may schedule and cancel timers, including the ones of this slot.
+         */
+        wheel_timer_t due = {&due, &due, 0, NULL};
+        for (wheel_timer_t *timer = head->next, *next; timer != head; timer = next) {
+            next = timer->next;
+            if (timer->expires > target)
+                continue;
+            detach(timer);
+            timer->next = &due;
+            timer->prev = due.prev;
+            due.prev->next = timer;
+            due.prev = timer;
+        }
+        while (due.next != &due) {
+            wheel_timer_t *timer = due.next;
+            detach(timer);
+            wheel->nr_timers--;
+            timer->fire(timer, arg);
+        }
+    }
+    wheel->tick = target;
+}
+
+int wheel_timeout(const timer_wheel_t *wheel, uint64_t now) {
+    if (wheel->nr_timers == 0)
+        return -1;
+    uint64_t next = (now / TICK_NS + 1) * TICK_NS;
+    return (int) ((next - now + 999999) / 1000000);
+}
@@ -0,0 +1,79 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Resolution of the wheel, timers fire up to one tick late. */
+#define WHEEL_TICK_MS 100
+/* Slots of the wheel, one revolution covers WHEEL_SLOTS ticks. */
+#define WHEEL_SLOTS 512
+
+/*
+ * A timer, embedded in the object it times. It is in at most one slot of
+ * the wheel, linked into its list.
+ */
+typedef struct wheel_timer {
+    struct wheel_timer *prev;
+    struct wheel_timer *next;
+    /* Tick at which the timer is due. */
+    uint64_t expires;
+    /* Called when the timer is due, after it was unlinked. */
+    void (*fire)(struct wheel_timer *timer, void *arg);
+} wheel_timer_t;
+
+/*
+ * Hashed timing wheel: a timer due at tick t waits in slot t % WHEEL_SLOTS,
+ * timers further out than one revolution stay there for the next round.
+ * Scheduling and cancelling are O(1), each tick looks at one slot only.
+ */
+typedef struct timer_wheel {
+    /* List heads of the slots. */
+    wheel_timer_t slots[WHEEL_SLOTS];
+    /* Last tick the wheel advanced to. */
+    uint64_t tick;
+    /* Timers scheduled. */
+    int nr_timers;
+} timer_wheel_t;
+
+/*
+ * Init an empty wheel at time now (ns).
+ */
+void wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+/*
+ * Init a timer that is not scheduled.
+ */
+static inline void wheel_timer_init(wheel_timer_t *timer, void (*fire)(wheel_timer_t *, void *)) {
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->fire = fire;
+}
+
+static inline int wheel_timer_pending(const wheel_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+/*
+ * (Re)schedule a timer to fire at time when (ns), rounded up to the next tick.
+ */
+void wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t when);
+
+/*
+ * Unschedule a timer, if it is scheduled.
+ */
+void wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+/*
+ * Fire the timers due by time now (ns).
+ * @ arg - passed on to the timers' fire functions
+ */
+void wheel_advance(timer_wheel_t *wheel, uint64_t now, void *arg);
+
+/*
+ * Time until the next tick of the wheel, for the backend wait.
+ * @ return value - milliseconds, -1 if no timer is scheduled
+ */
+int wheel_timeout(const timer_wheel_t *wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <openssl/err.h>
+#include "log.h"
+#include "tls.h"
+
+#define ERROR (-1)
+
+/*
+ * Log the reason OpenSSL gave for the last failure, and make sure the
+ * session sends nothing more: no alert may follow a fatal error.
+ */
+static void failed(SSL *ssl, int fd, const char *what) {
+    char reason[256];
+    unsigned long code = ERR_get_error();
+    if (code != 0)
+        ERR_error_string_n(code, reason, sizeof(reason));
+    else
+        snprintf(reason, sizeof(reason), "%s", errno != 0 ? strerror(errno) : "connection closed");
+    log_info("sd %d: TLS %s failed: %s", fd, what, reason);
+    SSL_set_quiet_shutdown(ssl, 1);
+    ERR_clear_error();
+}
+
+SSL_CTX *tls_context_create(const char *cert, const char *key) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        log_error("SSL_CTX_new failed");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    /* records go to the kernel once the keys are known, renegotiation would take them back */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    /* a record the socket did not take is offered again from wherever the queue is by then */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        char reason[256];
+        ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+        log_error("TLS certificate %s, key %s: %s", cert, key, reason);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void tls_context_destroy(SSL_CTX *ctx) {
+    SSL_CTX_free(ctx);
+}
+
+SSL *tls_session_create(SSL_CTX *ctx, int fd) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL)
+        return NULL;
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void tls_session_close(SSL *ssl) {
+    /* one try, the socket is closed right after whatever the peer does */
+    if (SSL_is_init_finished(ssl))
+        SSL_shutdown(ssl);
+    ERR_clear_error();
+    SSL_free(ssl);
+}
+
+int tls_handshake(SSL *ssl, int fd, int *want_write) {
+    *want_write = 0;
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1)
+        return 1;
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            *want_write = 1;
+            return 0;
+        default:
+            failed(ssl, fd, "handshake");
+            return ERROR;
+    }
+}
+
+int tls_ktls_send(SSL *ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+}
+
+int tls_ktls_recv(SSL *ssl) {
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? 1 : 0;
+}
+
+ssize_t tls_read(SSL *ssl, char *buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : (int) len);
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_ZERO_RETURN:
+            /* close_notify, the clean end of the stream */
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return ERROR;
+        default:
+            /* an end without close_notify may have cut the last line short */
+            failed(ssl, SSL_get_fd(ssl), "read");
+            errno = EIO;
+            return ERROR;
+    }
+}
+
+ssize_t tls_write(SSL *ssl, const char *buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write(ssl, buf, (int) len);
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return ERROR;
+        default:
+            failed(ssl, SSL_get_fd(ssl), "write");
+            errno = EIO;
+            return ERROR;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+#include <sys/types.h>
+
+/*
+ * TLS for the client listener, on top of OpenSSL.
+ *
+ * The handshake runs in the event loop on the non-blocking socket. Once it
+ * is done the record crypto is handed to the kernel (kTLS) where it can take
+ * it, and the connection is read and written with plain read() and writev()
+ * again. A direction the kernel did not take stays with OpenSSL, see
+ * tls_read() and tls_write().
+ */
+
+/* Largest TLS record payload, what tls_write() is best fed at once. */
+#define TLS_RECORD_MAX 16384
+
+/*
+ * Create the server context shared by all workers, asking OpenSSL for kTLS.
+ * @ cert - PEM file with the certificate chain
+ * @ key - PEM file with the private key
+ * @ return value - the context, NULL on failure (logged)
+ */
+SSL_CTX *tls_context_create(const char *cert, const char *key);
+
+void tls_context_destroy(SSL_CTX *ctx);
+
+/*
+ * Start the server side of a session on the accepted socket fd.
+ * @ return value - the session, NULL on failure
+ */
+SSL *tls_session_create(SSL_CTX *ctx, int fd);
+
+/*
+ * Send close_notify if the handshake got that far, without waiting for the
+ * peer's, and free the session. The socket must still be open.
+ */
+void tls_session_close(SSL *ssl);
+
+/*
+ * Move the handshake on as far as the socket allows.
+ * @ want_write - set to non-zero if it is stuck until the socket is writable
+ * @ return value - 1 once it is done, 0 while it waits for the socket, -1 if it failed (logged)
+ */
+int tls_handshake(SSL *ssl, int fd, int *want_write);
+
+/*
+ * Did the kernel take over encryption (tls_ktls_send) or decryption
+ * (tls_ktls_recv) of the session? Asked once the handshake is done.
+ */
+int tls_ktls_send(SSL *ssl);
+int tls_ktls_recv(SSL *ssl);
+
+/*
+ * Decrypt up to len bytes with OpenSSL.
+ * @ return value - as read(): bytes read, 0 once the peer closed, -1 with
+ *   errno EAGAIN while more records have to arrive and EIO on failure
+ */
+ssize_t tls_read(SSL *ssl, char *buf, size_t len);
+
+/*
+ * Encrypt and send buf with OpenSSL, as one record up to TLS_RECORD_MAX.
+ * After -1 with errno EAGAIN the call has to be repeated with the same
+ * bytes at the start of buf (it may be another buffer, and hold more).
+ * @ return value - len, or -1 with errno EAGAIN while the socket is full and EIO on failure
+ */
+ssize_t tls_write(SSL *ssl, const char *buf, size_t len);
+
+#endif
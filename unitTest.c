@@ -0,0 +1,268 @@
+/*
+ * unit_test: table driven checks of the pure parts of the server, the
+ * decoders of untrusted wire input and the timer wheel. Prints the cases
+ * that fail and exits non-zero if there is one. Run by ctest.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "frame.h"
+#include "timerWheel.h"
+#include "websocket.h"
+
+#define TICK_NS ((uint64_t) WHEEL_TICK_MS * 1000000)
+
+static int failures;
+
+#define CHECK(cond, ...)                                   \
+    do {                                                   \
+        if (!(cond)) {                                     \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                  \
+            fputc('\n', stderr);                           \
+            failures++;                                    \
+        }                                                  \
+    } while (0)
+
+/*
+ * A header as it comes off the wire and what decoding it should give.
+ */
+typedef struct frame_case {
+    const char *name;
+    const char *bytes;
+    int len;
+    /* Return value of frame_header_decode(), and the header if it is positive. */
+    int ret;
+    uint32_t length;
+    int type;
+    int flags;
+} frame_case_t;
+
+static const frame_case_t frameCases[] = {
+        {"empty",                 "",                         0, 0,  0,          0, 0},
+        {"one byte message",      "\x01\x00\x00",             3, 3,  1,          FRAME_MESSAGE, 0},
+        {"control",               "\x05\x01\x00",             3, 3,  5,          FRAME_CONTROL, 0},
+        {"flags passed on",       "\x05\x00\x01",             3, 3,  5,          FRAME_MESSAGE, FRAME_COMPRESSED},
+        {"truncated type",        "\x05",                     1, 0,  0,          0, 0},
+        {"truncated flags",       "\x05\x00",                 2, 0,  0,          0, 0},
+        {"truncated varint",      "\x80",                     1, 0,  0,          0, 0},
+        {"truncated long varint", "\xff\xff\xff\xff",         4, 0,  0,          0, 0},
+        {"two byte varint",       "\x80\x01\x00\x00",         4, 4,  128,        FRAME_MESSAGE, 0},
+        {"overlong zero",         "\x80\x80\x80\x80\x00\x00\x00", 7, 7, 0,       FRAME_MESSAGE, 0},
+        {"5 byte varint, max",    "\xff\xff\xff\xff\x0f\x00\x00", 7, 7, UINT32_MAX, FRAME_MESSAGE, 0},
+        {"5 byte varint, 33 bits", "\xff\xff\xff\xff\x1f\x00\x00", 7, -1, 0,     0, 0},
+        {"6 byte varint",         "\xff\xff\xff\xff\x8f\x00\x00", 7, -1, 0,     0, 0},
+};
+
+static void testFrameDecode(void) {
+    for (size_t i = 0; i < sizeof(frameCases) / sizeof(frameCases[0]); i++) {
+        const frame_case_t *c = &frameCases[i];
+        frame_header_t header = {0, -1, -1};
+        int ret = frame_header_decode(c->bytes, c->len, &header);
+        CHECK(ret == c->ret, "frame %s: returned %d, expected %d", c->name, ret, c->ret);
+        if (ret <= 0 || ret != c->ret)
+            continue;
+        CHECK(header.length == c->length && header.type == c->type && header.flags == c->flags,
+              "frame %s: got length %u type %d flags %d", c->name, header.length, header.type, header.flags);
+    }
+}
+
+static void testFrameRoundTrip(void) {
+    static const uint32_t lengths[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, UINT32_MAX};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        char buf[FRAME_HEADER_MAX];
+        int len = frame_header_encode(buf, lengths[i], FRAME_CONTROL, 0);
+        CHECK(len >= 3 && len <= FRAME_HEADER_MAX, "frame encode %u: %d bytes", lengths[i], len);
+        /* every prefix is incomplete, the whole header decodes back */
+        for (int avail = 0; avail < len; avail++) {
+            frame_header_t header;
+            CHECK(frame_header_decode(buf, avail, &header) == 0, "frame %u: prefix of %d decoded", lengths[i], avail);
+        }
+        frame_header_t header;
+        CHECK(frame_header_decode(buf, len, &header) == len && header.length == lengths[i]
+              && header.type == FRAME_CONTROL && header.flags == 0, "frame %u: no round trip", lengths[i]);
+    }
+}
+
+/*
+ * A client frame header and what decoding it should give.
+ */
+typedef struct ws_case {
+    const char *name;
+    const char *bytes;
+    int len;
+    /* Return value of ws_header_decode(), and the header if it is positive. */
+    int ret;
+    int fin;
+    int opcode;
+    uint64_t length;
+} ws_case_t;
+
+static const ws_case_t wsCases[] = {
+        {"empty",                "",                                  0, 0,  0, 0,         0},
+        {"truncated length",     "\x81",                              1, 0,  0, 0,         0},
+        {"truncated mask",       "\x81\x85\x01\x02",                  4, 0,  0, 0,         0},
+        {"text",                 "\x81\x85\x01\x02\x03\x04",          6, 6,  1, WS_TEXT,   5},
+        {"binary, no fin",       "\x02\x80\x01\x02\x03\x04",          6, 6,  0, WS_BINARY, 0},
+        {"continuation",         "\x80\x83\x01\x02\x03\x04",          6, 6,  1, WS_CONTINUATION, 3},
+        {"16 bit length",        "\x82\xfe\x01\x00\x01\x02\x03\x04",  8, 8,  1, WS_BINARY, 256},
+        {"truncated 16 bit",     "\x82\xfe\x01",                      3, 0,  0, 0,         0},
+        {"64 bit length",        "\x82\xff\x00\x00\x00\x00\x00\x01\x00\x00\x01\x02\x03\x04", 14, 14, 1, WS_BINARY,
+                                                                                                      65536},
+        {"truncated 64 bit",     "\x82\xff\x00\x00\x00\x00\x00\x01\x00\x00\x01\x02", 12, 0, 0, 0, 0},
+        {"64 bit, top bit set",  "\x82\xff\x80\x00\x00\x00\x00\x00\x00\x00\x01\x02\x03\x04", 14, -1, 0, 0, 0},
+        {"unmasked",             "\x81\x05",                          2, -1, 0, 0,         0},
+        {"RSV1",                 "\xc1\x85\x01\x02\x03\x04",          6, -1, 0, 0,         0},
+        {"RSV2",                 "\xa1\x85\x01\x02\x03\x04",          6, -1, 0, 0,         0},
+        {"RSV3",                 "\x91\x85\x01\x02\x03\x04",          6, -1, 0, 0,         0},
+        {"reserved opcode",      "\x83\x80\x01\x02\x03\x04",          6, -1, 0, 0,         0},
+        {"ping",                 "\x89\xfd\x01\x02\x03\x04",          6, 6,  1, WS_PING,   125},
+        {"ping too long",        "\x89\xfe\x00\x7e\x01\x02\x03\x04",  8, -1, 0, 0,         0},
+        {"fragmented ping",      "\x09\x80\x01\x02\x03\x04",          6, -1, 0, 0,         0},
+        {"close",                "\x88\x82\x01\x02\x03\x04",          6, 6,  1, WS_CLOSE,  2},
+};
+
+static void testWebSocketDecode(void) {
+    for (size_t i = 0; i < sizeof(wsCases) / sizeof(wsCases[0]); i++) {
+        const ws_case_t *c = &wsCases[i];
+        ws_header_t header;
+        memset(&header, 0xff, sizeof(header));
+        int ret = ws_header_decode(c->bytes, c->len, &header);
+        CHECK(ret == c->ret, "ws %s: returned %d, expected %d", c->name, ret, c->ret);
+        if (ret <= 0 || ret != c->ret)
+            continue;
+        CHECK(header.fin == c->fin && header.opcode == c->opcode && header.length == c->length
+              && memcmp(header.mask, "\x01\x02\x03\x04", 4) == 0, "ws %s: got fin %d opcode %d length %llu",
+              c->name, header.fin, header.opcode, (unsigned long long) header.length);
+    }
+}
+
+typedef struct utf8_case {
+    const char *name;
+    const char *bytes;
+    int valid;
+} utf8_case_t;
+
+static const utf8_case_t utf8Cases[] = {
+        {"empty",                    "",                                 1},
+        {"ascii",                    "the quick brown fox jumps",        1},
+        {"two bytes",                "caf\xc3\xa9",                      1},
+        {"three bytes",              "\xe2\x82\xac 5",                   1},
+        {"four bytes",               "\xf0\x9f\x98\x80",                 1},
+        {"last before surrogates",   "\xed\x9f\xbf",                     1},
+        {"first after surrogates",   "\xee\x80\x80",                     1},
+        {"U+10FFFF",                 "\xf4\x8f\xbf\xbf",                 1},
+        {"after a long ascii run",   "abcdefghijklmnop\xc3\xa9",         1},
+        {"overlong NUL",             "\xc0\x80",                         0},
+        {"overlong two bytes",       "\xc1\xbf",                         0},
+        {"overlong three bytes",     "\xe0\x80\x80",                     0},
+        {"overlong three bytes, max", "\xe0\x9f\xbf",                    0},
+        {"overlong four bytes",      "\xf0\x80\x80\x80",                 0},
+        {"overlong four bytes, max", "\xf0\x8f\xbf\xbf",                 0},
+        {"high surrogate",           "\xed\xa0\x80",                     0},
+        {"low surrogate",            "\xed\xbf\xbf",                     0},
+        {"past U+10FFFF",            "\xf4\x90\x80\x80",                 0},
+        {"F5 lead",                  "\xf5\x80\x80\x80",                 0},
+        {"FF",                       "\xff",                             0},
+        {"stray continuation",       "a\x80",                            0},
+        {"bad continuation",         "\xe2\x28\xa1",                     0},
+        {"truncated at the end",     "\xe2\x82",                         0},
+        {"truncated after ascii run", "abcdefgh\xf0\x9f\x98",            0},
+};
+
+static void testUtf8(void) {
+    for (size_t i = 0; i < sizeof(utf8Cases) / sizeof(utf8Cases[0]); i++) {
+        const utf8_case_t *c = &utf8Cases[i];
+        int valid = ws_utf8_valid(c->bytes, strlen(c->bytes));
+        CHECK(!valid == !c->valid, "utf8 %s: %s", c->name, valid ? "valid" : "invalid");
+    }
+}
+
+/*
+ * A timer that counts how often it fired, and may reschedule itself.
+ */
+typedef struct counted_timer {
+    wheel_timer_t timer;
+    int fired;
+    /* Rescheduled this far after the time passed to wheel_advance(), 0 for not. */
+    uint64_t period;
+} counted_timer_t;
+
+typedef struct wheel_env {
+    timer_wheel_t *wheel;
+    uint64_t now;
+} wheel_env_t;
+
+static void countedFired(wheel_timer_t *timer, void *arg) {
+    counted_timer_t *t = (counted_timer_t *) ((char *) timer - offsetof(counted_timer_t, timer));
+    wheel_env_t *env = arg;
+    t->fired++;
+    if (t->period > 0)
+        wheel_schedule(env->wheel, &t->timer, env->now + t->period);
+}
+
+static void advance(wheel_env_t *env, uint64_t now) {
+    env->now = now;
+    wheel_advance(env->wheel, now, env);
+}
+
+static void testWheelStall(void) {
+    static timer_wheel_t wheel;
+    uint64_t start = 1000 * TICK_NS + 123;
+    wheel_init(&wheel, start);
+    wheel_env_t env = {&wheel, start};
+    /* due in the first revolution, one slot after another revolution, and far out */
+    static const uint64_t ticks[] = {1, 2, WHEEL_SLOTS - 1, WHEEL_SLOTS, WHEEL_SLOTS + 1, 2 * WHEEL_SLOTS + 3,
+                                     7 * WHEEL_SLOTS + 5, 20 * WHEEL_SLOTS};
+    enum { NR = sizeof(ticks) / sizeof(ticks[0]) };
+    counted_timer_t timers[NR];
+    for (int i = 0; i < NR; i++) {
+        wheel_timer_init(&timers[i].timer, countedFired);
+        timers[i].fired = 0;
+        timers[i].period = 0;
+        wheel_schedule(&wheel, &timers[i].timer, start + ticks[i] * TICK_NS);
+    }
+    /* fires once a tick, rescheduled relative to the time of the advance */
+    counted_timer_t periodic = {.fired = 0, .period = TICK_NS};
+    wheel_timer_init(&periodic.timer, countedFired);
+    wheel_schedule(&wheel, &periodic.timer, start + TICK_NS);
+    CHECK(wheel.nr_timers == NR + 1, "wheel: %d timers scheduled", wheel.nr_timers);
+
+    /* a stall of several revolutions: everything due fires once, nothing early */
+    uint64_t stall = start + (uint64_t) (5 * WHEEL_SLOTS + 17) * TICK_NS;
+    advance(&env, stall);
+    for (int i = 0; i < NR; i++) {
+        int due = start + ticks[i] * TICK_NS <= stall;
+        CHECK(timers[i].fired == due, "wheel: timer %llu ticks out fired %d times after the stall",
+              (unsigned long long) ticks[i], timers[i].fired);
+    }
+    CHECK(periodic.fired == 1, "wheel: periodic timer fired %d times in one stall", periodic.fired);
+    CHECK(wheel.nr_timers == 3, "wheel: %d timers left after the stall", wheel.nr_timers);
+
+    /* the rest fire after another stall, not before their time and at most a tick late */
+    advance(&env, start + (7 * WHEEL_SLOTS + 5) * TICK_NS - 1);
+    CHECK(timers[NR - 2].fired == 0, "wheel: timer fired early");
+    advance(&env, start + (7 * WHEEL_SLOTS + 6) * TICK_NS);
+    CHECK(timers[NR - 2].fired == 1, "wheel: timer fired more than a tick late");
+    CHECK(periodic.fired == 2, "wheel: periodic timer fired %d times", periodic.fired);
+    advance(&env, start + (uint64_t) 40 * WHEEL_SLOTS * TICK_NS);
+    CHECK(timers[NR - 1].fired == 1, "wheel: far timer fired %d times", timers[NR - 1].fired);
+
+    wheel_cancel(&wheel, &periodic.timer);
+    CHECK(wheel.nr_timers == 0 && wheel_timeout(&wheel, env.now) == -1, "wheel: %d timers left", wheel.nr_timers);
+}
+
+int main(void) {
+    testFrameDecode();
+    testFrameRoundTrip();
+    testWebSocketDecode();
+    testUtf8();
+    testWheelStall();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,532 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#include "eventBackend.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+/* Submission queue entries, the completion queue is four times larger. */
+#define URING_ENTRIES 4096
+/* Provided receive buffers, must be a power of two. */
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 4096
+/* Buffer group id of the provided buffer ring. */
+#define URING_BGID 0
+
+/*
+ * user_data layout: the operation in the top byte. Descriptor operations keep
+ * a 24 bit generation and the fd below it, so completions that arrive after
+ * the fd was removed (and maybe reused) are recognised and dropped. Writes
+ * carry the caller's ctx pointer, user space addresses fit in 56 bits.
+ */
+#define OP_SHIFT 56
+#define OP_ACCEPT 1ULL
+#define OP_RECV 2ULL
+#define OP_POLL 3ULL
+#define OP_WRITE 4ULL
+#define OP_CANCEL 5ULL
+#define GEN_MASK 0xffffffULL
+
+/* Receive state of a connection fd. */
+/* A multishot recv is outstanding. */
+#define RECV_ARMED 0x1
+/* The caller wants to read, re-arm the recv whenever it ends. */
+#define RECV_WANTED 0x2
+/* A cancel of the outstanding recv was submitted. */
+#define RECV_CANCELLING 0x4
+
+typedef struct uring_backend {
+    event_backend_t base;
+    int ring_fd;
+
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* tail including prepared but not yet published entries */
+    unsigned sq_local_tail;
+
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided buffer ring for multishot recv */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buf_base;
+    unsigned short buf_tail;
+    /* buffers handed out by the last wait, given back on the next one */
+    unsigned short recycle[MAX_EVENTS];
+    int nr_recycle;
+
+    /* per-fd generation, bumped on remove */
+    uint32_t *gen;
+    /* per-fd RECV_* state */
+    unsigned char *recv_state;
+    int gen_cap;
+} uring_backend_t;
+
+static int uringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/* Multishot recv needs 6.0, nothing in the feature flags announces it. */
+static int kernelAtLeast(int major, int minor) {
+    struct utsname u;
+    int kmajor = 0, kminor = 0;
+    if (uname(&u) < 0 || sscanf(u.release, "%d.%d", &kmajor, &kminor) != 2)
+        return 0;
+    return kmajor > major || (kmajor == major && kminor >= minor);
+}
+
+static unsigned pendingSubmissions(uring_backend_t *ur) {
+    return ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Publish prepared entries and hand them to the kernel without waiting. */
+static int submitNow(uring_backend_t *ur) {
+    __atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned pending = pendingSubmissions(ur);
+    while (pending > 0) {
+        int ret = uringEnter(ur->ring_fd, pending, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return ERROR;
+        }
+        pending = pendingSubmissions(ur);
+    }
+    return SUCCESS;
+}
+
+static struct io_uring_sqe *getSqe(uring_backend_t *ur) {
+    if (ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) == ur->sq_entries) {
+        /* the queue is full: push it to the kernel to make room */
+        if (submitNow(ur) < 0)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &ur->sqes[ur->sq_local_tail & ur->sq_mask];
+    ur->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static uint64_t fdUserData(uring_backend_t *ur, uint64_t op, int fd) {
+    return (op << OP_SHIFT) | (((uint64_t) ur->gen[fd] & GEN_MASK) << 32) | (uint32_t) fd;
+}
+
+static int growGenerations(uring_backend_t *ur, int fd) {
+    if (fd < ur->gen_cap)
+        return SUCCESS;
+    int cap = ur->gen_cap ? ur->gen_cap : 1024;
+    while (cap <= fd)
+        cap *= 2;
+    uint32_t *gen = realloc(ur->gen, cap * sizeof(uint32_t));
+    if (gen == NULL)
+        return ERROR;
+    ur->gen = gen;
+    unsigned char *state = realloc(ur->recv_state, cap);
+    if (state == NULL)
+        return ERROR;
+    ur->recv_state = state;
+    memset(ur->gen + ur->gen_cap, 0, (cap - ur->gen_cap) * sizeof(uint32_t));
+    memset(ur->recv_state + ur->gen_cap, 0, cap - ur->gen_cap);
+    ur->gen_cap = cap;
+    return SUCCESS;
+}
+
+static int armAccept(uring_backend_t *ur, int fd) {
+    struct io_uring_sqe *sqe = getSqe(ur);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = fdUserData(ur, OP_ACCEPT, fd);
+    return SUCCESS;
+}
+
+static int armRecv(uring_backend_t *ur, int fd) {
+    struct io_uring_sqe *sqe = getSqe(ur);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = fdUserData(ur, OP_RECV, fd);
+    ur->recv_state[fd] |= RECV_ARMED;
+    return SUCCESS;
+}
+
+/* The multishot recv of fd terminated, start a new one if reading is still wanted. */
+static void recvEnded(uring_backend_t *ur, int fd) {
+    ur->recv_state[fd] &= ~(RECV_ARMED | RECV_CANCELLING);
+    if (ur->recv_state[fd] & RECV_WANTED)
+        armRecv(ur, fd);
+}
+
+static int armPoll(uring_backend_t *ur, int fd) {
+    struct io_uring_sqe *sqe = getSqe(ur);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = fdUserData(ur, OP_POLL, fd);
+    return SUCCESS;
+}
+
+static void provideBuffer(uring_backend_t *ur, unsigned short bid) {
+    struct io_uring_buf *buf = &ur->buf_ring->bufs[ur->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ur->buf_base + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ur->buf_tail++;
+}
+
+static int uringAdd(event_backend_t *be, int fd, int events) {
+    uring_backend_t *ur = (uring_backend_t *) be;
+    if (fd < 0 || growGenerations(ur, fd) < 0)
+        return ERROR;
+    if (events & EV_LISTEN)
+        return armAccept(ur, fd);
+    if (events & EV_POLL)
+        return armPoll(ur, fd);
+    ur->recv_state[fd] = RECV_WANTED;
+    return armRecv(ur, fd);
+}
+
+/*
+ * Writes are submitted explicitly, only read interest can change. Dropping it
+ * cancels the multishot recv so unread data stays in the socket buffer; bytes
+ * already received are still reported.
+ */
+static int uringModify(event_backend_t *be, int fd, int events) {
+    uring_backend_t *ur = (uring_backend_t *) be;
+    if (fd < 0 || fd >= ur->gen_cap)
+        return ERROR;
+    unsigned char *state = &ur->recv_state[fd];
+    if (events & EV_READ) {
+        *state |= RECV_WANTED;
+        /* a recv being cancelled is re-armed once the cancel completes */
+        return (*state & RECV_ARMED) ? SUCCESS : armRecv(ur, fd);
+    }
+    *state &= ~RECV_WANTED;
+    if (!(*state & RECV_ARMED) || (*state & RECV_CANCELLING))
+        return SUCCESS;
+    struct io_uring_sqe *sqe = getSqe(ur);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = fdUserData(ur, OP_RECV, fd);
+    sqe->user_data = OP_CANCEL << OP_SHIFT;
+    *state |= RECV_CANCELLING;
+    return SUCCESS;
+}
+
+static int uringRemove(event_backend_t *be, int fd) {
+    uring_backend_t *ur = (uring_backend_t *) be;
+    if (fd < 0 || fd >= ur->gen_cap)
+        return ERROR;
+    ur->gen[fd]++;
+    ur->recv_state[fd] = 0;
+    struct io_uring_sqe *sqe = getSqe(ur);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = OP_CANCEL << OP_SHIFT;
+    /* the cancel has to look the fd up before the caller closes it */
+    return submitNow(ur);
+}
+
+static int uringSubmitWrite(event_backend_t *be, int fd, const struct iovec *iov, int count, void *ctx) {
+    uring_backend_t *ur = (uring_backend_t *) be;
+    struct io_uring_sqe *sqe = getSqe(ur);
+    if (sqe == NULL)
+        return ERROR;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = (unsigned) count;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = (OP_WRITE << OP_SHIFT) | (uint64_t) (uintptr_t) ctx;
+    return SUCCESS;
+}
+
+static int uringWait(event_backend_t *be, ev_event_t *events, int max_events, long timeout_us) {
+    uring_backend_t *ur = (uring_backend_t *) be;
+    if (max_events > MAX_EVENTS)
+        max_events = MAX_EVENTS;
+
+    /* the data of the previous batch has been consumed, give its buffers back */
+    for (int i = 0; i < ur->nr_recycle; i++)
+        provideBuffer(ur, ur->recycle[i]);
+    ur->nr_recycle = 0;
+    __atomic_store_n(&ur->buf_ring->tail, ur->buf_tail, __ATOMIC_RELEASE);
+
+    /*************************************************************/
+    /* One io_uring_enter submits everything prepared since the  */
+    /* last wait (sends, re-armed multishots) and waits.         */
+    /*************************************************************/
+    __atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned ready = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE) - *ur->cq_head;
+    unsigned toSubmit = pendingSubmissions(ur);
+    if (ready == 0 || toSubmit > 0) {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        if (timeout_us >= 0) {
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = (long long) (timeout_us % 1000000) * 1000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+            arg.sigmask_sz = _NSIG / 8;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+        unsigned minComplete = (ready == 0 && timeout_us != 0) ? 1 : 0;
+        int ret = uringEnter(ur->ring_fd, toSubmit, minComplete, flags,
+                             timeout_us >= 0 ? &arg : NULL, timeout_us >= 0 ? sizeof(arg) : 0);
+        if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+            return ERROR;
+    }
+
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (head != tail && n < max_events && ur->nr_recycle < MAX_EVENTS) {
+        struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+        head++;
+        uint64_t op = cqe->user_data >> OP_SHIFT;
+        int res = cqe->res;
+        unsigned cflags = cqe->flags;
+
+        if (op == OP_WRITE) {
+            events[n].fd = -1;
+            events[n].events = EV_WRITTEN;
+            events[n].res = res;
+            events[n].data = NULL;
+            events[n].ptr = (void *) (uintptr_t) (cqe->user_data & ((1ULL << OP_SHIFT) - 1));
+            n++;
+            continue;
+        }
+        if (op == OP_CANCEL)
+            continue;
+
+        int fd = (int) (uint32_t) cqe->user_data;
+        uint32_t gen = (uint32_t) ((cqe->user_data >> 32) & GEN_MASK);
+        int stale = fd >= ur->gen_cap || (ur->gen[fd] & GEN_MASK) != gen;
+        if (stale) {
+            /* the fd was removed, only the buffer matters */
+            if (cflags & IORING_CQE_F_BUFFER)
+                ur->recycle[ur->nr_recycle++] = (unsigned short) (cflags >> IORING_CQE_BUFFER_SHIFT);
+            continue;
+        }
+        int more = cflags & IORING_CQE_F_MORE;
+
+        if (op == OP_ACCEPT) {
+            if (res >= 0) {
+                events[n].fd = fd;
+                events[n].events = EV_ACCEPTED;
+                events[n].res = res;
+                n++;
+            }
+            if (!more)
+                armAccept(ur, fd);
+        } else if (op == OP_POLL) {
+            events[n].fd = fd;
+            events[n].events = EV_READ;
+            n++;
+            if (!more)
+                armPoll(ur, fd);
+        } else if (op == OP_RECV) {
+            if (res > 0 && (cflags & IORING_CQE_F_BUFFER)) {
+                unsigned short bid = (unsigned short) (cflags >> IORING_CQE_BUFFER_SHIFT);
+                ur->recycle[ur->nr_recycle++] = bid;
+                events[n].fd = fd;
+                events[n].events = EV_DATA;
+                events[n].res = res;
+                events[n].data = ur->buf_base + (size_t) bid * URING_BUF_SIZE;
+                n++;
+                if (!more)
+                    recvEnded(ur, fd);
+            } else if (res == -ENOBUFS || res == -ECANCELED) {
+                /* out of buffers: they are given back before the re-armed recv is submitted */
+                recvEnded(ur, fd);
+            } else {
+                ur->recv_state[fd] = 0;
+                events[n].fd = fd;
+                events[n].events = EV_CLOSED;
+                events[n].res = res;
+                n++;
+            }
+        }
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static void uringDestroy(event_backend_t *be) {
+    uring_backend_t *ur = (uring_backend_t *) be;
+    if (ur->buf_ring != NULL)
+        munmap(ur->buf_ring, ur->buf_ring_size);
+    free(ur->buf_base);
+    if (ur->sqes != NULL)
+        munmap(ur->sqes, ur->sqes_size);
+    if (ur->cq_ptr != NULL && ur->cq_ptr != ur->sq_ptr)
+        munmap(ur->cq_ptr, ur->cq_size);
+    if (ur->sq_ptr != NULL)
+        munmap(ur->sq_ptr, ur->sq_size);
+    if (ur->ring_fd >= 0)
+        close(ur->ring_fd);
+    free(ur->gen);
+    free(ur->recv_state);
+    free(ur);
+}
+
+static int mapRings(uring_backend_t *ur, struct io_uring_params *p) {
+    ur->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ur->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_size > ur->sq_size)
+            ur->sq_size = ur->cq_size;
+        ur->cq_size = ur->sq_size;
+    }
+    ur->sq_ptr = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ur->ring_fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ptr == MAP_FAILED) {
+        ur->sq_ptr = NULL;
+        return ERROR;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ptr = ur->sq_ptr;
+    } else {
+        ur->cq_ptr = mmap(NULL, ur->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ur->ring_fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ptr == MAP_FAILED) {
+            ur->cq_ptr = NULL;
+            return ERROR;
+        }
+    }
+    ur->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ur->ring_fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        return ERROR;
+    }
+
+    char *sq = ur->sq_ptr;
+    ur->sq_head = (unsigned *) (sq + p->sq_off.head);
+    ur->sq_tail = (unsigned *) (sq + p->sq_off.tail);
+    ur->sq_mask = *(unsigned *) (sq + p->sq_off.ring_mask);
+    ur->sq_entries = *(unsigned *) (sq + p->sq_off.ring_entries);
+    unsigned *array = (unsigned *) (sq + p->sq_off.array);
+    for (unsigned i = 0; i < ur->sq_entries; i++)
+        array[i] = i;
+    ur->sq_local_tail = *ur->sq_tail;
+
+    char *cq = ur->cq_ptr;
+    ur->cq_head = (unsigned *) (cq + p->cq_off.head);
+    ur->cq_tail = (unsigned *) (cq + p->cq_off.tail);
+    ur->cq_mask = *(unsigned *) (cq + p->cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+    return SUCCESS;
+}
+
+static int registerBufferRing(uring_backend_t *ur) {
+    ur->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ur->buf_ring = mmap(NULL, ur->buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ur->buf_ring == MAP_FAILED) {
+        ur->buf_ring = NULL;
+        return ERROR;
+    }
+    ur->buf_base = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ur->buf_base == NULL)
+        return ERROR;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ur->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (uringRegister(ur->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return ERROR;
+
+    ur->buf_tail = 0;
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+        provideBuffer(ur, (unsigned short) i);
+    __atomic_store_n(&ur->buf_ring->tail, ur->buf_tail, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+event_backend_t *create_uring_backend(int max_fds) {
+    if (!kernelAtLeast(6, 0))
+        return NULL;
+    uring_backend_t *ur = calloc(1, sizeof(uring_backend_t));
+    if (ur == NULL)
+        return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    ur->ring_fd = uringSetup(URING_ENTRIES, &p);
+    if (ur->ring_fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        ur->ring_fd = uringSetup(URING_ENTRIES, &p);
+    }
+    if (ur->ring_fd < 0
+        || !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)
+        || mapRings(ur, &p) < 0 || registerBufferRing(ur) < 0) {
+        uringDestroy(&ur->base);
+        return NULL;
+    }
+
+    ur->base.name = "io_uring";
+    ur->base.edge_triggered = 1;
+    ur->base.max_fds = max_fds;
+    ur->base.add = uringAdd;
+    ur->base.modify = uringModify;
+    ur->base.remove = uringRemove;
+    ur->base.wait = uringWait;
+    ur->base.destroy = uringDestroy;
+    ur->base.submit_write = uringSubmitWrite;
+    return &ur->base;
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "websocket.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define ERROR (-1)
+
+/* Appended to the client's key before hashing it into Sec-WebSocket-Accept. */
+#define ACCEPT_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+/* More header lines than any browser sends. */
+#define UPGRADE_LINES_MAX 64
+
+/* Does the comma separated list value[0..len) hold token, in any case? */
+static int hasToken(const char *value, int len, const char *token) {
+    int tokenLen = (int) strlen(token);
+    int i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+            i++;
+        int start = i;
+        while (i < len && value[i] != ',')
+            i++;
+        int end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+            end--;
+        if (end - start == tokenLen && strncasecmp(value + start, token, tokenLen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int ws_upgrade_line(ws_upgrade_t *upgrade, const char *line, int len) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        len--;
+    if (len == 0)
+        return upgrade->lines > 0 ? 1 : 0;
+    if (++upgrade->lines > UPGRADE_LINES_MAX)
+        return ERROR;
+    if (upgrade->lines == 1) {
+        upgrade->get = len > 4 && memcmp(line, "GET ", 4) == 0;
+        return 0;
+    }
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL)
+        return 0;
+    int nameLen = (int) (colon - line);
+    const char *value = colon + 1;
+    int valueLen = len - nameLen - 1;
+    while (valueLen > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        valueLen--;
+    }
+    while (valueLen > 0 && (value[valueLen - 1] == ' ' || value[valueLen - 1] == '\t'))
+        valueLen--;
+    if (nameLen == 7 && strncasecmp(line, "Upgrade", 7) == 0)
+        upgrade->upgrade = hasToken(value, valueLen, "websocket");
+    else if (nameLen == 21 && strncasecmp(line, "Sec-WebSocket-Version", 21) == 0)
+        upgrade->version = valueLen == 2 && memcmp(value, "13", 2) == 0;
+    else if (nameLen == 17 && strncasecmp(line, "Sec-WebSocket-Key", 17) == 0 && valueLen <= WS_KEY_MAX) {
+        memcpy(upgrade->key, value, valueLen);
+        upgrade->key[valueLen] = '\0';
+    }
+    return 0;
+}
+
+int ws_upgrade_answer(const ws_upgrade_t *upgrade, char *out, int max) {
+    /* a key is 16 random bytes in base64 */
+    if (!upgrade->get || !upgrade->upgrade || !upgrade->version || strlen(upgrade->key) != 24) {
+        int len = snprintf(out, max, "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\n"
+                                     "Content-Length: 0\r\nConnection: close\r\n\r\n");
+        return -len;
+    }
+    char keyed[WS_KEY_MAX + sizeof(ACCEPT_GUID)];
+    int keyedLen = snprintf(keyed, sizeof(keyed), "%s%s", upgrade->key, ACCEPT_GUID);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *) keyed, keyedLen, digest);
+    char accept[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+    EVP_EncodeBlock((unsigned char *) accept, digest, SHA_DIGEST_LENGTH);
+    return snprintf(out, max, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                              "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+}
+
+int ws_header_encode(char *out, uint64_t length, int opcode) {
+    unsigned char *p = (unsigned char *) out;
+    p[0] = 0x80 | (unsigned char) opcode;
+    if (length < 126) {
+        p[1] = (unsigned char) length;
+        return 2;
+    }
+    if (length <= 0xffff) {
+        p[1] = 126;
+        p[2] = (unsigned char) (length >> 8);
+        p[3] = (unsigned char) length;
+        return 4;
+    }
+    p[1] = 127;
+    for (int i = 0; i < 8; i++)
+        p[2 + i] = (unsigned char) (length >> (56 - 8 * i));
+    return 10;
+}
+
+int ws_header_decode(const char *p, int avail, ws_header_t *header) {
+    const unsigned char *u = (const unsigned char *) p;
+    if (avail < 2)
+        return 0;
+    /* no extension was negotiated, so no reserved bit may be set; clients must mask */
+    if ((u[0] & 0x70) != 0 || (u[1] & 0x80) == 0)
+        return ERROR;
+    int len7 = u[1] & 0x7f;
+    int need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+    if (avail < need)
+        return 0;
+    header->fin = u[0] >> 7;
+    header->opcode = u[0] & 0x0f;
+    if (len7 == 126) {
+        header->length = (uint64_t) u[2] << 8 | u[3];
+    } else if (len7 == 127) {
+        header->length = 0;
+        for (int i = 0; i < 8; i++)
+            header->length = header->length << 8 | u[2 + i];
+        if (header->length >> 63)
+            return ERROR;
+    } else {
+        header->length = (uint64_t) len7;
+    }
+    memcpy(header->mask, u + need - 4, 4);
+    switch (header->opcode) {
+        case WS_CONTINUATION:
+        case WS_TEXT:
+        case WS_BINARY:
+            return need;
+        case WS_CLOSE:
+        case WS_PING:
+        case WS_PONG:
+            return header->fin && header->length <= WS_CONTROL_MAX ? need : ERROR;
+        default:
+            return ERROR;
+    }
+}
+
+/* len may be anything, but data must start on a multiple of 4 from the frame start */
+static void unmaskScalar(char *data, size_t len, const unsigned char mask[4]) {
+    size_t i = 0;
+    uint64_t wide;
+    memcpy(&wide, mask, 4);
+    memcpy((char *) &wide + 4, mask, 4);
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= wide;
+        memcpy(data + i, &word, 8);
+    }
+    for (; i < len; i++)
+        data[i] ^= (char) mask[i & 3];
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void unmaskSse2(char *data, size_t len, const unsigned char mask[4]) {
+    int32_t word;
+    memcpy(&word, mask, 4);
+    const __m128i key = _mm_set1_epi32(word);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        _mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(chunk, key));
+    }
+    unmaskScalar(data + i, len - i, mask);
+}
+
+__attribute__((target("avx2")))
+static void unmaskAvx2(char *data, size_t len, const unsigned char mask[4]) {
+    int32_t word;
+    memcpy(&word, mask, 4);
+    const __m256i key = _mm256_set1_epi32(word);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        _mm256_storeu_si256((__m256i *) (data + i), _mm256_xor_si256(chunk, key));
+    }
+    unmaskSse2(data + i, len - i, mask);
+}
+
+#endif
+
+static void (*unmaskImpl)(char *, size_t, const unsigned char *) = unmaskScalar;
+
+/* Pick the widest implementation the CPU supports, once at startup. */
+__attribute__((constructor))
+static void selectUnmask(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        unmaskImpl = unmaskAvx2;
+    else if (__builtin_cpu_supports("sse2"))
+        unmaskImpl = unmaskSse2;
+#endif
+}
+
+void ws_unmask(char *data, size_t len, const unsigned char mask[4]) {
+    unmaskImpl(data, len, mask);
+}
+
+int ws_utf8_valid(const char *data, size_t len) {
+    const unsigned char *s = (const unsigned char *) data;
+    size_t i = 0;
+    while (i < len) {
+        /* chat is mostly ASCII, skip it a word at a time */
+        if (i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if ((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        int follow;
+        unsigned char low = 0x80, high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            follow = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            follow = 2;
+            /* no overlong forms, no surrogates */
+            if (c == 0xe0)
+                low = 0xa0;
+            else if (c == 0xed)
+                high = 0x9f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            follow = 3;
+            /* no overlong forms, nothing past U+10FFFF */
+            if (c == 0xf0)
+                low = 0x90;
+            else if (c == 0xf4)
+                high = 0x8f;
+        } else {
+            return 0;
+        }
+        if (len - i <= (size_t) follow)
+            return 0;
+        if (s[i + 1] < low || s[i + 1] > high)
+            return 0;
+        for (int k = 2; k <= follow; k++) {
+            if ((s[i + k] & 0xc0) != 0x80)
+                return 0;
+        }
+        i += follow + 1;
+    }
+    return 1;
+}
@@ -0,0 +1,95 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * WebSocket (RFC 6455) for browser clients, on a listener of its own.
+ *
+ * A connection starts with an HTTP upgrade request, answered with "101
+ * Switching Protocols". From then on every message is a frame: the client's
+ * frames are masked and read straight into a body like binary frames, the
+ * server's are unmasked and built once per message (see msg_body_t).
+ * Fragmented messages are not supported, browsers do not send them.
+ */
+
+/* Opcodes. */
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xa
+/* Not an opcode: bytes queued to a WebSocket connection without a frame header (the HTTP answer). */
+#define WS_RAW (-1)
+
+/* Longest header of a frame sent by the server, and of one sent by a client (with the mask). */
+#define WS_HEADER_MAX 10
+#define WS_CLIENT_HEADER_MAX 14
+/* Longest payload of a control frame. */
+#define WS_CONTROL_MAX 125
+/* Longest Sec-WebSocket-Key kept, a valid one has 24 characters. */
+#define WS_KEY_MAX 64
+
+typedef struct ws_header {
+    int fin;
+    int opcode;
+    uint64_t length;
+    unsigned char mask[4];
+} ws_header_t;
+
+/*
+ * What is known of an upgrade request while its header lines arrive.
+ */
+typedef struct ws_upgrade {
+    /* Lines seen so far, the request line included. */
+    int lines;
+    /* Non-zero once the request line was a GET, and once "Upgrade: websocket" and version 13 were seen. */
+    int get;
+    int upgrade;
+    int version;
+    char key[WS_KEY_MAX + 1];
+} ws_upgrade_t;
+
+/*
+ * Take one line (with its "\r\n") of an upgrade request.
+ * @ return value - 1 once the request is complete, 0 while lines are
+ *   missing, -1 if it is too long to be one
+ */
+int ws_upgrade_line(ws_upgrade_t *upgrade, const char *line, int len);
+
+/*
+ * Write the answer to a complete upgrade request to out: "101 Switching
+ * Protocols" if it was a valid WebSocket request, "400 Bad Request" if not.
+ * @ max - size of out, 256 bytes are plenty
+ * @ return value - length of the answer, negated for a 400
+ */
+int ws_upgrade_answer(const ws_upgrade_t *upgrade, char *out, int max);
+
+/*
+ * Write the header of a final, unmasked frame to out, which has room for
+ * WS_HEADER_MAX bytes.
+ * @ return value - length of the header
+ */
+int ws_header_encode(char *out, uint64_t length, int opcode);
+
+/*
+ * Parse the header of a client frame at the start of p[0..avail).
+ * @ return value - length of the header, 0 if it is not complete yet, -1 if
+ *   it breaks the protocol (reserved bits, no mask, a long control frame)
+ */
+int ws_header_decode(const char *p, int avail, ws_header_t *header);
+
+/*
+ * XOR data[0..len) with the mask of its frame, 32 or 16 bytes at a time
+ * where the CPU has AVX2 or SSE2.
+ */
+void ws_unmask(char *data, size_t len, const unsigned char mask[4]);
+
+/*
+ * Is data[0..len) valid UTF-8, so it can go out as a text frame?
+ */
+int ws_utf8_valid(const char *data, size_t len);
+
+#endif
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "worker.h"
+
+#define SUCCESS 0
+#define ERROR (-1)
+
+void mpsc_init(mpsc_queue_t *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node_t *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+mpsc_node_t *mpsc_pop(mpsc_queue_t *q) {
+    mpsc_node_t *tail = q->tail;
+    mpsc_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    /* tail is the last node: a producer may be half way through a push */
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+int init_worker(worker_t *w, int id, worker_group_t *group, conn_pool_t *pool, int listen_sd) {
+    w->id = id;
+    w->group = group;
+    w->pool = pool;
+    w->listen_sd = listen_sd;
+    w->accept_pending = 0;
+    w->ws_listen_sd = -1;
+    w->ws_accept_pending = 0;
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wake_fd < 0)
+        return ERROR;
+    mpsc_init(&w->inbox);
+    atomic_init(&w->wakeup_pending, 0);
+    pool->worker = w;
+    return SUCCESS;
+}
+
+static void freeForward(forward_msg_t *fwd) {
+    if (fwd->slab != NULL)
+        slab_free(fwd->slab, fwd);
+    else
+        free(fwd);
+}
+
+void destroy_worker(worker_t *w) {
+    mpsc_node_t *node;
+    while ((node = mpsc_pop(&w->inbox)) != NULL) {
+        forward_msg_t *fwd = (forward_msg_t *) node;
+        msg_body_unref(fwd->body);
+        freeForward(fwd);
+    }
+    close(w->wake_fd);
+}
+
+void worker_wake(worker_t *w) {
+    uint64_t one = 1;
+    while (write(w->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+void worker_post(worker_t *w, forward_msg_t *fwd) {
+    mpsc_push(&w->inbox, &fwd->node);
+    /* one eventfd write per batch: skip it while the worker has not drained yet */
+    if (!atomic_exchange_explicit(&w->wakeup_pending, 1, memory_order_acq_rel))
+        worker_wake(w);
+}
+
+int worker_forward(worker_t *w, msg_body_t *body) {
+    worker_group_t *group = w->group;
+    int status = SUCCESS;
+    for (int i = 0; i < group->nr_workers; i++) {
+        worker_t *peer = &group->workers[i];
+        /* rooms without members on the peer cost it nothing, unless it keeps their history */
+        if (peer == w || (w->pool->registry->history_msgs == 0
+                          && room_present(w->pool->registry, body->room, peer->id) == 0))
+            continue;
+        forward_msg_t *fwd = slab_alloc(&w->pool->arena.forwards);
+        if (fwd == NULL) {
+            status = ERROR;
+            continue;
+        }
+        fwd->slab = &w->pool->arena.forwards;
+        fwd->body = msg_body_ref(body);
+        fwd->ingest = 0;
+        worker_post(peer, fwd);
+    }
+    return status;
+}
+
+void worker_drain_inbox(worker_t *w) {
+    uint64_t count;
+    while (read(w->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+    /* clear the flag before draining, so a push racing with us signals again */
+    atomic_exchange_explicit(&w->wakeup_pending, 0, memory_order_acq_rel);
+    mpsc_node_t *node;
+    while ((node = mpsc_pop(&w->inbox)) != NULL) {
+        forward_msg_t *fwd = (forward_msg_t *) node;
+        if (fwd->ingest) {
+            /* takes over the reference */
+            add_peer_body(fwd->body, w->pool);
+        } else {
+            add_body(-1, fwd->body, w->pool);
+            msg_body_unref(fwd->body);
+        }
+        freeForward(fwd);
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "chatServer.h"
+
+/*
+ * Intrusive node of an mpsc_queue_t.
+ */
+typedef struct mpsc_node {
+    _Atomic(struct mpsc_node *) next;
+} mpsc_node_t;
+
+/*
+ * Unbounded lock-free multi-producer single-consumer queue (Vyukov).
+ *
+ * Any thread may push, only the owning worker pops. Producers never wait on
+ * each other or on the consumer: a push is one atomic exchange.
+ */
+typedef struct mpsc_queue {
+    /* Most recently pushed node, producers swap themselves in here. */
+    _Atomic(mpsc_node_t *) head;
+    /* Oldest node not yet popped, only touched by the consumer. */
+    mpsc_node_t *tail;
+    /* Placeholder keeping the queue non-empty. */
+    mpsc_node_t stub;
+} mpsc_queue_t;
+
+/*
+ * A message body forwarded from one worker to another.
+ */
+typedef struct forward_msg {
+    mpsc_node_t node;
+    msg_body_t *body;
+    /* Slab of the sending worker, the receiver gives the node back to it. NULL if it was malloc'ed. */
+    slab_pool_t *slab;
+    /* Non-zero for a message of another node, which the receiver publishes instead of only fanning it out. */
+    int ingest;
+} forward_msg_t;
+
+/*
+ * One reactor thread. Every worker owns its own listening socket (bound with
+ * SO_REUSEPORT so the kernel spreads new connections across them), its own
+ * event backend and its own pool of connections, exactly like the single
+ * threaded server. Lines read by a worker are fanned out to its own clients
+ * directly and handed to every other worker through that worker's inbox.
+ */
+typedef struct worker {
+    /* Index of this worker in its group. */
+    int id;
+    pthread_t thread;
+    /* Listening socket of this worker. */
+    int listen_sd;
+    /* Non-zero while the listener may have connections left to accept. */
+    int accept_pending;
+    /* WebSocket listening socket of this worker, -1 without --ws-port, and its accept_pending. */
+    int ws_listen_sd;
+    int ws_accept_pending;
+    /* eventfd the worker's backend watches to notice a non-empty inbox. */
+    int wake_fd;
+    /* Connections owned by this worker. */
+    conn_pool_t *pool;
+    /* Messages forwarded by other workers. */
+    mpsc_queue_t inbox;
+    /* Non-zero once the eventfd was signalled and the inbox not yet drained. */
+    atomic_int wakeup_pending;
+    /* All workers of the server, this one included. */
+    struct worker_group *group;
+} worker_t;
+
+typedef struct worker_group {
+    int nr_workers;
+    worker_t *workers;
+} worker_group_t;
+
+/*
+ * Init an empty queue.
+ */
+void mpsc_init(mpsc_queue_t *q);
+
+/*
+ * Push a node, callable from any thread.
+ */
+void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node);
+
+/*
+ * Pop the oldest node, only callable from the consumer.
+ * @ return value - the node, NULL if the queue is (momentarily) empty
+ */
+mpsc_node_t *mpsc_pop(mpsc_queue_t *q);
+
+/*
+ * Init a worker: create its eventfd and empty inbox.
+ * @ return value - 0 on success, -1 on failure
+ */
+int init_worker(worker_t *w, int id, worker_group_t *group, conn_pool_t *pool, int listen_sd);
+
+/*
+ * Release everything a worker owns that init_worker created, and drop the
+ * messages still waiting in its inbox.
+ */
+void destroy_worker(worker_t *w);
+
+/*
+ * Wake a worker blocked in its backend wait.
+ */
+void worker_wake(worker_t *w);
+
+/*
+ * Put a message in the inbox of w, waking it unless a wakeup is pending
+ * already. Callable from any thread.
+ */
+void worker_post(worker_t *w, forward_msg_t *fwd);
+
+/*
+ * Hand a message body to every worker of the group, except the origin, that
+ * has members in the body's room. With room histories on, every worker gets
+ * it.
+ * Each receiving worker gets its own reference.
+ * @ w - the worker that read the message
+ * @ body - the message
+ * @ return value - 0 on success, -1 on failure
+ */
+int worker_forward(worker_t *w, msg_body_t *body);
+
+/*
+ * Fan out every message waiting in the worker's inbox to its connections.
+ * Called when wake_fd becomes readable.
+ */
+void worker_drain_inbox(worker_t *w);
+
+#endif